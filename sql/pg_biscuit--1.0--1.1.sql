@@ -0,0 +1,57 @@
+-- pg_biscuit--1.0--1.1.sql
+-- Upgrade script for Biscuit Index Access Method from 1.0 to 1.1
+--
+-- Adds:
+-- - biscuit_prewarm() to load an index ahead of the first query
+-- - biscuit_count() to count LIKE matches from the index
+-- - NOT LIKE, NOT ILIKE and regular expression operators to biscuit_text_ops
+
+-- Complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_biscuit UPDATE TO '1.1'" to load this file. \quit
+
+-- ==================== MAINTENANCE FUNCTIONS ====================
+
+-- Function to load an index into memory ahead of the first query
+CREATE FUNCTION biscuit_prewarm(regclass)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'biscuit_prewarm'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION biscuit_prewarm(regclass) IS
+'Loads a Biscuit index into memory (and into shared memory when preloaded) and returns the number of live records.
+Usage: SELECT biscuit_prewarm(''index_name'');';
+
+-- ==================== QUERY FUNCTIONS ====================
+
+-- Function to count LIKE matches from the index bitmaps
+CREATE FUNCTION biscuit_count(index regclass, pattern text, visible_only bool DEFAULT false)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'biscuit_count'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION biscuit_count(regclass, text, bool) IS
+'Counts the rows whose indexed value matches a LIKE pattern without scanning the table.
+By default counts all indexed row versions, including dead ones not yet vacuumed; with visible_only, counts the rows visible to the current snapshot.
+Usage: SELECT biscuit_count(''index_name'', ''%pattern%'', true);';
+
+-- ==================== OPERATOR CLASSES ====================
+
+-- Existing indexes pick up the new strategies without a rebuild
+ALTER OPERATOR FAMILY biscuit_text_ops USING biscuit ADD
+    OPERATOR 3 !~~ (text, text),         -- NOT LIKE operator
+    OPERATOR 4 !~~* (text, text),        -- NOT ILIKE operator
+    OPERATOR 5 ~ (text, text),           -- regular expression match (rechecked)
+    OPERATOR 6 ~* (text, text);          -- case-insensitive regular expression match (rechecked)
+
+COMMENT ON OPERATOR CLASS biscuit_text_ops USING biscuit IS
+'Default operator class for Biscuit indexes on text columns - supports LIKE, ILIKE, NOT LIKE, NOT ILIKE and regular expression queries';
+
+-- ==================== GRANT PERMISSIONS ====================
+
+GRANT EXECUTE ON FUNCTION biscuit_prewarm(regclass) TO PUBLIC;
+GRANT EXECUTE ON FUNCTION biscuit_count(regclass, text, bool) TO PUBLIC;
+
+-- ==================== VERSION INFO ====================
+
+INSERT INTO biscuit_version (version, description) VALUES
+    ('1.1', 'biscuit_prewarm, biscuit_count, NOT LIKE, NOT ILIKE and regular expression operators');
@@ -1,4 +1,4 @@
--- pg_biscuit--1.0.sql
+-- pg_biscuit--1.1.sql
 -- SQL installation script for Biscuit Index Access Method
 -- PostgreSQL 15+ compatible with full CRUD support
 --
@@ -52,6 +52,31 @@ COMMENT ON FUNCTION biscuit_index_stats(oid) IS
 'Returns detailed statistics for a Biscuit index including CRUD counts, tombstones, and memory usage.
 Usage: SELECT biscuit_index_stats(''index_name''::regclass::oid);';
 
+-- ==================== MAINTENANCE FUNCTIONS ====================
+
+-- Function to load an index into memory ahead of the first query
+CREATE FUNCTION biscuit_prewarm(regclass)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'biscuit_prewarm'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION biscuit_prewarm(regclass) IS
+'Loads a Biscuit index into memory (and into shared memory when preloaded) and returns the number of live records.
+Usage: SELECT biscuit_prewarm(''index_name'');';
+
+-- ==================== QUERY FUNCTIONS ====================
+
+-- Function to count LIKE matches from the index bitmaps
+CREATE FUNCTION biscuit_count(index regclass, pattern text, visible_only bool DEFAULT false)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'biscuit_count'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION biscuit_count(regclass, text, bool) IS
+'Counts the rows whose indexed value matches a LIKE pattern without scanning the table.
+By default counts all indexed row versions, including dead ones not yet vacuumed; with visible_only, counts the rows visible to the current snapshot.
+Usage: SELECT biscuit_count(''index_name'', ''%pattern%'', true);';
+
 -- ==================== OPERATOR CLASSES ====================
 
 -- Default operator class for text types (text, varchar, bpchar)
@@ -59,10 +84,14 @@ CREATE OPERATOR CLASS biscuit_text_ops
 DEFAULT FOR TYPE text USING biscuit AS
     OPERATOR 1 ~~ (text, text),          -- LIKE operator
     OPERATOR 2 ~~* (text, text),         -- ILIKE operator (case-insensitive)
+    OPERATOR 3 !~~ (text, text),         -- NOT LIKE operator
+    OPERATOR 4 !~~* (text, text),        -- NOT ILIKE operator
+    OPERATOR 5 ~ (text, text),           -- regular expression match (rechecked)
+    OPERATOR 6 ~* (text, text),          -- case-insensitive regular expression match (rechecked)
     FUNCTION 1 biscuit_like_support(internal);
 
 COMMENT ON OPERATOR CLASS biscuit_text_ops USING biscuit IS
-'Default operator class for Biscuit indexes on text columns - supports LIKE and ILIKE queries';
+'Default operator class for Biscuit indexes on text columns - supports LIKE, ILIKE, NOT LIKE, NOT ILIKE and regular expression queries';
 
 -- ==================== HELPER VIEWS ====================
 
@@ -119,6 +148,9 @@ SELECT * FROM users WHERE LOWER(username) LIKE '%admin%';
 -- Get index statistics
 SELECT biscuit_index_stats('idx_username'::regclass::oid);
 
+-- Count matches from the index alone
+SELECT biscuit_count('idx_username', '%admin%', true);
+
 -- View all Biscuit indexes
 SELECT * FROM biscuit_indexes;
 
@@ -140,6 +172,8 @@ REINDEX INDEX idx_username;     -- Rebuild if needed
 
 -- Grant execute on functions to public (read-only diagnostic function)
 GRANT EXECUTE ON FUNCTION biscuit_index_stats(oid) TO PUBLIC;
+GRANT EXECUTE ON FUNCTION biscuit_prewarm(regclass) TO PUBLIC;
+GRANT EXECUTE ON FUNCTION biscuit_count(regclass, text, bool) TO PUBLIC;
 
 -- ==================== VERSION INFO ====================
 
@@ -151,7 +185,8 @@ CREATE TABLE IF NOT EXISTS biscuit_version (
 );
 
 INSERT INTO biscuit_version (version, description) VALUES
-    ('1.0', 'Initial release with full CRUD support, O(1) deletion, and automatic cleanup');
+    ('1.0', 'Initial release with full CRUD support, O(1) deletion, and automatic cleanup'),
+    ('1.1', 'biscuit_prewarm, biscuit_count, NOT LIKE, NOT ILIKE and regular expression operators');
 
 COMMENT ON TABLE biscuit_version IS
 'Version history for the Biscuit IAM extension';
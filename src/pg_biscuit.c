@@ -8,7 +8,7 @@
  * 3. Avoid redundant bitmap copies
  * 4. Optimize single-part patterns
  * 5. Skip unnecessary length bitmap operations
- * 6. TID sorting for sequential heap access
+ * 6. Streaming TIDs in heap order from the result bitmap as the executor fetches them
  * 7. Batch TID insertion for bitmap scans
  * 8. Direct Roaring bitmap iteration without intermediate arrays
  * 9. Parallel bitmap heap scan support
@@ -16,22 +16,65 @@
  */
 
  #include "postgres.h"
+ 
+ #include <ctype.h>
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+ 
  #include "access/amapi.h"
  #include "access/generic_xlog.h"
+ #include "access/htup_details.h"
+ #include "access/parallel.h"
  #include "access/reloptions.h"
  #include "access/relscan.h"
  #include "access/tableam.h"
+ #include "access/visibilitymap.h"
  #include "access/table.h"
+ #include "access/xact.h"
+ #include "access/xloginsert.h"
  #include "catalog/index.h"
+ #include "catalog/namespace.h"
+ #include "catalog/objectaccess.h"
+ #include "catalog/pg_class.h"
+ #include "catalog/pg_collation.h"
+ #include "catalog/pg_type.h"
+ #include "common/file_utils.h"
+ #include "common/relpath.h"
+ #include "commands/progress.h"
+ #include "lib/dshash.h"
+ #include "mb/pg_wchar.h"
  #include "miscadmin.h"
  #include "nodes/pathnodes.h"
  #include "optimizer/optimizer.h"
+ #include "optimizer/planner.h"
+ #include "pgstat.h"
+ #include "regex/regexport.h"
+ #include "postmaster/bgworker.h"
+ #include "storage/buffile.h"
  #include "storage/bufmgr.h"
+ #include "storage/fd.h"
  #include "storage/indexfsm.h"
+ #include "storage/ipc.h"
  #include "storage/lmgr.h"
+ #include "storage/lwlock.h"
+ #include "storage/sharedfileset.h"
+ #include "storage/shmem.h"
+ #include "storage/spin.h"
+ #include "utils/acl.h"
+ #include "utils/array.h"
  #include "utils/builtins.h"
+ #include "utils/dsa.h"
+ #include "utils/guc.h"
+ #include "utils/hsearch.h"
+ #include "utils/lsyscache.h"
  #include "utils/memutils.h"
+ #include "utils/pg_locale.h"
+ #include "utils/regproc.h"
  #include "utils/rel.h"
+ #include "utils/selfuncs.h"
+ #include "utils/snapmgr.h"
+ #include "utils/syscache.h"
+ #include "utils/timestamp.h"
  
  #ifdef HAVE_ROARING
  #include "roaring.h"
@@ -49,37 +92,163 @@
  /* Forward declarations */
  PG_FUNCTION_INFO_V1(biscuit_handler);
  PG_FUNCTION_INFO_V1(biscuit_index_stats);
+ PG_FUNCTION_INFO_V1(biscuit_prewarm);
+ PG_FUNCTION_INFO_V1(biscuit_count);
+ 
+ /* Entry point of parallel index build workers */
+ PGDLLEXPORT void biscuit_parallel_build_main(dsm_segment *seg, shm_toc *toc);
+ 
+ /* Entry point of the startup prewarm workers */
+ PGDLLEXPORT void biscuit_prewarm_main(Datum main_arg);
  
  /* Forward declare Roaring functions */
  static inline RoaringBitmap* biscuit_roaring_create(void);
  static inline void biscuit_roaring_add(RoaringBitmap *rb, uint32_t value);
+ static inline void biscuit_roaring_add_many(RoaringBitmap *rb, size_t n, const uint32_t *values);
  static inline void biscuit_roaring_remove(RoaringBitmap *rb, uint32_t value);
+ static inline bool biscuit_roaring_contains(const RoaringBitmap *rb, uint32_t value);
  static inline uint64_t biscuit_roaring_count(const RoaringBitmap *rb);
  static inline bool biscuit_roaring_is_empty(const RoaringBitmap *rb);
  static inline void biscuit_roaring_free(RoaringBitmap *rb);
  static inline RoaringBitmap* biscuit_roaring_copy(const RoaringBitmap *rb);
  static inline void biscuit_roaring_and_inplace(RoaringBitmap *a, const RoaringBitmap *b);
+ static inline RoaringBitmap* biscuit_roaring_and(const RoaringBitmap *a, const RoaringBitmap *b);
  static inline void biscuit_roaring_or_inplace(RoaringBitmap *a, const RoaringBitmap *b);
  static inline void biscuit_roaring_andnot_inplace(RoaringBitmap *a, const RoaringBitmap *b);
+ static inline void biscuit_roaring_or_offset(RoaringBitmap *a, const RoaringBitmap *b, uint32_t offset);
+ static inline void biscuit_roaring_or_remap(RoaringBitmap *a, const RoaringBitmap *b,
+                                             const uint32_t *starts, const uint32_t *offsets, int n);
  static inline uint32_t* biscuit_roaring_to_array(const RoaringBitmap *rb, uint64_t *count);
+ static inline Size biscuit_roaring_serialized_size(const RoaringBitmap *rb);
+ static inline void biscuit_roaring_serialize(const RoaringBitmap *rb, char *buf);
+ static inline RoaringBitmap* biscuit_roaring_deserialize(const char *buf, Size len);
+ static inline RoaringBitmap* biscuit_roaring_deserialize_frozen(const char *buf, Size len);
+ static inline bool biscuit_roaring_is_frozen(const RoaringBitmap *rb);
+ static inline bool biscuit_roaring_intersects(const RoaringBitmap *a, const RoaringBitmap *b);
+ static inline RoaringBitmap* biscuit_roaring_thaw(RoaringBitmap **rb);
+ static inline void biscuit_roaring_optimize(RoaringBitmap *rb);
+ static inline uint64_t biscuit_roaring_range_count(const RoaringBitmap *rb, uint64_t lo, uint64_t hi);
  
  /* Index metapage and page structures */
  #define BISCUIT_MAGIC 0x42495343  /* "BISC" */
+ #define BISCUIT_SNAPSHOT_MAGIC 0x424E5053  /* "BSNP" */
+ #define BISCUIT_MAP_MAGIC 0x424D4150  /* "BMAP" */
  #define BISCUIT_VERSION 1
  #define BISCUIT_METAPAGE_BLKNO 0
+ #define BISCUIT_PAGE_ID 0xFF84
  #define MAX_POSITIONS 256
  #define CHAR_RANGE 256
  #define TOMBSTONE_CLEANUP_THRESHOLD 1000
+ #define LOG_COMPACTION_MIN_BYTES (1024 * 1024)
+ #define TID_ORDER_MIN_UNORDERED 1024
+ #define BISCUIT_END_OF_LIST PG_INT32_MAX
  
+ /* Operator strategies of biscuit_text_ops */
+ #define BISCUIT_LIKE_STRATEGY 1     /* ~~ */
+ #define BISCUIT_ILIKE_STRATEGY 2    /* ~~* */
+ #define BISCUIT_NOT_LIKE_STRATEGY 3     /* !~~ */
+ #define BISCUIT_NOT_ILIKE_STRATEGY 4    /* !~~* */
+ #define BISCUIT_REGEX_STRATEGY 5        /* ~ */
+ #define BISCUIT_REGEX_ICASE_STRATEGY 6  /* ~* */
+ #define BISCUIT_NSTRATEGIES 6
+ 
+ /*
+  * On-disk layout
+  *
+  * Block 0 is the metapage.  Every other page belongs to one of two byte
+  * streams chained through BiscuitPageOpaqueData.next:
+  *
+  *  - the snapshot, a serialized BiscuitIndex written at build time and
+  *    whenever VACUUM compacts the index (see biscuit_serialize_index), and
+  *  - the change log, an append-only sequence of BiscuitLogRecords for the
+  *    inserts, tombstones and cleanups applied since the snapshot.
+  *
+  * Loading an index reads the snapshot and replays the log; the heap is
+  * never scanned.  Stream bytes live between the page header and pd_lower,
+  * which generic xlog relies on to skip the unused rest of each page.
+  *
+  * All page changes are WAL-logged through generic xlog.  Stream pages are
+  * logged before the metapage record that makes them reachable, so after a
+  * crash any bytes past the committed log end are simply ignored.
+  */
  typedef struct BiscuitMetaPageData {
      uint32 magic;
      uint32 version;
-     BlockNumber root;
+     BlockNumber root;           /* first page of the snapshot stream */
      uint32 num_records;
+     uint32 generation;          /* bumped whenever the snapshot is rewritten */
+     uint32 snapshot_pages;
+     uint64 snapshot_len;        /* bytes in the snapshot stream */
+     BlockNumber log_head;       /* first change-log page */
+     BlockNumber log_tail;       /* last change-log page */
+     uint32 log_tail_len;        /* committed bytes on log_tail */
+     uint32 log_pages;
+     uint64 log_len;             /* committed bytes in the change log */
+     uint64 log_seq;             /* sequence number of the last logged change */
+     uint64 snapshot_id;         /* random; names the snapshot's mapped file */
+     uint32 flags;               /* BISCUIT_META_* */
  } BiscuitMetaPageData;
  
  typedef BiscuitMetaPageData *BiscuitMetaPage;
  
+ #define BiscuitPageGetMeta(page) ((BiscuitMetaPage) PageGetContents(page))
+ 
+ /* Metapage flags, fixed when the index is built */
+ #define BISCUIT_META_TID_KEYS   (1 << 0)    /* bitmaps hold heap TIDs (keys = tid) */
+ 
+ /* Page flags */
+ #define BISCUIT_META_PAGE       (1 << 0)
+ #define BISCUIT_SNAPSHOT_PAGE   (1 << 1)
+ #define BISCUIT_LOG_PAGE        (1 << 2)
+ #define BISCUIT_DELETED_PAGE    (1 << 3)
+ 
+ typedef struct BiscuitPageOpaqueData {
+     BlockNumber next;           /* next page of the same stream */
+     uint16 flags;
+     uint16 page_id;             /* BISCUIT_PAGE_ID, for pg_filedump */
+ } BiscuitPageOpaqueData;
+ 
+ typedef BiscuitPageOpaqueData *BiscuitPageOpaque;
+ 
+ #define BiscuitPageGetOpaque(page) ((BiscuitPageOpaque) PageGetSpecialPointer(page))
+ #define BISCUIT_PAGE_DATA_SIZE \
+     (BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(BiscuitPageOpaqueData)))
+ #define BiscuitPageGetUsed(page) \
+     ((Size) (((PageHeader) (page))->pd_lower - MAXALIGN(SizeOfPageHeaderData)))
+ 
+ /* Change-log record types */
+ #define BISCUIT_LOG_INSERT      1
+ #define BISCUIT_LOG_TOMBSTONE   2
+ #define BISCUIT_LOG_CLEANUP     3
+ 
+ /*
+  * Change-log record header.  INSERT is followed by len bytes of the indexed
+  * string; TOMBSTONE is followed by nslots uint32 record slots.
+  */
+ typedef struct BiscuitLogRecord {
+     uint64 seq;
+     uint32 type;
+     uint32 rec_idx;
+     uint32 nslots;
+     int32 len;
+     ItemPointerData tid;
+ } BiscuitLogRecord;
+ 
+ /* Fixed-size header of a serialized snapshot */
+ typedef struct BiscuitSnapshotHeader {
+     uint32 magic;
+     int32 num_records;
+     int32 max_len;
+     int32 max_length;
+     int32 tombstone_count;
+     int32 free_count;
+     int64 insert_count;
+     int64 update_count;
+     int64 delete_count;
+     int32 ngram;            /* n of the stored n-gram layer, 1 if none */
+     int32 casefold;         /* whether the case-folded layer is stored */
+ } BiscuitSnapshotHeader;
+ 
  /* Position entry for character indices */
  typedef struct {
      int pos;
@@ -92,6 +261,17 @@
      int capacity;
  } CharIndex;
  
+ /* Key of a positional n-gram bitmap: the n bytes packed into gram */
+ typedef struct BiscuitNgramKey {
+     uint32 gram;
+     int32 pos;
+ } BiscuitNgramKey;
+ 
+ typedef struct BiscuitNgramEntry {
+     BiscuitNgramKey key;
+     RoaringBitmap *bitmap;
+ } BiscuitNgramEntry;
+ 
  /* In-memory index structure with CRUD support */
  typedef struct {
      CharIndex pos_idx[CHAR_RANGE];
@@ -113,134 +293,491 @@
      int free_capacity;
      int tombstone_count;
      
+     /* Records out of heap TID order, and the last TID that is in order */
+     RoaringBitmap *unordered;
+     ItemPointerData last_ordered;
+     
      /* Statistics */
      int64 insert_count;
      int64 update_count;
      int64 delete_count;
+     
+     bool tid_keys;          /* bitmaps hold packed heap TIDs, not slots */
+     
+     /* Optional positional n-gram layer, stored in the snapshot */
+     int ngram;              /* n, or 1 if the layer is off */
+     HTAB *ngram_idx;        /* BiscuitNgramKey -> BiscuitNgramEntry */
+     
+     /* Optional case-folded layer for ILIKE, stored the same way */
+     bool casefold;
+     HTAB *fold_idx;         /* (lowercase letter, pos) -> BiscuitNgramEntry */
+     RoaringBitmap *fold_cache[CHAR_RANGE];  /* by lowercase letter, like char_cache */
+     bool layers_derived;    /* a layer was built on load, not read from the snapshot */
+     
+     /* Persistence: owning context, snapshot image and change-log position */
+     MemoryContext context;
+     char *image;            /* snapshot bytes; loaded strings point into it */
+     uint64 image_len;
+     dsa_pointer shared_image;   /* BiscuitSharedImage holding image, if shared */
+     char *mapped;           /* mapped snapshot file holding image, if any */
+     Size mapped_len;
+     bool tids_shared;       /* tids still points into the shared image */
+     uint32 generation;      /* metapage generation this copy was loaded from */
+     uint64 applied_seq;     /* last change-log record applied */
+     BlockNumber log_blkno;  /* where to resume reading the change log */
+     uint32 log_off;
+     int refcount;           /* open scans using this copy */
+     List *streams;          /* BiscuitScanOpaques streaming from this copy */
+     bool retired;           /* replaced in the cache; free at last unpin */
  } BiscuitIndex;
  
+ /* Backend-local cache of loaded indexes, keyed by index OID */
+ typedef struct BiscuitCacheEntry {
+     Oid indexoid;
+     RelFileNumber relfilenumber;
+     BiscuitIndex *index;
+ } BiscuitCacheEntry;
+ 
+ static HTAB *biscuit_index_cache = NULL;
+ 
+ /* Copies replaced in the cache while scans still had them pinned */
+ static List *biscuit_retired_indexes = NIL;
+ 
+ /* Shared memory state, present only when loaded via shared_preload_libraries */
+ typedef struct BiscuitSharedState {
+     LWLock *lock;               /* serializes creation of the area */
+     int tranche_id;             /* for the area and the registry */
+     dsa_handle area;
+     dshash_table_handle registry;
+ } BiscuitSharedState;
+ 
+ typedef struct BiscuitRegistryKey {
+     Oid dbid;
+     Oid indexoid;
+ } BiscuitRegistryKey;
+ 
+ /* Registry entry: the current shared snapshot image of one index */
+ typedef struct BiscuitRegistryEntry {
+     BiscuitRegistryKey key;
+     RelFileNumber relfilenumber;    /* storage the image was read from */
+     uint32 generation;              /* metapage generation of the image */
+     dsa_pointer image;              /* BiscuitSharedImage */
+ } BiscuitRegistryEntry;
+ 
+ /* Header of a snapshot image in the DSA area; the bytes follow */
+ typedef struct BiscuitSharedImage {
+     pg_atomic_uint32 refcount;
+     uint64 len;
+ } BiscuitSharedImage;
+ 
+ #define BISCUIT_SHARED_IMAGE_HDRSZ MAXALIGN(sizeof(BiscuitSharedImage))
+ #define BiscuitSharedImageData(img) ((char *) (img) + BISCUIT_SHARED_IMAGE_HDRSZ)
+ 
+ static BiscuitSharedState *biscuit_shared = NULL;
+ static dsa_area *biscuit_area = NULL;
+ static dshash_table *biscuit_registry = NULL;
+ static shmem_request_hook_type prev_shmem_request_hook = NULL;
+ static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+ static object_access_hook_type prev_object_access_hook = NULL;
+ 
+ /* GUC: database:index entries to load at server start */
+ static char *biscuit_prewarm_indexes = NULL;
+ 
+ /* Reloptions */
+ typedef struct BiscuitOptions {
+     int32 vl_len_;              /* varlena header (do not touch directly!) */
+     int storage;                /* BISCUIT_STORAGE_* */
+     int ngram;                  /* n of the positional n-gram layer; 1 = off */
+     int keys;                   /* BISCUIT_KEYS_* */
+     bool casefold;              /* keep the case-folded layer for ILIKE */
+ } BiscuitOptions;
+ 
+ #define BISCUIT_STORAGE_PAGES 0     /* load snapshots into backend memory */
+ #define BISCUIT_STORAGE_MMAP 1      /* map snapshots from a file under pg_biscuit/ */
+ 
+ static relopt_enum_elt_def biscuit_storage_values[] = {
+     {"pages", BISCUIT_STORAGE_PAGES},
+     {"mmap", BISCUIT_STORAGE_MMAP},
+     {(const char *)NULL}
+ };
+ 
+ #define BISCUIT_KEYS_RECORD 0       /* bitmaps hold record slots */
+ #define BISCUIT_KEYS_TID 1          /* bitmaps hold packed heap TIDs */
+ 
+ static relopt_enum_elt_def biscuit_keys_values[] = {
+     {"record", BISCUIT_KEYS_RECORD},
+     {"tid", BISCUIT_KEYS_TID},
+     {(const char *)NULL}
+ };
+ 
+ static relopt_kind biscuit_relopt_kind;
+ 
+ #define BISCUIT_MAX_NGRAM 3
+ 
+ #define BiscuitGetNgram(index) \
+     ((index)->rd_options ? ((BiscuitOptions *) (index)->rd_options)->ngram : 1)
+ 
+ #define BiscuitUseCaseFold(index) \
+     ((index)->rd_options ? ((BiscuitOptions *) (index)->rd_options)->casefold : false)
+ 
+ /* Only consulted by a build; the index keeps what it was built with in its metapage */
+ #define BiscuitUseTidKeys(index) \
+     ((index)->rd_options && \
+      ((BiscuitOptions *) (index)->rd_options)->keys == BISCUIT_KEYS_TID)
+ 
+ /*
+  * Mapped files are a cache of the pages and are not WAL-logged, so only
+  * permanent indexes use them: an unlogged index is reset to its init fork
+  * after a crash, and a temporary one is private to its backend anyway.
+  */
+ #define BiscuitUseMappedSnapshot(index) \
+     ((index)->rd_options && \
+      ((BiscuitOptions *) (index)->rd_options)->storage == BISCUIT_STORAGE_MMAP && \
+      (index)->rd_rel->relpersistence == RELPERSISTENCE_PERMANENT)
+ 
+ /* Header of a mapped snapshot file; the snapshot stream follows */
+ typedef struct BiscuitMapHeader {
+     uint32 magic;
+     RelFileLocator locator;     /* storage the snapshot was copied from */
+     uint64 snapshot_id;         /* metapage snapshot_id of the copy */
+     uint64 len;                 /* bytes in the snapshot stream */
+ } BiscuitMapHeader;
+ 
+ #define BISCUIT_MAP_DIR "pg_biscuit"
+ #define BISCUIT_MAP_HDRSZ MAXALIGN(sizeof(BiscuitMapHeader))
+ 
+ /* Destination for serialized index bytes */
+ typedef struct {
+     void (*write) (void *arg, const void *data, Size len);
+     void *arg;
+ } BiscuitSink;
+ 
+ /* Cursor over an in-memory serialized image */
+ typedef struct {
+     const char *data;
+     uint64 len;
+     uint64 pos;
+     bool frozen;            /* image is read-only: load bitmaps as views into it */
+ } BiscuitImageReader;
+ 
+ /* Position in the change log during replay */
+ typedef struct {
+     Relation index;
+     BiscuitMetaPage meta;   /* committed end of the log */
+     BlockNumber blkno;
+     uint32 off;
+     Buffer buf;             /* pinned, unlocked page at blkno, if any */
+ } BiscuitLogReader;
+ 
+ /*
+  * Appends bytes to a chain of index pages.  Every page is WAL-logged as one
+  * generic xlog record when the writer moves past it.
+  */
+ typedef struct {
+     Relation index;
+     Buffer buf;             /* current page, exclusively locked */
+     GenericXLogState *state;
+     Page page;              /* working copy of buf registered in state */
+     uint16 flags;
+     BlockNumber first;
+     uint32 npages;
+     uint64 len;
+ } BiscuitPageWriter;
+ 
+ /* TIDs handed out per batch by a streaming scan */
+ #define BISCUIT_TID_BATCH 256
+ 
+ /* Fewest matches on a heap block for a bitmap scan to consider it whole */
+ #define BISCUIT_DENSE_PAGE_MIN_MATCHES 4
+ 
+ /* Cursor over a result bitmap */
+ typedef struct {
+ #ifdef HAVE_ROARING
+     roaring_uint32_iterator_t *iter;
+ #else
+     const RoaringBitmap *result;
+     uint32_t next;          /* next record to examine */
+ #endif
+ } BiscuitResultIter;
+ 
  /* Scan opaque structure */
  typedef struct {
      BiscuitIndex *index;
-     ItemPointerData *results;
+     MemoryContext context;  /* scan memory */
+     RoaringBitmap *result;  /* matches still being streamed, or NULL */
+     BiscuitResultIter iter;
+     ItemPointerData ahead[BISCUIT_TID_BATCH];   /* read from the stream, not yet merged */
+     const char *ahead_values[BISCUIT_TID_BATCH];
+     int ahead_len;
+     int ahead_pos;
+     ItemPointerData *delta; /* sorted TIDs of the out-of-order matches */
+     char **delta_values;
+     int delta_len;
+     int delta_pos;
+     bool dense;             /* matches at least half the records */
+     bool recheck;           /* matches are candidates the executor must recheck */
+     ItemPointerData *results;   /* current batch, or all that is left once materialized */
+     char **values;          /* indexed values of results, for index-only scans */
+     MemoryContext values_context;   /* copies in values, reset per batch */
      int num_results;
      int current;
+     Size capacity;
  } BiscuitScanOpaque;
  
- /* ==================== TID SORTING (OPTIMIZATION 6) ==================== */
+ /* ==================== RECORD KEYS ==================== */
  
  /*
-  * Compare function for qsort to sort TIDs by (block, offset)
-  * This enables sequential I/O during heap access
+  * Bitmaps normally hold record slots, and a result is turned into TIDs
+  * through idx->tids.  With keys = tid they hold the heap TIDs themselves,
+  * packed as block * BISCUIT_TID_KEY_OFFSETS + offset, so a result is read
+  * off as TIDs in heap order with no lookup.  The slots stay, but only to
+  * keep each record's string and TID for maintenance: VACUUM, slot reuse
+  * and the change log still work on slots.
+  *
+  * Keys are 32-bit like every other bitmap value, which covers heaps of up
+  * to 2^32 / BISCUIT_TID_KEY_OFFSETS blocks (64 GB with 8 kB blocks).
   */
- static int
- biscuit_compare_tids(const void *a, const void *b)
+ #define BISCUIT_TID_KEY_OFFSETS (BLCKSZ / 16)
+ 
+ StaticAssertDecl(MaxHeapTuplesPerPage < BISCUIT_TID_KEY_OFFSETS,
+                  "heap offsets must fit in a TID key");
+ 
+ static inline uint32_t
+ biscuit_tid_key(ItemPointer tid)
  {
-     ItemPointer tid_a = (ItemPointer)a;
-     ItemPointer tid_b = (ItemPointer)b;
-     BlockNumber block_a = ItemPointerGetBlockNumber(tid_a);
-     BlockNumber block_b = ItemPointerGetBlockNumber(tid_b);
-     
-     if (block_a < block_b)
-         return -1;
-     if (block_a > block_b)
-         return 1;
-     
-     OffsetNumber offset_a = ItemPointerGetOffsetNumber(tid_a);
-     OffsetNumber offset_b = ItemPointerGetOffsetNumber(tid_b);
-     
-     if (offset_a < offset_b)
-         return -1;
-     if (offset_a > offset_b)
-         return 1;
-     
-     return 0;
+     BlockNumber blkno = ItemPointerGetBlockNumberNoCheck(tid);
+     
+     if (blkno >= PG_UINT32_MAX / BISCUIT_TID_KEY_OFFSETS)
+         ereport(ERROR,
+                 (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                  errmsg("heap block %u is too large for a biscuit index with keys = tid", blkno),
+                  errhint("Rebuild the index with keys = record.")));
+     return blkno * BISCUIT_TID_KEY_OFFSETS + ItemPointerGetOffsetNumberNoCheck(tid);
+ }
+ 
+ static inline void
+ biscuit_key_tid(uint32_t key, ItemPointer tid)
+ {
+     ItemPointerSet(tid, key / BISCUIT_TID_KEY_OFFSETS, key % BISCUIT_TID_KEY_OFFSETS);
+ }
+ 
+ /* The bitmap value of the record in slot rec_idx */
+ static inline uint32_t
+ biscuit_record_key(BiscuitIndex *idx, uint32_t rec_idx)
+ {
+     return idx->tid_keys ? biscuit_tid_key(&idx->tids[rec_idx]) : rec_idx;
  }
  
+ /* ==================== RESULT STREAMING (OPTIMIZATION 6, 8) ==================== */
+ 
  /*
-  * Sort TIDs for sequential heap access
-  * This is critical for performance with large result sets
+  * Scans do not materialize their matches.  The result bitmap is walked on
+  * demand and its records are turned into TIDs a batch at a time, so a
+  * LIMIT query only pays for the rows the executor actually fetches.
+  * Record numbers follow heap order, so the stream comes out sorted by TID
+  * once the few out-of-order matches are merged back in.
   */
+ 
  static void
- biscuit_sort_tids_by_block(ItemPointerData *tids, int count)
+ biscuit_result_iter_init(BiscuitResultIter *it, const RoaringBitmap *result)
  {
-     if (count > 1) {
-         qsort(tids, count, sizeof(ItemPointerData), biscuit_compare_tids);
-     }
+ #ifdef HAVE_ROARING
+     it->iter = roaring_create_iterator(result);
+ #else
+     it->result = result;
+     it->next = 0;
+ #endif
  }
  
- /* ==================== DIRECT BITMAP TO TID COLLECTION (OPTIMIZATION 8) ==================== */
+ static void
+ biscuit_result_iter_free(BiscuitResultIter *it)
+ {
+ #ifdef HAVE_ROARING
+     if (it->iter)
+         roaring_free_uint32_iterator(it->iter);
+     it->iter = NULL;
+ #endif
+ }
  
  /*
-  * Collect TIDs directly from bitmap without intermediate array allocation
-  * Also sorts TIDs for optimal heap access
+  * Fill tids with up to max further matches; 0 once the result is exhausted.
+  * With values, also point each at the record's cached string (record keys
+  * only; index-only scans are not offered with TID keys).
   */
- static void
- biscuit_collect_sorted_tids(BiscuitIndex *idx, 
-                             RoaringBitmap *result,
-                             ItemPointerData **out_tids,
-                             int *out_count)
+ static int
+ biscuit_result_iter_next(BiscuitIndex *idx, BiscuitResultIter *it, ItemPointerData *tids,
+                          const char **values, int max)
  {
-     uint64_t count;
-     ItemPointerData *tids;
-     int idx_out = 0;
-     
-     count = biscuit_roaring_count(result);
+     int n = 0;
      
-     if (count == 0) {
-         *out_tids = NULL;
-         *out_count = 0;
-         return;
-     }
-     
-     tids = (ItemPointerData *)palloc(count * sizeof(ItemPointerData));
+ #ifdef HAVE_ROARING
+     uint32_t recs[BISCUIT_TID_BATCH];
      
-     #ifdef HAVE_ROARING
-     {
-         /* Direct iteration over Roaring bitmap - no intermediate array */
-         roaring_uint32_iterator_t *iter = roaring_create_iterator(result);
+     while (n == 0) {
+         uint32_t got = roaring_read_uint32_iterator(it->iter, recs, Min(max, BISCUIT_TID_BATCH));
+         uint32_t i;
          
-         while (iter->has_value) {
-             uint32_t rec_idx = iter->current_value;
-             
-             if (rec_idx < (uint32_t)idx->num_records) {
-                 ItemPointerCopy(&idx->tids[rec_idx], &tids[idx_out]);
-                 idx_out++;
+         if (got == 0)
+             break;
+         for (i = 0; i < got; i++) {
+             if (idx->tid_keys) {
+                 biscuit_key_tid(recs[i], &tids[n++]);
+             } else if (recs[i] < (uint32_t)idx->num_records) {
+                 if (values)
+                     values[n] = idx->data_cache[recs[i]];
+                 ItemPointerCopy(&idx->tids[recs[i]], &tids[n++]);
              }
-             
-             roaring_advance_uint32_iterator(iter);
          }
+     }
+ #else
+     uint64_t limit = (uint64_t)it->result->num_blocks * 64;
+     
+     if (!idx->tid_keys)
+         limit = Min(limit, (uint64_t)idx->num_records);
+     while (n < max && it->next < limit) {
+         uint32_t rec = it->next++;
          
-         roaring_free_uint32_iterator(iter);
+         if (!biscuit_roaring_contains(it->result, rec))
+             continue;
+         if (idx->tid_keys) {
+             biscuit_key_tid(rec, &tids[n++]);
+         } else {
+             if (values)
+                 values[n] = idx->data_cache[rec];
+             ItemPointerCopy(&idx->tids[rec], &tids[n++]);
+         }
      }
-     #else
-     {
-         /* Fallback: use array conversion for non-roaring implementation */
-         uint32_t *indices;
-         int i;
+ #endif
+     
+     return n;
+ }
+ 
+ /* Stop streaming: drop the iterator and the result it walks */
+ static void
+ biscuit_scan_end_stream(BiscuitScanOpaque *so)
+ {
+     if (!so->result)
+         return;
+     
+     biscuit_result_iter_free(&so->iter);
+     biscuit_roaring_free(so->result);
+     so->result = NULL;
+     so->index->streams = list_delete_ptr(so->index->streams, so);
+ }
+ 
+ /*
+  * Fill out with up to max further TIDs in heap order, merging in the delta.
+  * With out_values, also hand out the indexed values.  Those of the stream
+  * point into the index copy, which may drop them once the stream ends, so
+  * they are copied into values_context.
+  */
+ static int
+ biscuit_scan_fill(BiscuitScanOpaque *so, ItemPointerData *out, char **out_values, int max)
+ {
+     int n = 0;
+     
+     while (n < max) {
+         bool have_ahead;
+         bool have_delta;
          
-         indices = biscuit_roaring_to_array(result, &count);
+         if (so->ahead_pos >= so->ahead_len && so->result) {
+             so->ahead_pos = 0;
+             so->ahead_len = biscuit_result_iter_next(so->index, &so->iter, so->ahead,
+                                                      out_values ? so->ahead_values : NULL,
+                                                      BISCUIT_TID_BATCH);
+             if (so->ahead_len == 0)
+                 biscuit_scan_end_stream(so);
+         }
          
-         if (indices) {
-             for (i = 0; i < (int)count; i++) {
-                 if (indices[i] < (uint32_t)idx->num_records) {
-                     ItemPointerCopy(&idx->tids[indices[i]], &tids[idx_out]);
-                     idx_out++;
-                 }
-             }
-             pfree(indices);
+         have_ahead = so->ahead_pos < so->ahead_len;
+         have_delta = so->delta_pos < so->delta_len;
+         if (!have_ahead && !have_delta)
+             break;
+         
+         if (have_ahead &&
+             (!have_delta || ItemPointerCompare(&so->ahead[so->ahead_pos], &so->delta[so->delta_pos]) < 0)) {
+             if (out_values)
+                 out_values[n] = MemoryContextStrdup(so->values_context, so->ahead_values[so->ahead_pos]);
+             out[n++] = so->ahead[so->ahead_pos++];
+         } else {
+             if (out_values)
+                 out_values[n] = so->delta_values[so->delta_pos];
+             out[n++] = so->delta[so->delta_pos++];
          }
      }
-     #endif
      
-     *out_count = idx_out;
+     return n;
+ }
+ 
+ /* Hand out the next batch of TIDs in so->results; false when done */
+ static bool
+ biscuit_scan_next_batch(BiscuitScanOpaque *so)
+ {
+     if (so->values)
+         MemoryContextReset(so->values_context);
+     so->current = 0;
+     so->num_results = biscuit_scan_fill(so, so->results, so->values, so->capacity);
+     return so->num_results > 0;
+ }
+ 
+ /*
+  * Turn the rest of a streaming scan into a TID array.  A stream reads the
+  * tids of its copy as it goes, which is only safe while the matched slots
+  * keep their records; before a slot can be tombstoned and reused, every
+  * scan still streaming from the copy collects what it has left.
+  */
+ static void
+ biscuit_scan_materialize(BiscuitScanOpaque *so)
+ {
+     MemoryContext oldcontext = MemoryContextSwitchTo(so->context);
+     int n = so->num_results - so->current;
+     Size cap = Max(n, BISCUIT_TID_BATCH) * 2;
+     ItemPointerData *tids;
+     char **values = NULL;
+     
+     tids = (ItemPointerData *)MemoryContextAllocHuge(so->context, cap * sizeof(ItemPointerData));
+     if (n > 0)
+         memcpy(tids, so->results + so->current, n * sizeof(ItemPointerData));
+     if (so->values) {
+         values = (char **)MemoryContextAllocHuge(so->context, cap * sizeof(char *));
+         if (n > 0)
+             memcpy(values, so->values + so->current, n * sizeof(char *));
+     }
+     
+     for (;;) {
+         int got;
+         
+         if (cap - n < BISCUIT_TID_BATCH) {
+             cap *= 2;
+             tids = (ItemPointerData *)repalloc_huge(tids, cap * sizeof(ItemPointerData));
+             if (values)
+                 values = (char **)repalloc_huge(values, cap * sizeof(char *));
+         }
+         got = biscuit_scan_fill(so, tids + n, values ? values + n : NULL, BISCUIT_TID_BATCH);
+         if (got == 0)
+             break;
+         n += got;
+     }
      
-     /* CRITICAL OPTIMIZATION: Sort TIDs for sequential heap access */
-     if (idx_out > 0) {
-         biscuit_sort_tids_by_block(tids, idx_out);
+     biscuit_scan_end_stream(so);
+     pfree(so->results);
+     so->results = tids;
+     if (values) {
+         pfree(so->values);
+         so->values = values;
      }
+     so->capacity = cap;
+     so->num_results = n;
+     so->current = 0;
      
-     *out_tids = tids;
+     MemoryContextSwitchTo(oldcontext);
+ }
+ 
+ static void
+ biscuit_materialize_streams(BiscuitIndex *idx)
+ {
+     while (idx->streams != NIL)
+         biscuit_scan_materialize((BiscuitScanOpaque *)linitial(idx->streams));
  }
  
  /* ==================== CRUD HELPER FUNCTIONS ==================== */
@@ -252,6 +789,8 @@
      idx->free_count = 0;
      idx->free_list = (uint32_t *)palloc(idx->free_capacity * sizeof(uint32_t));
      idx->tombstone_count = 0;
+     idx->unordered = biscuit_roaring_create();
+     ItemPointerSet(&idx->last_ordered, 0, InvalidOffsetNumber);
      idx->insert_count = 0;
      idx->update_count = 0;
      idx->delete_count = 0;
@@ -271,12 +810,34 @@
      idx->free_list[idx->free_count++] = slot;
  }
  
- static bool biscuit_pop_free_slot(BiscuitIndex *idx, uint32_t *slot)
+ /* Slot the next insert will use: the most recently freed one, else a new one */
+ static uint32_t biscuit_next_slot(BiscuitIndex *idx)
  {
-     if (idx->free_count == 0)
-         return false;
-     *slot = idx->free_list[--idx->free_count];
-     return true;
+     if (idx->free_count > 0)
+         return idx->free_list[idx->free_count - 1];
+     return (uint32_t)idx->num_records;
+ }
+ 
+ /* Remove a slot from the free list; usually it is the last one pushed */
+ static void biscuit_take_free_slot(BiscuitIndex *idx, uint32_t slot)
+ {
+     int i;
+     
+     for (i = idx->free_count - 1; i >= 0; i--) {
+         if (idx->free_list[i] == slot) {
+             memmove(&idx->free_list[i], &idx->free_list[i + 1],
+                     (idx->free_count - i - 1) * sizeof(uint32_t));
+             idx->free_count--;
+             return;
+         }
+     }
+ }
+ 
+ /* Remove one record, copying a shared bitmap only if it holds the record */
+ static void biscuit_remove_record(RoaringBitmap **rb, uint32_t rec_idx)
+ {
+     if (*rb && biscuit_roaring_contains(*rb, rec_idx))
+         biscuit_roaring_remove(biscuit_roaring_thaw(rb), rec_idx);
  }
  
  static void biscuit_remove_from_all_indices(BiscuitIndex *idx, uint32_t rec_idx)
@@ -288,23 +849,20 @@
      {
          CharIndex *pos_cidx = &idx->pos_idx[ch];
          for (j = 0; j < pos_cidx->count; j++)
-             biscuit_roaring_remove(pos_cidx->entries[j].bitmap, rec_idx);
+             biscuit_remove_record(&pos_cidx->entries[j].bitmap, rec_idx);
          
          CharIndex *neg_cidx = &idx->neg_idx[ch];
          for (j = 0; j < neg_cidx->count; j++)
-             biscuit_roaring_remove(neg_cidx->entries[j].bitmap, rec_idx);
+             biscuit_remove_record(&neg_cidx->entries[j].bitmap, rec_idx);
          
-         if (idx->char_cache[ch])
-             biscuit_roaring_remove(idx->char_cache[ch], rec_idx);
+         biscuit_remove_record(&idx->char_cache[ch], rec_idx);
      }
      
      /* Remove from length bitmaps */
      for (j = 0; j < idx->max_length; j++)
      {
-         if (idx->length_bitmaps[j])
-             biscuit_roaring_remove(idx->length_bitmaps[j], rec_idx);
-         if (idx->length_ge_bitmaps[j])
-             biscuit_roaring_remove(idx->length_ge_bitmaps[j], rec_idx);
+         biscuit_remove_record(&idx->length_bitmaps[j], rec_idx);
+         biscuit_remove_record(&idx->length_ge_bitmaps[j], rec_idx);
      }
  }
  
@@ -313,15 +871,43 @@
  #ifdef HAVE_ROARING
  static inline RoaringBitmap* biscuit_roaring_create(void) { return roaring_bitmap_create(); }
  static inline void biscuit_roaring_add(RoaringBitmap *rb, uint32_t value) { roaring_bitmap_add(rb, value); }
+ static inline void biscuit_roaring_add_many(RoaringBitmap *rb, size_t n, const uint32_t *values) { roaring_bitmap_add_many(rb, n, values); }
  static inline void biscuit_roaring_remove(RoaringBitmap *rb, uint32_t value) { roaring_bitmap_remove(rb, value); }
+ static inline bool biscuit_roaring_contains(const RoaringBitmap *rb, uint32_t value) { return roaring_bitmap_contains(rb, value); }
  static inline uint64_t biscuit_roaring_count(const RoaringBitmap *rb) { return roaring_bitmap_get_cardinality(rb); }
  static inline bool biscuit_roaring_is_empty(const RoaringBitmap *rb) { return roaring_bitmap_get_cardinality(rb) == 0; }
  static inline void biscuit_roaring_free(RoaringBitmap *rb) { if (rb) roaring_bitmap_free(rb); }
  static inline RoaringBitmap* biscuit_roaring_copy(const RoaringBitmap *rb) { return roaring_bitmap_copy(rb); }
  static inline void biscuit_roaring_and_inplace(RoaringBitmap *a, const RoaringBitmap *b) { roaring_bitmap_and_inplace(a, b); }
+ static inline RoaringBitmap* biscuit_roaring_and(const RoaringBitmap *a, const RoaringBitmap *b) { return roaring_bitmap_and(a, b); }
  static inline void biscuit_roaring_or_inplace(RoaringBitmap *a, const RoaringBitmap *b) { roaring_bitmap_or_inplace(a, b); }
  static inline void biscuit_roaring_andnot_inplace(RoaringBitmap *a, const RoaringBitmap *b) { roaring_bitmap_andnot_inplace(a, b); }
  
+ /* a |= (b shifted up by offset) */
+ static inline void biscuit_roaring_or_offset(RoaringBitmap *a, const RoaringBitmap *b, uint32_t offset) {
+     roaring_bitmap_t *shifted = roaring_bitmap_add_offset(b, offset);
+     roaring_bitmap_or_inplace(a, shifted);
+     roaring_bitmap_free(shifted);
+ }
+ 
+ /* a |= b shifted piecewise: values from starts[i] up to starts[i + 1] move up by offsets[i] */
+ static inline void biscuit_roaring_or_remap(RoaringBitmap *a, const RoaringBitmap *b,
+                                             const uint32_t *starts, const uint32_t *offsets, int n) {
+     roaring_uint32_iterator_t *it = roaring_create_iterator(b);
+     uint32_t vals[256];
+     uint32_t got;
+     int s = 0;
+     while ((got = roaring_read_uint32_iterator(it, vals, lengthof(vals))) > 0) {
+         uint32_t i;
+         for (i = 0; i < got; i++) {
+             while (s + 1 < n && vals[i] >= starts[s + 1]) s++;
+             vals[i] += offsets[s];
+         }
+         roaring_bitmap_add_many(a, got, vals);
+     }
+     roaring_free_uint32_iterator(it);
+ }
+ 
  static inline uint32_t* biscuit_roaring_to_array(const RoaringBitmap *rb, uint64_t *count) {
      uint32_t *array;
      *count = roaring_bitmap_get_cardinality(rb);
@@ -330,6 +916,44 @@
      roaring_bitmap_to_uint32_array(rb, array);
      return array;
  }
+ 
+ static inline Size biscuit_roaring_serialized_size(const RoaringBitmap *rb) {
+     return roaring_bitmap_portable_size_in_bytes(rb);
+ }
+ 
+ static inline void biscuit_roaring_serialize(const RoaringBitmap *rb, char *buf) {
+     roaring_bitmap_portable_serialize(rb, buf);
+ }
+ 
+ static inline RoaringBitmap* biscuit_roaring_deserialize(const char *buf, Size len) {
+     return roaring_bitmap_portable_deserialize_safe(buf, len);
+ }
+ 
+ /* Read-only view whose containers point into buf, which must outlive it */
+ static inline RoaringBitmap* biscuit_roaring_deserialize_frozen(const char *buf, Size len) {
+     if (roaring_bitmap_portable_deserialize_size(buf, len) != len)
+         return NULL;
+     return roaring_bitmap_portable_deserialize_frozen(buf);
+ }
+ 
+ static inline bool biscuit_roaring_is_frozen(const RoaringBitmap *rb) {
+     return (rb->high_low_container.flags & ROARING_FLAG_FROZEN) != 0;
+ }
+ 
+ static inline bool biscuit_roaring_intersects(const RoaringBitmap *a, const RoaringBitmap *b) {
+     return roaring_bitmap_intersect(a, b);
+ }
+ 
+ /* Convert to run containers where smaller and release slack capacity */
+ static inline void biscuit_roaring_optimize(RoaringBitmap *rb) {
+     roaring_bitmap_run_optimize(rb);
+     roaring_bitmap_shrink_to_fit(rb);
+ }
+ 
+ /* Number of values in [lo, hi) */
+ static inline uint64_t biscuit_roaring_range_count(const RoaringBitmap *rb, uint64_t lo, uint64_t hi) {
+     return roaring_bitmap_range_cardinality(rb, lo, hi);
+ }
  #else
  static inline RoaringBitmap* biscuit_roaring_create(void) {
      RoaringBitmap *rb = (RoaringBitmap *)palloc0(sizeof(RoaringBitmap));
@@ -355,6 +979,12 @@
      rb->blocks[block] |= (1ULL << bit);
  }
  
+ static inline void biscuit_roaring_add_many(RoaringBitmap *rb, size_t n, const uint32_t *values) {
+     size_t i;
+     for (i = 0; i < n; i++)
+         biscuit_roaring_add(rb, values[i]);
+ }
+ 
  static inline void biscuit_roaring_remove(RoaringBitmap *rb, uint32_t value) {
      int block = value >> 6;
      int bit = value & 63;
@@ -362,6 +992,12 @@
          rb->blocks[block] &= ~(1ULL << bit);
  }
  
+ static inline bool biscuit_roaring_contains(const RoaringBitmap *rb, uint32_t value) {
+     int block = value >> 6;
+     int bit = value & 63;
+     return block < rb->num_blocks && (rb->blocks[block] & (1ULL << bit)) != 0;
+ }
+ 
  static inline uint64_t biscuit_roaring_count(const RoaringBitmap *rb) {
      uint64_t count = 0;
      int i;
@@ -406,6 +1042,21 @@
      a->num_blocks = min;
  }
  
+ static inline RoaringBitmap* biscuit_roaring_and(const RoaringBitmap *a, const RoaringBitmap *b) {
+     RoaringBitmap *result = biscuit_roaring_create();
+     int min = (a->num_blocks < b->num_blocks) ? a->num_blocks : b->num_blocks;
+     int i;
+     if (min > result->capacity) {
+         pfree(result->blocks);
+         result->blocks = (uint64_t *)palloc(min * sizeof(uint64_t));
+         result->capacity = min;
+     }
+     for (i = 0; i < min; i++)
+         result->blocks[i] = a->blocks[i] & b->blocks[i];
+     result->num_blocks = min;
+     return result;
+ }
+ 
  static inline void biscuit_roaring_or_inplace(RoaringBitmap *a, const RoaringBitmap *b) {
      int min;
      int i;
@@ -434,6 +1085,33 @@
          a->blocks[i] &= ~b->blocks[i];
  }
  
+ static inline void biscuit_roaring_or_offset(RoaringBitmap *a, const RoaringBitmap *b, uint32_t offset) {
+     int i;
+     for (i = 0; i < b->num_blocks; i++) {
+         uint64_t bits = b->blocks[i];
+         uint64_t base = ((uint64_t)i << 6) + offset;
+         while (bits) {
+             biscuit_roaring_add(a, (uint32_t)(base + __builtin_ctzll(bits)));
+             bits &= bits - 1;
+         }
+     }
+ }
+ 
+ static inline void biscuit_roaring_or_remap(RoaringBitmap *a, const RoaringBitmap *b,
+                                             const uint32_t *starts, const uint32_t *offsets, int n) {
+     int s = 0;
+     int i;
+     for (i = 0; i < b->num_blocks; i++) {
+         uint64_t bits = b->blocks[i];
+         while (bits) {
+             uint32_t v = (uint32_t)(((uint64_t)i << 6) + __builtin_ctzll(bits));
+             while (s + 1 < n && v >= starts[s + 1]) s++;
+             biscuit_roaring_add(a, v + offsets[s]);
+             bits &= bits - 1;
+         }
+     }
+ }
+ 
  static inline uint32_t* biscuit_roaring_to_array(const RoaringBitmap *rb, uint64_t *count) {
      uint32_t *array;
      int idx;
@@ -454,38 +1132,173 @@
      }
      return array;
  }
- #endif
  
- /* ==================== BITMAP ACCESS ==================== */
+ /* Serialized form: int32 block count followed by the blocks */
+ static inline Size biscuit_roaring_serialized_size(const RoaringBitmap *rb) {
+     return sizeof(int32) + rb->num_blocks * sizeof(uint64_t);
+ }
  
- static inline RoaringBitmap* biscuit_get_pos_bitmap(BiscuitIndex *idx, unsigned char ch, int pos) {
-     CharIndex *cidx = &idx->pos_idx[ch];
-     int left = 0, right = cidx->count - 1;
-     while (left <= right) {
-         int mid = (left + right) >> 1;
-         if (cidx->entries[mid].pos == pos)
-             return cidx->entries[mid].bitmap;
-         else if (cidx->entries[mid].pos < pos)
-             left = mid + 1;
-         else
-             right = mid - 1;
-     }
-     return NULL;
+ static inline void biscuit_roaring_serialize(const RoaringBitmap *rb, char *buf) {
+     int32 num_blocks = rb->num_blocks;
+     memcpy(buf, &num_blocks, sizeof(int32));
+     if (num_blocks > 0)
+         memcpy(buf + sizeof(int32), rb->blocks, num_blocks * sizeof(uint64_t));
  }
  
- static inline RoaringBitmap* biscuit_get_neg_bitmap(BiscuitIndex *idx, unsigned char ch, int neg_offset) {
-     CharIndex *cidx = &idx->neg_idx[ch];
-     int left = 0, right = cidx->count - 1;
-     while (left <= right) {
-         int mid = (left + right) >> 1;
-         if (cidx->entries[mid].pos == neg_offset)
-             return cidx->entries[mid].bitmap;
-         else if (cidx->entries[mid].pos < neg_offset)
-             left = mid + 1;
-         else
-             right = mid - 1;
+ static inline RoaringBitmap* biscuit_roaring_deserialize(const char *buf, Size len) {
+     RoaringBitmap *rb;
+     int32 num_blocks;
+     if (len < sizeof(int32))
+         return NULL;
+     memcpy(&num_blocks, buf, sizeof(int32));
+     if (num_blocks < 0 || len != sizeof(int32) + num_blocks * sizeof(uint64_t))
+         return NULL;
+     rb = biscuit_roaring_create();
+     if (num_blocks > rb->capacity) {
+         pfree(rb->blocks);
+         rb->blocks = (uint64_t *)palloc(num_blocks * sizeof(uint64_t));
+         rb->capacity = num_blocks;
      }
-     return NULL;
+     if (num_blocks > 0)
+         memcpy(rb->blocks, buf + sizeof(int32), num_blocks * sizeof(uint64_t));
+     rb->num_blocks = num_blocks;
+     return rb;
+ }
+ 
+ /*
+  * The fallback has no read-only views: shared and mapped snapshots are
+  * copied into each backend (biscuit_options warns about storage = mmap)
+  */
+ static inline RoaringBitmap* biscuit_roaring_deserialize_frozen(const char *buf, Size len) {
+     return biscuit_roaring_deserialize(buf, len);
+ }
+ 
+ static inline bool biscuit_roaring_is_frozen(const RoaringBitmap *rb) {
+     return false;
+ }
+ 
+ static inline bool biscuit_roaring_intersects(const RoaringBitmap *a, const RoaringBitmap *b) {
+     int i;
+     int n = Min(a->num_blocks, b->num_blocks);
+     for (i = 0; i < n; i++) {
+         if (a->blocks[i] & b->blocks[i])
+             return true;
+     }
+     return false;
+ }
+ 
+ static inline void biscuit_roaring_optimize(RoaringBitmap *rb) {
+ }
+ 
+ static inline uint64_t biscuit_roaring_range_count(const RoaringBitmap *rb, uint64_t lo, uint64_t hi) {
+     uint64_t count = 0;
+     uint64_t v;
+     hi = Min(hi, (uint64_t)rb->num_blocks * 64);
+     for (v = lo; v < hi; v++)
+         if (biscuit_roaring_contains(rb, (uint32_t)v)) count++;
+     return count;
+ }
+ #endif
+ 
+ /*
+  * Bitmaps loaded from a shared snapshot are read-only views.  Call this
+  * before modifying an index bitmap in place; it swaps a view for a private
+  * copy, so only bitmaps that actually change stop being shared.
+  */
+ static inline RoaringBitmap* biscuit_roaring_thaw(RoaringBitmap **rb) {
+     if (*rb && biscuit_roaring_is_frozen(*rb)) {
+         RoaringBitmap *copy = biscuit_roaring_copy(*rb);
+         biscuit_roaring_free(*rb);
+         *rb = copy;
+     }
+     return *rb;
+ }
+ 
+ /* ==================== BITMAP ACCESS ==================== */
+ 
+ static inline RoaringBitmap* biscuit_get_pos_bitmap(BiscuitIndex *idx, unsigned char ch, int pos) {
+     CharIndex *cidx = &idx->pos_idx[ch];
+     int left = 0, right = cidx->count - 1;
+     while (left <= right) {
+         int mid = (left + right) >> 1;
+         if (cidx->entries[mid].pos == pos)
+             return cidx->entries[mid].bitmap;
+         else if (cidx->entries[mid].pos < pos)
+             left = mid + 1;
+         else
+             right = mid - 1;
+     }
+     return NULL;
+ }
+ 
+ static inline RoaringBitmap* biscuit_get_neg_bitmap(BiscuitIndex *idx, unsigned char ch, int neg_offset) {
+     CharIndex *cidx = &idx->neg_idx[ch];
+     int left = 0, right = cidx->count - 1;
+     while (left <= right) {
+         int mid = (left + right) >> 1;
+         if (cidx->entries[mid].pos == neg_offset)
+             return cidx->entries[mid].bitmap;
+         else if (cidx->entries[mid].pos < neg_offset)
+             left = mid + 1;
+         else
+             right = mid - 1;
+     }
+     return NULL;
+ }
+ 
+ static inline uint32 biscuit_ngram_gram(const char *str, int n) {
+     uint32 gram = 0;
+     int i;
+     for (i = 0; i < n; i++)
+         gram = (gram << 8) | (unsigned char)str[i];
+     return gram;
+ }
+ 
+ /* Bitmap of records with the n bytes at str starting at pos; NULL if none */
+ static inline RoaringBitmap* biscuit_get_ngram_bitmap(BiscuitIndex *idx, const char *str, int pos) {
+     BiscuitNgramKey key;
+     BiscuitNgramEntry *entry;
+     
+     key.gram = biscuit_ngram_gram(str, idx->ngram);
+     key.pos = pos;
+     entry = (BiscuitNgramEntry *)hash_search(idx->ngram_idx, &key, HASH_FIND, NULL);
+     return entry ? entry->bitmap : NULL;
+ }
+ 
+ static inline bool biscuit_is_upper(unsigned char ch) {
+     return ch >= 'A' && ch <= 'Z';
+ }
+ 
+ static inline bool biscuit_is_lower(unsigned char ch) {
+     return ch >= 'a' && ch <= 'z';
+ }
+ 
+ /*
+  * Lowercase ASCII letters that collations other than C may fold to or from
+  * non-ASCII characters: KELVIN SIGN lowers to 'k' and U+0130 to 'i', while
+  * Turkish locales lower 'I' to a dotless i.  Their ASCII bitmaps do not
+  * hold every string that ILIKE folds onto them.
+  */
+ static inline bool biscuit_fold_is_ambiguous(unsigned char ch) {
+     return ch == 'i' || ch == 'k';
+ }
+ 
+ /*
+  * Bitmap of records with ch at pos in either case, for a lowercased ch; a
+  * negative pos counts from the end like neg_idx.  Only letters have bitmaps
+  * of their own in the case-folded layer, the rest use the exact ones.
+  */
+ static inline RoaringBitmap* biscuit_get_fold_bitmap(BiscuitIndex *idx, unsigned char ch, int pos) {
+     BiscuitNgramKey key;
+     BiscuitNgramEntry *entry;
+     
+     if (!biscuit_is_lower(ch))
+         return pos >= 0 ? biscuit_get_pos_bitmap(idx, ch, pos) : biscuit_get_neg_bitmap(idx, ch, pos);
+     
+     key.gram = ch;
+     key.pos = pos;
+     entry = (BiscuitNgramEntry *)hash_search(idx->fold_idx, &key, HASH_FIND, NULL);
+     return entry ? entry->bitmap : NULL;
  }
  
  static void biscuit_set_pos_bitmap(BiscuitIndex *idx, unsigned char ch, int pos, RoaringBitmap *bm) {
@@ -568,9 +1381,52 @@
      return biscuit_roaring_copy(idx->length_ge_bitmaps[min_len]);
  }
  
- /* OPTIMIZATION 1: Skip wildcards entirely, only intersect concrete characters */
- static RoaringBitmap* biscuit_match_part_at_pos(BiscuitIndex *idx, const char *part, int part_len, int start_pos) {
-     RoaringBitmap *result = NULL;
+ /* A concrete character's bitmap and its cardinality, for ordering intersections */
+ typedef struct {
+     RoaringBitmap *bitmap;
+     uint64_t card;
+ } BiscuitAndInput;
+ 
+ static int biscuit_and_input_cmp(const void *a, const void *b) {
+     uint64_t ca = ((const BiscuitAndInput *)a)->card;
+     uint64_t cb = ((const BiscuitAndInput *)b)->card;
+     return (ca > cb) - (ca < cb);
+ }
+ 
+ /*
+  * Intersect n bitmaps, rarest first.  The first AND builds a new bitmap no
+  * larger than the rarest input, so no input is ever copied, and with the
+  * most selective characters applied first an empty result ends the loop
+  * as early as possible.  Skewed data makes this matter: in UUIDs a hex
+  * digit matches 1/16 of the rows while a '-' at a fixed offset matches all.
+  */
+ static RoaringBitmap* biscuit_and_all(BiscuitAndInput *inputs, int n) {
+     RoaringBitmap *result;
+     int i;
+     
+     if (n == 1)
+         return biscuit_roaring_copy(inputs[0].bitmap);
+     
+     qsort(inputs, n, sizeof(BiscuitAndInput), biscuit_and_input_cmp);
+     
+     result = biscuit_roaring_and(inputs[0].bitmap, inputs[1].bitmap);
+     for (i = 2; i < n && !biscuit_roaring_is_empty(result); i++)
+         biscuit_roaring_and_inplace(result, inputs[i].bitmap);
+     
+     return result;
+ }
+ 
+ /*
+  * OPTIMIZATION 1: Skip wildcards entirely, only intersect concrete characters.
+  * A non-NULL filter restricts the result to those records; as the usually
+  * rarest input it goes first, so the positional bitmaps are only probed
+  * where they can still contribute.  With fold, the part is lowercased and
+  * matched against the case-folded layer.
+  */
+ static RoaringBitmap* biscuit_match_part_at_pos(BiscuitIndex *idx, const char *part, int part_len, int start_pos,
+                                                 const RoaringBitmap *filter, bool fold) {
+     BiscuitAndInput *inputs;
+     RoaringBitmap *result;
      int i;
      int concrete_count = 0;
      
@@ -580,47 +1436,75 @@
              concrete_count++;
      }
      
-     /* OPTIMIZATION: If all wildcards, return all records at this position range */
+     /* OPTIMIZATION: If all wildcards, return all records long enough to hold the part here */
      if (concrete_count == 0) {
-         int ch;
-         result = biscuit_roaring_create();
-         for (ch = 0; ch < CHAR_RANGE; ch++) {
-             RoaringBitmap *cb = biscuit_get_pos_bitmap(idx, ch, start_pos);
-             if (cb) biscuit_roaring_or_inplace(result, cb);
-         }
+         result = biscuit_get_length_ge(idx, start_pos + part_len);
+         if (filter)
+             biscuit_roaring_and_inplace(result, filter);
          return result;
      }
      
      /* OPTIMIZATION: Only process concrete characters, skip wildcards */
-     for (i = 0; i < part_len; i++) {
-         if (part[i] == '_')
-             continue;  /* Skip wildcard - no constraint */
+     inputs = (BiscuitAndInput *)palloc((concrete_count + 1) * sizeof(BiscuitAndInput));
+     concrete_count = 0;
+     if (filter) {
+         inputs[0].bitmap = (RoaringBitmap *)filter;
+         inputs[0].card = biscuit_roaring_count(filter);
+         concrete_count++;
+     }
+     for (i = 0; i < part_len; ) {
+         int run;
+         int k;
          
-         RoaringBitmap *char_bm = biscuit_get_pos_bitmap(idx, (unsigned char)part[i], start_pos + i);
-         if (!char_bm) {
-             /* Character not found at this position - no matches */
-             if (result) biscuit_roaring_free(result);
-             return biscuit_roaring_create();
+         if (part[i] == '_') {
+             i++;
+             continue;  /* Skip wildcard - no constraint */
          }
+         for (run = 0; i + run < part_len && part[i + run] != '_'; run++)
+             ;
          
-         if (!result) {
-             /* First concrete character - copy directly */
-             result = biscuit_roaring_copy(char_bm);
-         } else {
-             /* Intersect with existing results */
-             biscuit_roaring_and_inplace(result, char_bm);
-             /* OPTIMIZATION 2: Early termination if empty */
-             if (biscuit_roaring_is_empty(result))
-                 return result;
+         /*
+          * With an n-gram layer, cover each concrete run with n-gram windows,
+          * the last one overlapping the previous so the run ends exactly:
+          * about run/n intersections instead of one per character.
+          */
+         for (k = 0; k < run; ) {
+             RoaringBitmap *char_bm;
+             int at = i + k;
+             int step = 1;
+             
+             if (fold) {
+                 char_bm = biscuit_get_fold_bitmap(idx, (unsigned char)part[at], start_pos + at);
+             } else if (idx->ngram_idx && run >= idx->ngram) {
+                 at = i + Min(k, run - idx->ngram);
+                 step = idx->ngram;
+                 char_bm = biscuit_get_ngram_bitmap(idx, part + at, start_pos + at);
+             } else {
+                 char_bm = biscuit_get_pos_bitmap(idx, (unsigned char)part[at], start_pos + at);
+             }
+             if (!char_bm) {
+                 /* Character not found at this position - no matches */
+                 pfree(inputs);
+                 return biscuit_roaring_create();
+             }
+             inputs[concrete_count].bitmap = char_bm;
+             inputs[concrete_count].card = biscuit_roaring_count(char_bm);
+             concrete_count++;
+             k += step;
          }
+         i += run;
      }
      
-     return result ? result : biscuit_roaring_create();
+     /* OPTIMIZATION 2: Rarest first, so early termination comes early */
+     result = biscuit_and_all(inputs, concrete_count);
+     pfree(inputs);
+     return result;
  }
  
  /* OPTIMIZATION: Similar optimization for end-anchored patterns */
- static RoaringBitmap* biscuit_match_part_at_end(BiscuitIndex *idx, const char *part, int part_len) {
-     RoaringBitmap *result = NULL;
+ static RoaringBitmap* biscuit_match_part_at_end(BiscuitIndex *idx, const char *part, int part_len, bool fold) {
+     BiscuitAndInput *inputs;
+     RoaringBitmap *result;
      int i;
      int concrete_count = 0;
      
@@ -636,28 +1520,28 @@
      }
      
      /* Only process concrete characters */
+     inputs = (BiscuitAndInput *)palloc(concrete_count * sizeof(BiscuitAndInput));
+     concrete_count = 0;
      for (i = 0; i < part_len; i++) {
          if (part[i] == '_')
              continue;
          
          int neg_pos = -(part_len - i);
-         RoaringBitmap *char_bm = biscuit_get_neg_bitmap(idx, (unsigned char)part[i], neg_pos);
+         RoaringBitmap *char_bm = fold ? biscuit_get_fold_bitmap(idx, (unsigned char)part[i], neg_pos)
+                                       : biscuit_get_neg_bitmap(idx, (unsigned char)part[i], neg_pos);
          
          if (!char_bm) {
-             if (result) biscuit_roaring_free(result);
+             pfree(inputs);
              return biscuit_roaring_create();
          }
-         
-         if (!result) {
-             result = biscuit_roaring_copy(char_bm);
-         } else {
-             biscuit_roaring_and_inplace(result, char_bm);
-             if (biscuit_roaring_is_empty(result))
-                 return result;
-         }
+         inputs[concrete_count].bitmap = char_bm;
+         inputs[concrete_count].card = biscuit_roaring_count(char_bm);
+         concrete_count++;
      }
      
-     return result ? result : biscuit_roaring_create();
+     result = biscuit_and_all(inputs, concrete_count);
+     pfree(inputs);
+     return result;
  }
  
  typedef struct {
@@ -686,8 +1570,9 @@
      
      part_start = parsed->starts_percent ? 1 : 0;
      
-     for (i = part_start; i < plen; i++) {
-         if (pattern[i] == '%') {
+     /* The end of the pattern closes the last part like a '%' would */
+     for (i = part_start; i <= plen; i++) {
+         if (i == plen || pattern[i] == '%') {
              int part_len = i - part_start;
              if (part_len > 0) {
                  if (parsed->part_count >= part_cap) {
@@ -710,63 +1595,165 @@
          }
      }
      
-     if (part_start < plen && (!parsed->ends_percent || part_start < plen - 1)) {
-         int part_len = parsed->ends_percent ? (plen - 1 - part_start) : (plen - part_start);
-         if (part_len > 0) {
-             parsed->parts[parsed->part_count] = pnstrdup(pattern + part_start, part_len);
-             parsed->part_lens[parsed->part_count] = part_len;
-             parsed->part_count++;
+     return parsed;
+ }
+ 
+ /*
+  * Records holding every concrete character of the pattern somewhere: the
+  * intersection of their char_cache bitmaps, rarest first.  A needle with
+  * a rare character narrows positional matching to a few candidates, and
+  * one absent from the index rules the pattern out without any.  NULL if
+  * the pattern has no concrete characters to filter on.  With fold, letters
+  * use the fold_cache bitmaps instead.
+  */
+ static RoaringBitmap* biscuit_char_prefilter(BiscuitIndex *idx, ParsedPattern *parsed, bool fold) {
+     BiscuitAndInput inputs[CHAR_RANGE];
+     bool seen[CHAR_RANGE];
+     int n = 0;
+     int i, j;
+     
+     memset(seen, 0, sizeof(seen));
+     for (i = 0; i < parsed->part_count; i++) {
+         for (j = 0; j < parsed->part_lens[i]; j++) {
+             unsigned char uch = (unsigned char)parsed->parts[i][j];
+             
+             RoaringBitmap *bm;
+             
+             if (uch == '_' || seen[uch])
+                 continue;
+             seen[uch] = true;
+             
+             bm = fold && biscuit_is_lower(uch) ? idx->fold_cache[uch] : idx->char_cache[uch];
+             if (!bm)
+                 return biscuit_roaring_create();
+             inputs[n].bitmap = bm;
+             inputs[n].card = biscuit_roaring_count(bm);
+             n++;
          }
      }
      
-     return parsed;
+     return n > 0 ? biscuit_and_all(inputs, n) : NULL;
  }
  
- static void biscuit_recursive_windowed_match(
-     RoaringBitmap *result, BiscuitIndex *idx,
-     const char **parts, int *part_lens, int part_count,
-     bool ends_percent, int part_idx, int min_pos,
-     RoaringBitmap *current_candidates, int max_len)
- {
-     int remaining_len = 0;
-     int i;
-     int max_pos;
-     int pos;
+ /*
+  * Match a pattern of two or more parts.  For each record the engine keeps
+  * the frontier: the earliest position at which the parts matched so far
+  * end, stored as one bitmap of records per end position.  Taking the
+  * leftmost match of each part is always safe, since a later one would only
+  * leave less room for the parts after it.  So a floating part is tried
+  * once at each position, against the records whose frontier has been
+  * reached there, and each record drops out at its first match.  The cost
+  * grows linearly with the number of parts instead of exponentially.
+  */
+ static RoaringBitmap* biscuit_match_multipart(BiscuitIndex *idx, ParsedPattern *parsed, int min_len, bool fold) {
+     int nparts = parsed->part_count;
+     int first = parsed->starts_percent ? 0 : 1;         /* first floating part */
+     int last = parsed->ends_percent ? nparts : nparts - 1;  /* one past the last */
+     int nfront = idx->max_len + 2;
+     int remaining = min_len;
+     RoaringBitmap **front;
+     RoaringBitmap *filter;
+     RoaringBitmap *result;
+     int j, e;
      
-     if (part_idx >= part_count) {
-         biscuit_roaring_or_inplace(result, current_candidates);
-         return;
-     }
+     if (min_len > idx->max_len)
+         return biscuit_roaring_create();
      
-     for (i = part_idx + 1; i < part_count; i++)
-         remaining_len += part_lens[i];
+     /* OPTIMIZATION: Only records holding every concrete character can match */
+     filter = biscuit_char_prefilter(idx, parsed, fold);
+     if (filter && biscuit_roaring_is_empty(filter))
+         return filter;
      
-     /* OPTIMIZATION 4: Handle last part specially */
-     if (part_idx == part_count - 1 && !ends_percent) {
-         RoaringBitmap *last_match = biscuit_match_part_at_end(idx, parts[part_idx], part_lens[part_idx]);
-         biscuit_roaring_and_inplace(last_match, current_candidates);
-         biscuit_roaring_or_inplace(result, last_match);
-         biscuit_roaring_free(last_match);
-         return;
+     front = (RoaringBitmap **)palloc0(nfront * sizeof(RoaringBitmap *));
+     if (parsed->starts_percent) {
+         front[0] = biscuit_get_length_ge(idx, min_len);
+         if (filter)
+             biscuit_roaring_and_inplace(front[0], filter);
+     } else {
+         /* The first part is anchored at the start */
+         front[parsed->part_lens[0]] = biscuit_match_part_at_pos(idx, parsed->parts[0], parsed->part_lens[0], 0, filter, fold);
+         biscuit_roaring_and_inplace(front[parsed->part_lens[0]], idx->length_ge_bitmaps[min_len]);
+         remaining -= parsed->part_lens[0];
+     }
+     biscuit_roaring_free(filter);
+     
+     for (j = first; j < last; j++) {
+         const char *part = parsed->parts[j];
+         int len = parsed->part_lens[j];
+         RoaringBitmap **next = (RoaringBitmap **)palloc0(nfront * sizeof(RoaringBitmap *));
+         RoaringBitmap *active = biscuit_roaring_create();
+         int hi = -1;
+         int pos;
+         
+         for (e = 0; e < nfront; e++) {
+             if (front[e])
+                 hi = e;
+         }
+         
+         /* remaining now counts only the parts after this one */
+         remaining -= len;
+         for (pos = 0; pos + len + remaining <= idx->max_len; pos++) {
+             RoaringBitmap *match;
+             
+             if (front[pos]) {
+                 biscuit_roaring_or_inplace(active, front[pos]);
+                 biscuit_roaring_free(front[pos]);
+                 front[pos] = NULL;
+             }
+             if (biscuit_roaring_is_empty(active)) {
+                 /* OPTIMIZATION 2: Nothing left to extend */
+                 if (pos >= hi)
+                     break;
+                 continue;
+             }
+             
+             match = biscuit_match_part_at_pos(idx, part, len, pos, active, fold);
+             biscuit_roaring_and_inplace(match, active);
+             if (biscuit_roaring_is_empty(match)) {
+                 biscuit_roaring_free(match);
+                 continue;
+             }
+             biscuit_roaring_andnot_inplace(active, match);
+             next[pos + len] = match;
+         }
+         
+         biscuit_roaring_free(active);
+         for (e = 0; e < nfront; e++)
+             biscuit_roaring_free(front[e]);
+         pfree(front);
+         front = next;
      }
      
-     max_pos = max_len - part_lens[part_idx] - remaining_len;
-     if (min_pos > max_pos) return;
-     
-     for (pos = min_pos; pos <= max_pos; pos++) {
-         RoaringBitmap *part_at_pos = biscuit_match_part_at_pos(idx, parts[part_idx], part_lens[part_idx], pos);
-         biscuit_roaring_and_inplace(part_at_pos, current_candidates);
+     result = biscuit_roaring_create();
+     if (parsed->ends_percent) {
+         for (e = 0; e < nfront; e++) {
+             if (front[e])
+                 biscuit_roaring_or_inplace(result, front[e]);
+         }
+     } else {
+         /* The last part is anchored at the end and must start at or after the frontier */
+         int len = parsed->part_lens[nparts - 1];
+         RoaringBitmap *tail = biscuit_match_part_at_end(idx, parsed->parts[nparts - 1], len, fold);
          
-         /* OPTIMIZATION: Skip recursion if no matches */
-         if (!biscuit_roaring_is_empty(part_at_pos)) {
-             biscuit_recursive_windowed_match(result, idx, parts, part_lens, part_count, ends_percent,
-                                     part_idx + 1, pos + part_lens[part_idx], part_at_pos, max_len);
+         for (e = 0; e < nfront; e++) {
+             if (!front[e] || e + len > idx->max_len)
+                 continue;
+             biscuit_roaring_and_inplace(front[e], idx->length_ge_bitmaps[e + len]);
+             biscuit_roaring_and_inplace(front[e], tail);
+             biscuit_roaring_or_inplace(result, front[e]);
          }
-         biscuit_roaring_free(part_at_pos);
+         biscuit_roaring_free(tail);
      }
+     
+     for (e = 0; e < nfront; e++)
+         biscuit_roaring_free(front[e]);
+     pfree(front);
+     
+     return result;
  }
  
- static RoaringBitmap* biscuit_query_pattern(BiscuitIndex *idx, const char *pattern) {
+ /* Records matching a LIKE pattern; with fold, an ASCII-lowercased pattern ignoring case */
+ static RoaringBitmap* biscuit_query_pattern(BiscuitIndex *idx, const char *pattern, bool fold) {
      int plen;
      ParsedPattern *parsed;
      int min_len;
@@ -782,21 +1769,15 @@
          return biscuit_roaring_create();
      }
      
-     /* OPTIMIZATION: Single '%' matches everything */
-     if (plen == 1 && pattern[0] == '%') {
-         result = biscuit_roaring_create();
-         for (i = 0; i < idx->num_records; i++)
-             biscuit_roaring_add(result, i);
-         return result;
-     }
+     /* OPTIMIZATION: Single '%' matches everything (every record has a length >= 0) */
+     if (plen == 1 && pattern[0] == '%')
+         return biscuit_get_length_ge(idx, 0);
      
      parsed = biscuit_parse_pattern(pattern);
      
      /* OPTIMIZATION: Pattern is all '%' - matches everything */
      if (parsed->part_count == 0) {
-         result = biscuit_roaring_create();
-         for (i = 0; i < idx->num_records; i++)
-             biscuit_roaring_add(result, i);
+         result = biscuit_get_length_ge(idx, 0);
          pfree(parsed->parts);
          pfree(parsed->part_lens);
          pfree(parsed);
@@ -811,40 +1792,45 @@
      if (parsed->part_count == 1) {
          if (!parsed->starts_percent && !parsed->ends_percent) {
              /* Exact match: 'abc' */
-             result = biscuit_match_part_at_pos(idx, parsed->parts[0], parsed->part_lens[0], 0);
+             result = biscuit_match_part_at_pos(idx, parsed->parts[0], parsed->part_lens[0], 0, NULL, fold);
              /* OPTIMIZATION 5: Only filter by length if needed */
              if (min_len < idx->max_length && idx->length_bitmaps[min_len]) {
                  biscuit_roaring_and_inplace(result, idx->length_bitmaps[min_len]);
              }
          } else if (!parsed->starts_percent) {
              /* Prefix match: 'abc%' */
-             result = biscuit_match_part_at_pos(idx, parsed->parts[0], parsed->part_lens[0], 0);
+             result = biscuit_match_part_at_pos(idx, parsed->parts[0], parsed->part_lens[0], 0, NULL, fold);
              RoaringBitmap *len_filter = biscuit_get_length_ge(idx, min_len);
              biscuit_roaring_and_inplace(result, len_filter);
              biscuit_roaring_free(len_filter);
          } else if (!parsed->ends_percent) {
              /* Suffix match: '%abc' */
-             result = biscuit_match_part_at_end(idx, parsed->parts[0], parsed->part_lens[0]);
+             result = biscuit_match_part_at_end(idx, parsed->parts[0], parsed->part_lens[0], fold);
              RoaringBitmap *len_filter = biscuit_get_length_ge(idx, min_len);
              biscuit_roaring_and_inplace(result, len_filter);
              biscuit_roaring_free(len_filter);
          } else {
              /* Substring match: '%abc%' */
+             RoaringBitmap *candidates = biscuit_char_prefilter(idx, parsed, fold);
+             
+             if (!candidates)
+                 candidates = biscuit_get_length_ge(idx, min_len);
+             else
+                 biscuit_roaring_and_inplace(candidates, idx->length_ge_bitmaps[Min(min_len, idx->max_length)]);
+             
              result = biscuit_roaring_create();
-             /* OPTIMIZATION: Only search positions where pattern can fit */
-             for (i = 0; i <= idx->max_len - parsed->part_lens[0]; i++) {
-                 RoaringBitmap *match = biscuit_match_part_at_pos(idx, parsed->parts[0], parsed->part_lens[0], i);
+             /* OPTIMIZATION: Only search positions where pattern can fit, until every candidate is found */
+             for (i = 0; i <= idx->max_len - parsed->part_lens[0] && !biscuit_roaring_is_empty(candidates); i++) {
+                 RoaringBitmap *match = biscuit_match_part_at_pos(idx, parsed->parts[0], parsed->part_lens[0], i, candidates, fold);
+                 biscuit_roaring_andnot_inplace(candidates, match);
                  biscuit_roaring_or_inplace(result, match);
                  biscuit_roaring_free(match);
              }
+             biscuit_roaring_free(candidates);
          }
      } else {
-         /* Multi-part pattern - use recursive matching */
-         RoaringBitmap *initial = biscuit_get_length_ge(idx, min_len);
-         result = biscuit_roaring_create();
-         biscuit_recursive_windowed_match(result, idx, (const char **)parsed->parts, parsed->part_lens,
-                                 parsed->part_count, parsed->ends_percent, 0, 0, initial, idx->max_len);
-         biscuit_roaring_free(initial);
+         /* Multi-part pattern */
+         result = biscuit_match_multipart(idx, parsed, min_len, fold);
      }
      
      for (i = 0; i < parsed->part_count; i++)
@@ -856,230 +1842,625 @@
      return result;
  }
  
- /* ==================== IAM CALLBACK FUNCTIONS ==================== */
+ /*
+  * Whether biscuit_query_pattern answers a pattern exactly.  The engine
+  * indexes strings up to MAX_POSITIONS bytes, reads '\' as a literal rather
+  * than an escape, and lets '_' stand for one byte, which is one character
+  * only in single-byte encodings.  Past any of these its result can both
+  * miss matches and hold strings that do not match.
+  */
+ static bool biscuit_like_is_exact(BiscuitIndex *idx, const char *pattern) {
+     if (idx->max_len >= MAX_POSITIONS)
+         return false;
+     if (strchr(pattern, '\\'))
+         return false;
+     if (pg_database_encoding_max_length() > 1 && strchr(pattern, '_'))
+         return false;
+     return true;
+ }
  
- static IndexBuildResult *
- biscuit_build(Relation heap, Relation index, IndexInfo *indexInfo)
- {
-     IndexBuildResult *result;
-     BiscuitIndex *idx;
-     TableScanDesc scan;
-     TupleTableSlot *slot;
-     Datum values[1];
-     bool isnull[1];
-     int natts;
-     int ch;
-     int rec_idx;
-     MemoryContext oldcontext;
-     MemoryContext indexContext;
-     
-     natts = indexInfo->ii_NumIndexAttrs;
-     
-     if (natts != 1)
-         ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                 errmsg("biscuit index supports only one column")));
-     
-     /* Create persistent memory context for index */
-     if (!index->rd_indexcxt) {
-         index->rd_indexcxt = AllocSetContextCreate(CacheMemoryContext,
-                                                     "Biscuit index context",
-                                                     ALLOCSET_DEFAULT_SIZES);
-     }
-     indexContext = index->rd_indexcxt;
-     oldcontext = MemoryContextSwitchTo(indexContext);
-     
-     /* Initialize in-memory index */
-     idx = (BiscuitIndex *)palloc0(sizeof(BiscuitIndex));
-     idx->capacity = 1024;
-     idx->num_records = 0;
-     idx->tids = (ItemPointerData *)palloc(idx->capacity * sizeof(ItemPointerData));
-     idx->data_cache = (char **)palloc(idx->capacity * sizeof(char *));
-     idx->max_len = 0;
-     
-     for (ch = 0; ch < CHAR_RANGE; ch++) {
-         idx->pos_idx[ch].entries = (PosEntry *)palloc(64 * sizeof(PosEntry));
-         idx->pos_idx[ch].count = 0;
-         idx->pos_idx[ch].capacity = 64;
-         idx->neg_idx[ch].entries = (PosEntry *)palloc(64 * sizeof(PosEntry));
-         idx->neg_idx[ch].count = 0;
-         idx->neg_idx[ch].capacity = 64;
-         idx->char_cache[ch] = NULL;
+ /*
+  * A pattern that the engine answers with a superset of a LIKE pattern's
+  * matches.  Escaped characters become literals, or '_' for the wildcards,
+  * which the engine cannot escape.  In multibyte encodings '_' becomes '%',
+  * as one character may span several bytes.
+  */
+ static char* biscuit_like_widen(const char *pattern) {
+     bool multibyte = pg_database_encoding_max_length() > 1;
+     char *widened = (char *)palloc(strlen(pattern) + 1);
+     char *q = widened;
+     const char *p;
+     
+     for (p = pattern; *p; p++) {
+         if (*p == '\\' && p[1]) {
+             p++;
+             *q++ = (*p == '%' || *p == '_') ? '_' : *p;
+         } else if (*p == '_' && multibyte) {
+             *q++ = '%';
+         } else {
+             *q++ = *p;
+         }
      }
+     *q = '\0';
      
-     /* Initialize CRUD structures */
-     biscuit_init_crud_structures(idx);
-     
-     MemoryContextSwitchTo(oldcontext);
-     
-     /* Scan heap and build index */
-     slot = table_slot_create(heap, NULL);
-     scan = table_beginscan(heap, SnapshotAny, 0, NULL);
+     return widened;
+ }
+ 
+ /*
+  * Adds the records longer than MAX_POSITIONS bytes, whose unindexed tail
+  * the engine cannot see, to candidates that the executor rechecks.  They
+  * all have the longest indexed length.
+  */
+ static void biscuit_add_truncated(BiscuitIndex *idx, RoaringBitmap *candidates) {
+     if (idx->max_len >= MAX_POSITIONS && idx->length_bitmaps[MAX_POSITIONS])
+         biscuit_roaring_or_inplace(candidates, idx->length_bitmaps[MAX_POSITIONS]);
+ }
+ 
+ /*
+  * Upper bound on the records a pattern can match: the count of its rarest
+  * concrete character, from char_cache (both cases for ILIKE, leaving out
+  * letters that may fold from non-ASCII characters), plus the records
+  * longer than the indexed prefix that char_cache only partly knows.  It
+  * costs no bitmap operations, so scans use it to order their keys.
+  */
+ static uint64_t biscuit_estimate_pattern(BiscuitIndex *idx, const char *pattern, bool ilike) {
+     uint64_t estimate = (uint64_t)(idx->num_records - idx->free_count);
+     uint64_t truncated = 0;
+     const char *p;
      
-     elog(INFO, "Biscuit: Starting index build on relation %s", RelationGetRelationName(heap));
+     if (idx->max_len >= MAX_POSITIONS && idx->length_bitmaps[MAX_POSITIONS])
+         truncated = biscuit_roaring_count(idx->length_bitmaps[MAX_POSITIONS]);
      
-     while (table_scan_getnextslot(scan, ForwardScanDirection, slot)) {
-         int pos;
-         text *txt;
-         char *str;
-         int len;
-         bool should_free;
+     for (p = pattern; *p; p++) {
+         unsigned char uch = (unsigned char)*p;
+         uint64_t card;
          
-         slot_getallattrs(slot);
-         
-         values[0] = slot_getattr(slot, indexInfo->ii_IndexAttrNumbers[0], &isnull[0]);
+         if (uch == '%' || uch == '_' || uch == '\\')
+             continue;
+         if (ilike) {
+             if (IS_HIGHBIT_SET(uch))
+                 continue;
+             uch = pg_ascii_tolower(uch);
+             if (biscuit_fold_is_ambiguous(uch))
+                 continue;
+         }
          
-         if (!isnull[0]) {
-             txt = DatumGetTextPP(values[0]);
-             str = VARDATA_ANY(txt);
-             len = VARSIZE_ANY_EXHDR(txt);
-             should_free = (txt != DatumGetTextPP(values[0]));
-             
-             if (len > MAX_POSITIONS) len = MAX_POSITIONS;
-             if (len > idx->max_len) idx->max_len = len;
-             
-             oldcontext = MemoryContextSwitchTo(indexContext);
-             
-             if (idx->num_records >= idx->capacity) {
-                 idx->capacity *= 2;
-                 idx->tids = (ItemPointerData *)repalloc(idx->tids, idx->capacity * sizeof(ItemPointerData));
-                 idx->data_cache = (char **)repalloc(idx->data_cache, idx->capacity * sizeof(char *));
-             }
-             ItemPointerCopy(&slot->tts_tid, &idx->tids[idx->num_records]);
-             idx->data_cache[idx->num_records] = pstrdup(str);
-             
-             for (pos = 0; pos < len; pos++) {
-                 unsigned char uch = (unsigned char)str[pos];
-                 RoaringBitmap *bm;
-                 int neg_offset;
-                 
-                 bm = biscuit_get_pos_bitmap(idx, uch, pos);
-                 if (!bm) {
-                     bm = biscuit_roaring_create();
-                     biscuit_set_pos_bitmap(idx, uch, pos, bm);
-                 }
-                 biscuit_roaring_add(bm, idx->num_records);
-                 
-                 neg_offset = -(len - pos);
-                 bm = biscuit_get_neg_bitmap(idx, uch, neg_offset);
-                 if (!bm) {
-                     bm = biscuit_roaring_create();
-                     biscuit_set_neg_bitmap(idx, uch, neg_offset, bm);
-                 }
-                 biscuit_roaring_add(bm, idx->num_records);
-                 
-                 if (!idx->char_cache[uch])
-                     idx->char_cache[uch] = biscuit_roaring_create();
-                 biscuit_roaring_add(idx->char_cache[uch], idx->num_records);
-             }
-             
-             idx->num_records++;
-             
-             MemoryContextSwitchTo(oldcontext);
+         card = idx->char_cache[uch] ? biscuit_roaring_count(idx->char_cache[uch]) : 0;
+         if (ilike && biscuit_is_lower(uch)) {
+             unsigned char upper = pg_ascii_toupper(uch);
              
-             if (should_free)
-                 pfree(txt);
+             if (idx->char_cache[upper])
+                 card += biscuit_roaring_count(idx->char_cache[upper]);
          }
+         estimate = Min(estimate, card + truncated);
      }
      
-     table_endscan(scan);
-     ExecDropSingleTupleTableSlot(slot);
+     return estimate;
+ }
+ 
+ /*
+  * Whether folding ASCII case gives the same result as ILIKE under a
+  * collation.  ILIKE lowers both sides with the collation's rules, which
+  * only the C collation limits to ASCII.  Single-byte encodings fold byte
+  * by byte, so there only the ambiguous letters can fold elsewhere.
+  */
+ static bool biscuit_ascii_fold_is_exact(const char *pattern, Oid collation) {
+     const char *p;
      
-     elog(INFO, "Biscuit: Indexed %d records, max_len=%d", idx->num_records, idx->max_len);
+     if (lc_ctype_is_c(collation))
+         return true;
+     if (pg_database_encoding_max_length() > 1)
+         return false;
+     for (p = pattern; *p; p++) {
+         if (biscuit_fold_is_ambiguous(pg_ascii_tolower((unsigned char)*p)))
+             return false;
+     }
+     return true;
+ }
+ 
+ /*
+  * Records that may match an ILIKE pattern.  The case-folded layer answers
+  * exactly for patterns of ASCII characters that LIKE would also answer
+  * exactly, when the collation folds case like ASCII does.  Otherwise the
+  * result is only narrowed to records holding each ASCII character of the
+  * pattern in either case, and *recheck is set for the executor to apply
+  * the operator.  Letters that may fold from non-ASCII characters do not
+  * narrow it unless the collation is C, and records longer than the
+  * indexed prefix are always kept.
+  */
+ static RoaringBitmap* biscuit_query_ilike(BiscuitIndex *idx, const char *pattern, Oid collation, bool *recheck) {
+     RoaringBitmap *result;
+     bool seen[CHAR_RANGE];
+     bool c_ctype = lc_ctype_is_c(collation);
+     const char *p;
      
-     oldcontext = MemoryContextSwitchTo(indexContext);
+     for (p = pattern; *p && !IS_HIGHBIT_SET(*p); p++)
+         ;
      
-     /* Build length bitmaps */
-     idx->max_length = idx->max_len + 1;
-     idx->length_bitmaps = (RoaringBitmap **)palloc0(idx->max_length * sizeof(RoaringBitmap *));
-     idx->length_ge_bitmaps = (RoaringBitmap **)palloc0((idx->max_length + 1) * sizeof(RoaringBitmap *));
+     if (idx->fold_idx && *p == '\0' && biscuit_like_is_exact(idx, pattern) &&
+         biscuit_ascii_fold_is_exact(pattern, collation)) {
+         char *lowered = pstrdup(pattern);
+         char *q;
+         
+         for (q = lowered; *q; q++)
+             *q = pg_ascii_tolower((unsigned char)*q);
+         result = biscuit_query_pattern(idx, lowered, true);
+         pfree(lowered);
+         *recheck = false;
+         return result;
+     }
      
-     for (ch = 0; ch <= idx->max_length; ch++)
-         idx->length_ge_bitmaps[ch] = biscuit_roaring_create();
+     *recheck = true;
+     result = biscuit_get_length_ge(idx, 0);
+     memset(seen, 0, sizeof(seen));
+     for (p = pattern; *p && !biscuit_roaring_is_empty(result); p++) {
+         unsigned char uch = (unsigned char)pg_ascii_tolower((unsigned char)*p);
+         RoaringBitmap *bm;
+         
+         /* Wildcards and escapes say nothing; other bytes may fold unlike ASCII */
+         if (uch == '%' || uch == '_' || uch == '\\' || IS_HIGHBIT_SET(uch) || seen[uch])
+             continue;
+         if (!c_ctype && biscuit_fold_is_ambiguous(uch))
+             continue;
+         seen[uch] = true;
+         
+         if (biscuit_is_lower(uch)) {
+             unsigned char upper = pg_ascii_toupper(uch);
+             
+             bm = biscuit_roaring_create();
+             if (idx->char_cache[uch])
+                 biscuit_roaring_or_inplace(bm, idx->char_cache[uch]);
+             if (idx->char_cache[upper])
+                 biscuit_roaring_or_inplace(bm, idx->char_cache[upper]);
+             biscuit_roaring_and_inplace(result, bm);
+             biscuit_roaring_free(bm);
+         } else if (idx->char_cache[uch]) {
+             biscuit_roaring_and_inplace(result, idx->char_cache[uch]);
+         } else {
+             biscuit_roaring_free(result);
+             result = biscuit_roaring_create();
+         }
+     }
      
-     MemoryContextSwitchTo(oldcontext);
+     /* char_cache only knows the indexed prefix of each string */
+     biscuit_add_truncated(idx, result);
+     return result;
+ }
+ 
+ /* ==================== REGULAR EXPRESSIONS ==================== */
+ 
+ /*
+  * A regular expression is answered through a LIKE pattern that every
+  * string it matches also matches; the executor rechecks the candidates.
+  * The pattern comes from the regex engine's NFA (see regex/regexport.h),
+  * walked from the initial state for as long as every path must go through
+  * the same next state.  Each such step becomes a literal character, '_'
+  * for a set of ASCII characters, or '%' for anything wider, with '%' in
+  * front for a state that loops on itself.  Begin- and end-of-string arcs
+  * anchor the pattern.  Where paths part, the walk ends in '%'.
+  *
+  * Every rule only widens the pattern, so the candidates always include
+  * the matches; lookaround constraints are exported as free transitions,
+  * which widens it further.  Embedded options such as (?n) can make ^ and $
+  * match at newlines, so anchors are ignored when the regex has any.
+  */
+ 
+ static void
+ biscuit_like_append_any(StringInfo like)
+ {
+     if (like->len == 0 || like->data[like->len - 1] != '%')
+         appendStringInfoChar(like, '%');
+ }
+ 
+ /* One step of the walk: the characters the arcs to the next state consume */
+ static void
+ biscuit_like_append_step(StringInfo like, pg_wchar *chars, int nchars, bool icase)
+ {
+     char buf[MAX_MULTIBYTE_CHAR_LEN + 1];
+     bool ascii = true;
+     int i;
      
-     /* Rescan to build length bitmaps */
-     slot = table_slot_create(heap, NULL);
-     scan = table_beginscan(heap, SnapshotAny, 0, NULL);
-     rec_idx = 0;
+     for (i = 0; i < nchars; i++) {
+         if (chars[i] >= 0x80)
+             ascii = false;
+     }
      
-     while (table_scan_getnextslot(scan, ForwardScanDirection, slot)) {
-         text *txt;
-         char *str;
-         int len;
-         int i;
-         bool should_free;
-         
-         slot_getallattrs(slot);
+     if (nchars == 1) {
+         int len = pg_wchar2mb_with_len(chars, buf, 1);
          
-         values[0] = slot_getattr(slot, indexInfo->ii_IndexAttrNumbers[0], &isnull[0]);
+         appendBinaryStringInfo(like, buf, len);
+     } else if (icase && nchars == 2 && ascii && chars[0] != chars[1] &&
+                pg_ascii_tolower((unsigned char)chars[0]) == pg_ascii_tolower((unsigned char)chars[1])) {
+         appendStringInfoChar(like, pg_ascii_tolower((unsigned char)chars[0]));
+     } else if (ascii && nchars > 0) {
+         appendStringInfoChar(like, '_');
+     } else {
+         biscuit_like_append_any(like);
+     }
+ }
+ 
+ static char*
+ biscuit_regex_to_like(const char *re, bool icase, Oid collation)
+ {
+     regex_t regex;
+     pg_wchar *wre;
+     int relen = strlen(re);
+     int wlen;
+     StringInfoData like;
+     bool use_anchors = strstr(re, "(?") == NULL;
+     bool anchored_start = false;
+     bool anchored_end = false;
+     bool *visited;
+     int final;
+     int state;
+     
+     wre = (pg_wchar *)palloc((relen + 1) * sizeof(pg_wchar));
+     wlen = pg_mb2wchar_with_len(re, wre, relen);
+     if (!OidIsValid(collation))
+         collation = DEFAULT_COLLATION_OID;
+     if (pg_regcomp(&regex, wre, wlen, REG_ADVANCED | (icase ? REG_ICASE : 0), collation) != REG_OKAY) {
+         /* Let the executor report the error when it applies the operator */
+         pfree(wre);
+         return pstrdup("%");
+     }
+     pfree(wre);
+     
+     initStringInfo(&like);
+     visited = (bool *)palloc0(pg_reg_getnumstates(&regex) * sizeof(bool));
+     final = pg_reg_getfinalstate(&regex);
+     state = pg_reg_getinitialstate(&regex);
+     
+     while (state != final && !visited[state] && like.len < MAX_POSITIONS) {
+         int narcs = pg_reg_getnumoutarcs(&regex, state);
+         regex_arc_t *arcs = (regex_arc_t *)palloc(Max(narcs, 1) * sizeof(regex_arc_t));
+         pg_wchar chars[CHAR_RANGE];
+         int nchars = 0;
+         int target = -1;
+         bool loops = false;
+         bool begin = false;
+         bool end = false;
+         bool wide = false;
+         bool parted = false;
+         int i;
          
-         if (!isnull[0]) {
-             txt = DatumGetTextPP(values[0]);
-             str = VARDATA_ANY(txt);
-             len = VARSIZE_ANY_EXHDR(txt);
-             should_free = (txt != DatumGetTextPP(values[0]));
-             
-             oldcontext = MemoryContextSwitchTo(indexContext);
+         visited[state] = true;
+         pg_reg_getoutarcs(&regex, state, arcs, narcs);
+         for (i = 0; i < narcs && !parted; i++) {
+             int co = arcs[i].co;
+             int n;
              
-             if (len < idx->max_length) {
-                 if (!idx->length_bitmaps[len])
-                     idx->length_bitmaps[len] = biscuit_roaring_create();
-                 biscuit_roaring_add(idx->length_bitmaps[len], rec_idx);
+             if (arcs[i].to == state) {
+                 loops = true;
+                 continue;
              }
+             if (target >= 0 && arcs[i].to != target) {
+                 parted = true;
+                 continue;
+             }
+             target = arcs[i].to;
              
-             for (i = 0; i <= len && i < idx->max_length; i++)
-                 biscuit_roaring_add(idx->length_ge_bitmaps[i], rec_idx);
-             
-             MemoryContextSwitchTo(oldcontext);
-             
-             rec_idx++;
-             if (should_free)
-                 pfree(txt);
+             if (pg_reg_colorisbegin(&regex, co)) {
+                 begin = true;
+                 continue;
+             }
+             if (pg_reg_colorisend(&regex, co)) {
+                 end = true;
+                 continue;
+             }
+             n = pg_reg_getnumcharacters(&regex, co);
+             if (n <= 0 || nchars + n > CHAR_RANGE) {
+                 wide = true;
+                 continue;
+             }
+             pg_reg_getcharacters(&regex, co, chars + nchars, n);
+             nchars += n;
+         }
+         pfree(arcs);
+         
+         if (parted || target < 0)
+             break;
+         
+         if (begin && !end && !wide && nchars == 0) {
+             /* Only the start of the string leads on, whatever the loops */
+             if (like.len == 0 && use_anchors)
+                 anchored_start = true;
+             else
+                 biscuit_like_append_any(&like);
+         } else if (end && !begin && !wide && nchars == 0) {
+             if (loops)
+                 biscuit_like_append_any(&like);
+             anchored_end = use_anchors;
+             break;
+         } else {
+             if (loops)
+                 biscuit_like_append_any(&like);
+             if (begin || end || wide)
+                 biscuit_like_append_any(&like);
+             else
+                 biscuit_like_append_step(&like, chars, nchars, icase);
          }
+         
+         state = target;
      }
      
-     table_endscan(scan);
-     ExecDropSingleTupleTableSlot(slot);
+     pfree(visited);
+     pg_regfree(&regex);
+     
+     if (!anchored_end)
+         biscuit_like_append_any(&like);
+     if (!anchored_start && like.data[0] != '%') {
+         char *floating = psprintf("%%%s", like.data);
+         
+         pfree(like.data);
+         return floating;
+     }
+     return like.data;
+ }
+ 
+ /* ==================== SHARED SNAPSHOTS ==================== */
+ 
+ /*
+  * When pg_biscuit is in shared_preload_libraries, snapshot images are kept
+  * in a DSA area and shared by all backends.  The first backend to load a
+  * given snapshot generation reads it into the area and publishes it in a
+  * registry keyed by database and index; later backends attach to it and
+  * use the tids, strings and bitmaps in place.  Each backend still replays
+  * the change log privately, copying only the bitmaps it has to modify.
+  *
+  * Images are reference counted: the registry holds one reference and every
+  * backend copy built on the image holds another.  The last one to let go
+  * frees it, so an image outlives the backend that loaded it.
+  */
+ 
+ static void
+ biscuit_shmem_request(void)
+ {
+     if (prev_shmem_request_hook)
+         prev_shmem_request_hook();
      
-     index->rd_amcache = idx;
+     RequestAddinShmemSpace(MAXALIGN(sizeof(BiscuitSharedState)));
+     RequestNamedLWLockTranche("pg_biscuit", 1);
+ }
+ 
+ static void
+ biscuit_shmem_startup(void)
+ {
+     bool found;
      
-     elog(INFO, "Biscuit: Index build complete, stored in rd_amcache");
+     if (prev_shmem_startup_hook)
+         prev_shmem_startup_hook();
      
-     result = (IndexBuildResult *)palloc(sizeof(IndexBuildResult));
-     result->heap_tuples = idx->num_records;
-     result->index_tuples = idx->num_records;
+     LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
      
-     return result;
+     biscuit_shared = ShmemInitStruct("pg_biscuit", sizeof(BiscuitSharedState), &found);
+     if (!found) {
+         struct stat st;
+         
+         /* Mapped snapshot files are only a cache; start over with each server */
+         if (stat(BISCUIT_MAP_DIR, &st) == 0)
+             rmtree(BISCUIT_MAP_DIR, false);
+         
+         biscuit_shared->lock = &(GetNamedLWLockTranche("pg_biscuit"))->lock;
+         biscuit_shared->tranche_id = LWLockNewTrancheId();
+         biscuit_shared->area = DSA_HANDLE_INVALID;
+         biscuit_shared->registry = DSHASH_HANDLE_INVALID;
+     }
+     
+     LWLockRelease(AddinShmemInitLock);
  }
  
- /* Helper function to rebuild index from disk */
- static BiscuitIndex* biscuit_load_index(Relation index)
+ static void
+ biscuit_registry_params(dshash_parameters *params)
+ {
+     MemSet(params, 0, sizeof(dshash_parameters));
+     params->key_size = sizeof(BiscuitRegistryKey);
+     params->entry_size = sizeof(BiscuitRegistryEntry);
+     params->compare_function = dshash_memcmp;
+     params->hash_function = dshash_memhash;
+ #if PG_VERSION_NUM >= 170000
+     params->copy_function = dshash_memcpy;
+ #endif
+     params->tranche_id = biscuit_shared->tranche_id;
+ }
+ 
+ static void
+ biscuit_shared_image_release(dsa_pointer dp)
+ {
+     BiscuitSharedImage *img = (BiscuitSharedImage *)dsa_get_address(biscuit_area, dp);
+     
+     if (pg_atomic_sub_fetch_u32(&img->refcount, 1) == 0)
+         dsa_free(biscuit_area, dp);
+ }
+ 
+ /* Drop this backend's image references; the area itself stays pinned */
+ static void
+ biscuit_shared_detach(int code, Datum arg)
+ {
+     ListCell *lc;
+     
+     if (biscuit_index_cache) {
+         HASH_SEQ_STATUS status;
+         BiscuitCacheEntry *entry;
+         
+         hash_seq_init(&status, biscuit_index_cache);
+         while ((entry = (BiscuitCacheEntry *)hash_seq_search(&status)) != NULL) {
+             if (entry->index && DsaPointerIsValid(entry->index->shared_image)) {
+                 biscuit_shared_image_release(entry->index->shared_image);
+                 entry->index->shared_image = InvalidDsaPointer;
+             }
+         }
+     }
+     
+     foreach(lc, biscuit_retired_indexes) {
+         BiscuitIndex *idx = (BiscuitIndex *)lfirst(lc);
+         
+         if (DsaPointerIsValid(idx->shared_image)) {
+             biscuit_shared_image_release(idx->shared_image);
+             idx->shared_image = InvalidDsaPointer;
+         }
+     }
+ }
+ 
+ /* Attach to the shared area, creating it on first use; false if not preloaded */
+ static bool
+ biscuit_shared_attach(void)
  {
-     Relation heap;
-     TableScanDesc scan;
-     TupleTableSlot *slot;
-     BiscuitIndex *idx;
      MemoryContext oldcontext;
-     MemoryContext indexContext;
-     int ch;
-     int rec_idx;
-     AttrNumber indexcol;
+     dshash_parameters params;
+     
+     if (biscuit_registry)
+         return true;
+     if (!biscuit_shared)
+         return false;
+     
+     oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+     
+     LWLockRegisterTranche(biscuit_shared->tranche_id, "pg_biscuit");
+     biscuit_registry_params(&params);
+     
+     LWLockAcquire(biscuit_shared->lock, LW_EXCLUSIVE);
+     if (biscuit_shared->area == DSA_HANDLE_INVALID) {
+         biscuit_area = dsa_create(biscuit_shared->tranche_id);
+         dsa_pin(biscuit_area);
+         biscuit_registry = dshash_create(biscuit_area, &params, NULL);
+         biscuit_shared->area = dsa_get_handle(biscuit_area);
+         biscuit_shared->registry = dshash_get_hash_table_handle(biscuit_registry);
+     } else {
+         biscuit_area = dsa_attach(biscuit_shared->area);
+         biscuit_registry = dshash_attach(biscuit_area, &params, biscuit_shared->registry, NULL);
+     }
+     dsa_pin_mapping(biscuit_area);
+     LWLockRelease(biscuit_shared->lock);
+     
+     MemoryContextSwitchTo(oldcontext);
+     
+     before_shmem_exit(biscuit_shared_detach, (Datum)0);
+     
+     return true;
+ }
+ 
+ static void
+ biscuit_registry_key(Relation index, BiscuitRegistryKey *key)
+ {
+     key->dbid = MyDatabaseId;
+     key->indexoid = RelationGetRelid(index);
+ }
+ 
+ /* Find the published image of a snapshot generation, taking a reference */
+ static dsa_pointer
+ biscuit_shared_image_find(Relation index, uint32 generation)
+ {
+     BiscuitRegistryKey key;
+     BiscuitRegistryEntry *entry;
+     dsa_pointer dp = InvalidDsaPointer;
+     
+     if (!biscuit_shared_attach())
+         return InvalidDsaPointer;
+     
+     biscuit_registry_key(index, &key);
+     entry = (BiscuitRegistryEntry *)dshash_find(biscuit_registry, &key, false);
+     if (entry) {
+         if (DsaPointerIsValid(entry->image) &&
+             entry->relfilenumber == index->rd_locator.relNumber &&
+             entry->generation == generation) {
+             BiscuitSharedImage *img = (BiscuitSharedImage *)dsa_get_address(biscuit_area, entry->image);
+             
+             pg_atomic_fetch_add_u32(&img->refcount, 1);
+             dp = entry->image;
+         }
+         dshash_release_lock(biscuit_registry, entry);
+     }
+     
+     return dp;
+ }
+ 
+ /* Allocate an unpublished image holding one reference; NULL if out of space */
+ static char*
+ biscuit_shared_image_alloc(uint64 len, dsa_pointer *dp)
+ {
+     BiscuitSharedImage *img;
+     
+     if (!biscuit_shared_attach())
+         return NULL;
      
-     elog(INFO, "Biscuit: Loading index from heap");
+     *dp = dsa_allocate_extended(biscuit_area, BISCUIT_SHARED_IMAGE_HDRSZ + len,
+                                 DSA_ALLOC_HUGE | DSA_ALLOC_NO_OOM);
+     if (!DsaPointerIsValid(*dp))
+         return NULL;
      
-     heap = table_open(index->rd_index->indrelid, AccessShareLock);
-     indexcol = index->rd_index->indkey.values[0];
+     img = (BiscuitSharedImage *)dsa_get_address(biscuit_area, *dp);
+     pg_atomic_init_u32(&img->refcount, 1);
+     img->len = len;
      
-     if (!index->rd_indexcxt) {
-         index->rd_indexcxt = AllocSetContextCreate(CacheMemoryContext,
-                                                     "Biscuit index context",
-                                                     ALLOCSET_DEFAULT_SIZES);
+     return BiscuitSharedImageData(img);
+ }
+ 
+ /*
+  * Publish a freshly read image, replacing any older one.  If another
+  * backend published the same generation meanwhile, ours is dropped and
+  * theirs returned instead.  Either way the caller owns one reference to
+  * the returned image.
+  */
+ static dsa_pointer
+ biscuit_shared_image_publish(Relation index, uint32 generation, dsa_pointer dp)
+ {
+     BiscuitRegistryKey key;
+     BiscuitRegistryEntry *entry;
+     BiscuitSharedImage *img;
+     bool found;
+     
+     biscuit_registry_key(index, &key);
+     entry = (BiscuitRegistryEntry *)dshash_find_or_insert(biscuit_registry, &key, &found);
+     if (!found)
+         entry->image = InvalidDsaPointer;
+     
+     if (DsaPointerIsValid(entry->image) &&
+         entry->relfilenumber == index->rd_locator.relNumber &&
+         entry->generation == generation) {
+         dsa_pointer theirs = entry->image;
+         
+         img = (BiscuitSharedImage *)dsa_get_address(biscuit_area, theirs);
+         pg_atomic_fetch_add_u32(&img->refcount, 1);
+         dshash_release_lock(biscuit_registry, entry);
+         
+         biscuit_shared_image_release(dp);
+         return theirs;
      }
-     indexContext = index->rd_indexcxt;
-     oldcontext = MemoryContextSwitchTo(indexContext);
+     
+     if (DsaPointerIsValid(entry->image))
+         biscuit_shared_image_release(entry->image);
+     
+     img = (BiscuitSharedImage *)dsa_get_address(biscuit_area, dp);
+     pg_atomic_fetch_add_u32(&img->refcount, 1);
+     entry->relfilenumber = index->rd_locator.relNumber;
+     entry->generation = generation;
+     entry->image = dp;
+     dshash_release_lock(biscuit_registry, entry);
+     
+     return dp;
+ }
+ 
+ /* ==================== INDEX LIFECYCLE ==================== */
+ 
+ /*
+  * Allocate an empty in-memory index.  Each index owns a memory context so
+  * that a stale copy can be released as a unit after REINDEX or compaction.
+  */
+ static BiscuitIndex*
+ biscuit_create_index(void)
+ {
+     MemoryContext context;
+     MemoryContext oldcontext;
+     BiscuitIndex *idx;
+     int ch;
+     
+     context = AllocSetContextCreate(CacheMemoryContext,
+                                     "Biscuit index context",
+                                     ALLOCSET_DEFAULT_SIZES);
+     oldcontext = MemoryContextSwitchTo(context);
      
      idx = (BiscuitIndex *)palloc0(sizeof(BiscuitIndex));
+     idx->context = context;
      idx->capacity = 1024;
      idx->num_records = 0;
      idx->tids = (ItemPointerData *)palloc(idx->capacity * sizeof(ItemPointerData));
@@ -1096,149 +2477,3440 @@
          idx->char_cache[ch] = NULL;
      }
      
-     biscuit_init_crud_structures(idx);
+     biscuit_init_crud_structures(idx);
+     
+     idx->log_blkno = InvalidBlockNumber;
+     idx->shared_image = InvalidDsaPointer;
+     idx->ngram = 1;
+     
+     MemoryContextSwitchTo(oldcontext);
+     
+     return idx;
+ }
+ 
+ /* Allocate length bitmaps once max_len is known; caller is in idx->context */
+ static void
+ biscuit_init_length_bitmaps(BiscuitIndex *idx)
+ {
+     int i;
+     
+     idx->max_length = idx->max_len + 1;
+     idx->length_bitmaps = (RoaringBitmap **)palloc0(idx->max_length * sizeof(RoaringBitmap *));
+     idx->length_ge_bitmaps = (RoaringBitmap **)palloc0((idx->max_length + 1) * sizeof(RoaringBitmap *));
+     
+     for (i = 0; i <= idx->max_length; i++)
+         idx->length_ge_bitmaps[i] = biscuit_roaring_create();
+ }
+ 
+ /* Add a record to the positional n-gram bitmaps, if the index keeps them */
+ static void
+ biscuit_add_ngram_bitmaps(BiscuitIndex *idx, uint32_t rec_idx, const char *str, int len)
+ {
+     int pos;
+     
+     if (!idx->ngram_idx)
+         return;
+     
+     for (pos = 0; pos + idx->ngram <= len; pos++) {
+         BiscuitNgramKey key;
+         BiscuitNgramEntry *entry;
+         bool found;
+         
+         key.gram = biscuit_ngram_gram(str + pos, idx->ngram);
+         key.pos = pos;
+         entry = (BiscuitNgramEntry *)hash_search(idx->ngram_idx, &key, HASH_ENTER, &found);
+         if (!found)
+             entry->bitmap = biscuit_roaring_create();
+         biscuit_roaring_add(biscuit_roaring_thaw(&entry->bitmap), rec_idx);
+     }
+ }
+ 
+ static void
+ biscuit_remove_ngram_bitmaps(BiscuitIndex *idx, uint32_t rec_idx, const char *str, int len)
+ {
+     int pos;
+     
+     if (!idx->ngram_idx)
+         return;
+     
+     for (pos = 0; pos + idx->ngram <= len; pos++) {
+         BiscuitNgramKey key;
+         BiscuitNgramEntry *entry;
+         
+         key.gram = biscuit_ngram_gram(str + pos, idx->ngram);
+         key.pos = pos;
+         entry = (BiscuitNgramEntry *)hash_search(idx->ngram_idx, &key, HASH_FIND, NULL);
+         if (entry)
+             biscuit_remove_record(&entry->bitmap, rec_idx);
+     }
+ }
+ 
+ static void
+ biscuit_free_ngram_bitmaps(BiscuitIndex *idx)
+ {
+     HASH_SEQ_STATUS status;
+     BiscuitNgramEntry *entry;
+     
+     if (!idx->ngram_idx)
+         return;
+     
+     hash_seq_init(&status, idx->ngram_idx);
+     while ((entry = (BiscuitNgramEntry *)hash_seq_search(&status)) != NULL)
+         biscuit_roaring_free(entry->bitmap);
+     hash_destroy(idx->ngram_idx);
+     idx->ngram_idx = NULL;
+ }
+ 
+ /* Empty hash table of a bitmap layer keyed by BiscuitNgramKey */
+ static HTAB*
+ biscuit_create_layer(BiscuitIndex *idx, const char *name)
+ {
+     HASHCTL ctl;
+     
+     ctl.keysize = sizeof(BiscuitNgramKey);
+     ctl.entrysize = sizeof(BiscuitNgramEntry);
+     ctl.hcxt = idx->context;
+     return hash_create(name, 1024, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+ }
+ 
+ /*
+  * Set up the n-gram layer for n (1 turns it off), deriving it from the
+  * cached strings.  A build does this once and the snapshot keeps the
+  * layer; a load only needs it when the snapshot was written for another
+  * n.  Inserts and cleanups then keep it up to date like the character
+  * bitmaps.
+  */
+ static void
+ biscuit_init_ngram_bitmaps(BiscuitIndex *idx, int n)
+ {
+     int i;
+     
+     biscuit_free_ngram_bitmaps(idx);
+     idx->ngram = n;
+     if (n < 2)
+         return;
+     
+     idx->ngram_idx = biscuit_create_layer(idx, "Biscuit n-gram bitmaps");
+     
+     for (i = 0; i < idx->num_records; i++) {
+         const char *str = idx->data_cache[i];
+         
+         if (str)
+             biscuit_add_ngram_bitmaps(idx, biscuit_record_key(idx, i), str, (int)strnlen(str, MAX_POSITIONS));
+     }
+     
+     elog(DEBUG1, "Biscuit: Built %ld %d-gram bitmaps", hash_get_num_entries(idx->ngram_idx), n);
+ }
+ 
+ /* Add a record to the case-folded bitmaps of its ASCII letters, if kept */
+ static void
+ biscuit_add_fold_bitmaps(BiscuitIndex *idx, uint32_t rec_idx, const char *str, int len)
+ {
+     int pos;
+     
+     if (!idx->fold_idx)
+         return;
+     
+     for (pos = 0; pos < len; pos++) {
+         unsigned char ch = (unsigned char)str[pos];
+         BiscuitNgramKey key;
+         BiscuitNgramEntry *entry;
+         bool found;
+         int k;
+         
+         if (!biscuit_is_upper(ch) && !biscuit_is_lower(ch))
+             continue;
+         ch = pg_ascii_tolower(ch);
+         
+         /* Once from the start and once from the end, like pos_idx and neg_idx */
+         for (k = 0; k < 2; k++) {
+             key.gram = ch;
+             key.pos = k == 0 ? pos : pos - len;
+             entry = (BiscuitNgramEntry *)hash_search(idx->fold_idx, &key, HASH_ENTER, &found);
+             if (!found)
+                 entry->bitmap = biscuit_roaring_create();
+             biscuit_roaring_add(biscuit_roaring_thaw(&entry->bitmap), rec_idx);
+         }
+         
+         if (!idx->fold_cache[ch])
+             idx->fold_cache[ch] = biscuit_roaring_create();
+         biscuit_roaring_add(biscuit_roaring_thaw(&idx->fold_cache[ch]), rec_idx);
+     }
+ }
+ 
+ static void
+ biscuit_remove_fold_bitmaps(BiscuitIndex *idx, uint32_t rec_idx, const char *str, int len)
+ {
+     int pos;
+     
+     if (!idx->fold_idx)
+         return;
+     
+     for (pos = 0; pos < len; pos++) {
+         unsigned char ch = (unsigned char)str[pos];
+         BiscuitNgramKey key;
+         BiscuitNgramEntry *entry;
+         int k;
+         
+         if (!biscuit_is_upper(ch) && !biscuit_is_lower(ch))
+             continue;
+         ch = pg_ascii_tolower(ch);
+         
+         for (k = 0; k < 2; k++) {
+             key.gram = ch;
+             key.pos = k == 0 ? pos : pos - len;
+             entry = (BiscuitNgramEntry *)hash_search(idx->fold_idx, &key, HASH_FIND, NULL);
+             if (entry)
+                 biscuit_remove_record(&entry->bitmap, rec_idx);
+         }
+         biscuit_remove_record(&idx->fold_cache[ch], rec_idx);
+     }
+ }
+ 
+ static void
+ biscuit_free_fold_bitmaps(BiscuitIndex *idx)
+ {
+     HASH_SEQ_STATUS status;
+     BiscuitNgramEntry *entry;
+     int ch;
+     
+     if (!idx->fold_idx)
+         return;
+     
+     hash_seq_init(&status, idx->fold_idx);
+     while ((entry = (BiscuitNgramEntry *)hash_seq_search(&status)) != NULL)
+         biscuit_roaring_free(entry->bitmap);
+     hash_destroy(idx->fold_idx);
+     idx->fold_idx = NULL;
+     
+     for (ch = 0; ch < CHAR_RANGE; ch++) {
+         biscuit_roaring_free(idx->fold_cache[ch]);
+         idx->fold_cache[ch] = NULL;
+     }
+ }
+ 
+ /*
+  * Set up the case-folded layer that answers ILIKE, or drop it.  Only ASCII
+  * letters differ from the character bitmaps, so the layer holds just their
+  * bitmaps, each the union of both cases.  Like the n-gram layer, it is
+  * derived from the cached strings, stored in the snapshot and then
+  * maintained incrementally.
+  */
+ static void
+ biscuit_init_fold_bitmaps(BiscuitIndex *idx, bool casefold)
+ {
+     int i;
+     
+     biscuit_free_fold_bitmaps(idx);
+     idx->casefold = casefold;
+     if (!casefold)
+         return;
+     
+     idx->fold_idx = biscuit_create_layer(idx, "Biscuit case-folded bitmaps");
+     
+     for (i = 0; i < idx->num_records; i++) {
+         const char *str = idx->data_cache[i];
+         
+         if (str)
+             biscuit_add_fold_bitmaps(idx, biscuit_record_key(idx, i), str, (int)strnlen(str, MAX_POSITIONS));
+     }
+     
+     elog(DEBUG1, "Biscuit: Built %ld case-folded bitmaps", hash_get_num_entries(idx->fold_idx));
+ }
+ 
+ static void
+ biscuit_free_index(BiscuitIndex *idx)
+ {
+     int ch, j;
+     
+     /* Roaring bitmaps are malloc'd, so they do not go away with the context */
+     for (ch = 0; ch < CHAR_RANGE; ch++) {
+         for (j = 0; j < idx->pos_idx[ch].count; j++)
+             biscuit_roaring_free(idx->pos_idx[ch].entries[j].bitmap);
+         for (j = 0; j < idx->neg_idx[ch].count; j++)
+             biscuit_roaring_free(idx->neg_idx[ch].entries[j].bitmap);
+         biscuit_roaring_free(idx->char_cache[ch]);
+     }
+     
+     if (idx->length_bitmaps) {
+         for (j = 0; j < idx->max_length; j++)
+             biscuit_roaring_free(idx->length_bitmaps[j]);
+     }
+     if (idx->length_ge_bitmaps) {
+         for (j = 0; j <= idx->max_length; j++)
+             biscuit_roaring_free(idx->length_ge_bitmaps[j]);
+     }
+     biscuit_roaring_free(idx->tombstones);
+     biscuit_roaring_free(idx->unordered);
+     biscuit_free_ngram_bitmaps(idx);
+     biscuit_free_fold_bitmaps(idx);
+     
+     /* The views above pointed into the shared image; now let it go */
+     if (DsaPointerIsValid(idx->shared_image))
+         biscuit_shared_image_release(idx->shared_image);
+     if (idx->mapped)
+         munmap(idx->mapped, idx->mapped_len);
+     
+     MemoryContextDelete(idx->context);
+ }
+ 
+ /* Drop a copy that is no longer current, deferring while scans still use it */
+ static void
+ biscuit_retire_index(BiscuitIndex *idx)
+ {
+     if (idx->refcount > 0) {
+         MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+         
+         idx->retired = true;
+         biscuit_retired_indexes = lappend(biscuit_retired_indexes, idx);
+         MemoryContextSwitchTo(oldcontext);
+     } else {
+         biscuit_free_index(idx);
+     }
+ }
+ 
+ static void
+ biscuit_release_index(BiscuitIndex *idx)
+ {
+     if (idx->refcount > 0)
+         idx->refcount--;
+     if (idx->refcount == 0 && idx->retired) {
+         biscuit_retired_indexes = list_delete_ptr(biscuit_retired_indexes, idx);
+         biscuit_free_index(idx);
+     }
+ }
+ 
+ /*
+  * Scans never outlive their transaction, so at transaction end drop the
+  * pins that scans aborted by an error did not get to release.
+  */
+ static void
+ biscuit_xact_callback(XactEvent event, void *arg)
+ {
+     ListCell *lc;
+     
+     switch (event) {
+         case XACT_EVENT_COMMIT:
+         case XACT_EVENT_PARALLEL_COMMIT:
+         case XACT_EVENT_ABORT:
+         case XACT_EVENT_PARALLEL_ABORT:
+         case XACT_EVENT_PREPARE:
+             break;
+         default:
+             return;
+     }
+     
+     foreach(lc, biscuit_retired_indexes)
+         biscuit_free_index((BiscuitIndex *)lfirst(lc));
+     list_free(biscuit_retired_indexes);
+     biscuit_retired_indexes = NIL;
+     
+     if (biscuit_index_cache) {
+         HASH_SEQ_STATUS status;
+         BiscuitCacheEntry *entry;
+         
+         hash_seq_init(&status, biscuit_index_cache);
+         while ((entry = (BiscuitCacheEntry *)hash_seq_search(&status)) != NULL) {
+             if (entry->index) {
+                 entry->index->refcount = 0;
+                 list_free(entry->index->streams);
+                 entry->index->streams = NIL;
+             }
+         }
+     }
+ }
+ 
+ /*
+  * Find the backend-local cache entry for an index.  The entry is reset when
+  * the index has been given new storage (REINDEX, TRUNCATE).
+  */
+ static BiscuitCacheEntry*
+ biscuit_cache_lookup(Relation index)
+ {
+     BiscuitCacheEntry *entry;
+     Oid indexoid = RelationGetRelid(index);
+     bool found;
+     
+     if (!biscuit_index_cache) {
+         HASHCTL ctl;
+         
+         ctl.keysize = sizeof(Oid);
+         ctl.entrysize = sizeof(BiscuitCacheEntry);
+         ctl.hcxt = CacheMemoryContext;
+         biscuit_index_cache = hash_create("Biscuit index cache", 16, &ctl,
+                                           HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+     }
+     
+     entry = (BiscuitCacheEntry *)hash_search(biscuit_index_cache, &indexoid, HASH_ENTER, &found);
+     
+     if (!found) {
+         entry->relfilenumber = index->rd_locator.relNumber;
+         entry->index = NULL;
+     } else if (entry->relfilenumber != index->rd_locator.relNumber) {
+         if (entry->index)
+             biscuit_retire_index(entry->index);
+         entry->relfilenumber = index->rd_locator.relNumber;
+         entry->index = NULL;
+     }
+     
+     return entry;
+ }
+ 
+ static void
+ biscuit_cache_store(Relation index, BiscuitIndex *idx)
+ {
+     BiscuitCacheEntry *entry = biscuit_cache_lookup(index);
+     
+     if (entry->index && entry->index != idx)
+         biscuit_retire_index(entry->index);
+     entry->index = idx;
+ }
+ 
+ /* Give the index a private tids array before it is modified */
+ static void
+ biscuit_own_tids(BiscuitIndex *idx)
+ {
+     ItemPointerData *tids;
+     
+     if (!idx->tids_shared)
+         return;
+     
+     tids = (ItemPointerData *)MemoryContextAllocHuge(idx->context,
+                                                      (Size)idx->capacity * sizeof(ItemPointerData));
+     memcpy(tids, idx->tids, (Size)idx->num_records * sizeof(ItemPointerData));
+     idx->tids = tids;
+     idx->tids_shared = false;
+ }
+ 
+ static void
+ biscuit_ensure_capacity(BiscuitIndex *idx, int needed)
+ {
+     if (needed <= idx->capacity)
+         return;
+     
+     while (idx->capacity < needed)
+         idx->capacity *= 2;
+     /* A shared tids array is copied at the new capacity on first write */
+     if (!idx->tids_shared)
+         idx->tids = (ItemPointerData *)repalloc_huge(idx->tids,
+                                                     (Size)idx->capacity * sizeof(ItemPointerData));
+     idx->data_cache = (char **)repalloc_huge(idx->data_cache,
+                                             (Size)idx->capacity * sizeof(char *));
+ }
+ 
+ /* Release a cached string unless it lives inside the loaded snapshot image */
+ static void
+ biscuit_free_string(BiscuitIndex *idx, uint32_t rec_idx)
+ {
+     char *str = idx->data_cache[rec_idx];
+     
+     if (str == NULL)
+         return;
+     if (!(idx->image && str >= idx->image && str < idx->image + idx->image_len))
+         pfree(str);
+     idx->data_cache[rec_idx] = NULL;
+ }
+ 
+ /* ==================== RECORD ORDER ==================== */
+ 
+ /*
+  * Record numbers follow heap TID order, so streaming a result bitmap in
+  * record order visits the heap sequentially without sorting.  Builds
+  * number records in scan order.  An insert that lands past the last
+  * ordered TID in a new slot keeps the order; one that reuses a freed slot,
+  * or whose tuple sits before the last ordered one, is recorded in
+  * idx->unordered instead.  Scans sort just those few matches and merge
+  * them in (see biscuit_scan_fill).  Compaction renumbers every record in
+  * TID order, which empties the set again.
+  */
+ 
+ #define BISCUIT_NO_SLOT PG_UINT32_MAX
+ 
+ static int
+ biscuit_compare_rec_tids(const void *a, const void *b, void *arg)
+ {
+     ItemPointerData *tids = (ItemPointerData *)arg;
+     
+     return ItemPointerCompare(&tids[*(const uint32_t *)a], &tids[*(const uint32_t *)b]);
+ }
+ 
+ /* Note where a record just stored in rec_idx falls in TID order */
+ static void
+ biscuit_note_tid_order(BiscuitIndex *idx, uint32_t rec_idx, ItemPointer tid)
+ {
+     /* TID keys are in heap order by construction */
+     if (idx->tid_keys)
+         return;
+     if (rec_idx == (uint32_t)idx->num_records - 1 && ItemPointerCompare(tid, &idx->last_ordered) > 0)
+         ItemPointerCopy(tid, &idx->last_ordered);
+     else
+         biscuit_roaring_add(idx->unordered, rec_idx);
+ }
+ 
+ /*
+  * Derive the unordered set of a freshly built or loaded copy: every record
+  * whose TID does not exceed that of an earlier ordered one.
+  */
+ static void
+ biscuit_init_tid_order(BiscuitIndex *idx)
+ {
+     int i;
+     
+     biscuit_roaring_free(idx->unordered);
+     idx->unordered = biscuit_roaring_create();
+     ItemPointerSet(&idx->last_ordered, 0, InvalidOffsetNumber);
+     if (idx->tid_keys)
+         return;
+     
+     for (i = 0; i < idx->num_records; i++) {
+         if (!idx->data_cache[i])
+             continue;
+         if (ItemPointerCompare(&idx->tids[i], &idx->last_ordered) > 0)
+             ItemPointerCopy(&idx->tids[i], &idx->last_ordered);
+         else
+             biscuit_roaring_add(idx->unordered, i);
+     }
+ }
+ 
+ /* Rewrite a bitmap through map, dropping records mapped to BISCUIT_NO_SLOT */
+ static RoaringBitmap*
+ biscuit_remap_bitmap(RoaringBitmap *rb, const uint32_t *map)
+ {
+     RoaringBitmap *out;
+     uint32_t *values;
+     uint64_t count;
+     uint64_t i, n = 0;
+     
+     if (!rb)
+         return NULL;
+     
+     out = biscuit_roaring_create();
+     values = biscuit_roaring_to_array(rb, &count);
+     if (values) {
+         for (i = 0; i < count; i++) {
+             if (map[values[i]] != BISCUIT_NO_SLOT)
+                 values[n++] = map[values[i]];
+         }
+         /* Mostly sorted still: records keep their order but for the few moved */
+         biscuit_roaring_add_many(out, n, values);
+         biscuit_roaring_optimize(out);
+         pfree(values);
+     }
+     biscuit_roaring_free(rb);
+     return out;
+ }
+ 
+ /*
+  * Renumber the live records of idx in TID order.  Tombstoned records are
+  * dropped and free slots disappear, so the copy comes out with no free
+  * list, no tombstones and nothing out of order.  Every bitmap is rewritten,
+  * which is why this only runs when a whole snapshot is written anyway.
+  */
+ static void
+ biscuit_renumber_records(BiscuitIndex *idx)
+ {
+     MemoryContext oldcontext = MemoryContextSwitchTo(idx->context);
+     uint32_t *order;
+     uint32_t *map;
+     ItemPointerData *tids;
+     char **data_cache;
+     int nlive = 0;
+     int i, j, ch;
+     
+     Assert(!idx->tid_keys);
+     
+     /* Scans must not keep reading the old numbering */
+     biscuit_materialize_streams(idx);
+     
+     order = (uint32_t *)MemoryContextAllocHuge(idx->context, (Size)Max(idx->num_records, 1) * sizeof(uint32_t));
+     map = (uint32_t *)MemoryContextAllocHuge(idx->context, (Size)Max(idx->num_records, 1) * sizeof(uint32_t));
+     for (i = 0; i < idx->num_records; i++) {
+         map[i] = BISCUIT_NO_SLOT;
+         if (!idx->data_cache[i])
+             continue;
+         if (biscuit_roaring_contains(idx->tombstones, i))
+             biscuit_free_string(idx, i);
+         else
+             order[nlive++] = i;
+     }
+     qsort_arg(order, nlive, sizeof(uint32_t), biscuit_compare_rec_tids, idx->tids);
+     
+     tids = (ItemPointerData *)MemoryContextAllocHuge(idx->context, (Size)idx->capacity * sizeof(ItemPointerData));
+     data_cache = (char **)MemoryContextAllocHuge(idx->context, (Size)idx->capacity * sizeof(char *));
+     for (i = 0; i < nlive; i++) {
+         map[order[i]] = i;
+         tids[i] = idx->tids[order[i]];
+         data_cache[i] = idx->data_cache[order[i]];
+     }
+     
+     for (ch = 0; ch < CHAR_RANGE; ch++) {
+         for (j = 0; j < idx->pos_idx[ch].count; j++)
+             idx->pos_idx[ch].entries[j].bitmap = biscuit_remap_bitmap(idx->pos_idx[ch].entries[j].bitmap, map);
+         for (j = 0; j < idx->neg_idx[ch].count; j++)
+             idx->neg_idx[ch].entries[j].bitmap = biscuit_remap_bitmap(idx->neg_idx[ch].entries[j].bitmap, map);
+         idx->char_cache[ch] = biscuit_remap_bitmap(idx->char_cache[ch], map);
+     }
+     for (j = 0; j < idx->max_length; j++)
+         idx->length_bitmaps[j] = biscuit_remap_bitmap(idx->length_bitmaps[j], map);
+     for (j = 0; j <= idx->max_length; j++)
+         idx->length_ge_bitmaps[j] = biscuit_remap_bitmap(idx->length_ge_bitmaps[j], map);
+     if (idx->ngram_idx) {
+         HASH_SEQ_STATUS status;
+         BiscuitNgramEntry *entry;
+         
+         hash_seq_init(&status, idx->ngram_idx);
+         while ((entry = (BiscuitNgramEntry *)hash_seq_search(&status)) != NULL)
+             entry->bitmap = biscuit_remap_bitmap(entry->bitmap, map);
+     }
+     if (idx->fold_idx) {
+         HASH_SEQ_STATUS status;
+         BiscuitNgramEntry *entry;
+         
+         hash_seq_init(&status, idx->fold_idx);
+         while ((entry = (BiscuitNgramEntry *)hash_seq_search(&status)) != NULL)
+             entry->bitmap = biscuit_remap_bitmap(entry->bitmap, map);
+         for (ch = 0; ch < CHAR_RANGE; ch++)
+             idx->fold_cache[ch] = biscuit_remap_bitmap(idx->fold_cache[ch], map);
+     }
+     
+     if (!idx->tids_shared)
+         pfree(idx->tids);
+     idx->tids = tids;
+     idx->tids_shared = false;
+     pfree(idx->data_cache);
+     idx->data_cache = data_cache;
+     idx->num_records = nlive;
+     idx->free_count = 0;
+     biscuit_roaring_free(idx->tombstones);
+     idx->tombstones = biscuit_roaring_create();
+     idx->tombstone_count = 0;
+     
+     biscuit_roaring_free(idx->unordered);
+     idx->unordered = biscuit_roaring_create();
+     if (nlive > 0)
+         ItemPointerCopy(&tids[nlive - 1], &idx->last_ordered);
+     else
+         ItemPointerSet(&idx->last_ordered, 0, InvalidOffsetNumber);
+     
+     pfree(order);
+     pfree(map);
+     MemoryContextSwitchTo(oldcontext);
+ }
+ 
+ /* Whether enough records are out of TID order to be worth a renumbering */
+ static bool
+ biscuit_needs_renumber(BiscuitIndex *idx)
+ {
+     uint64_t unordered = biscuit_roaring_count(idx->unordered);
+     
+     return unordered >= TID_ORDER_MIN_UNORDERED && unordered > (uint64_t)idx->num_records / 8;
+ }
+ 
+ /* Add a record to the position, negative-offset and character bitmaps */
+ static void
+ biscuit_add_char_bitmaps(BiscuitIndex *idx, uint32_t rec_idx, const char *str, int len)
+ {
+     int pos;
+     
+     for (pos = 0; pos < len; pos++) {
+         unsigned char uch = (unsigned char)str[pos];
+         RoaringBitmap *bm;
+         int neg_offset;
+         
+         bm = biscuit_get_pos_bitmap(idx, uch, pos);
+         if (!bm || biscuit_roaring_is_frozen(bm)) {
+             bm = bm ? biscuit_roaring_thaw(&bm) : biscuit_roaring_create();
+             biscuit_set_pos_bitmap(idx, uch, pos, bm);
+         }
+         biscuit_roaring_add(bm, rec_idx);
+         
+         neg_offset = -(len - pos);
+         bm = biscuit_get_neg_bitmap(idx, uch, neg_offset);
+         if (!bm || biscuit_roaring_is_frozen(bm)) {
+             bm = bm ? biscuit_roaring_thaw(&bm) : biscuit_roaring_create();
+             biscuit_set_neg_bitmap(idx, uch, neg_offset, bm);
+         }
+         biscuit_roaring_add(bm, rec_idx);
+         
+         if (!idx->char_cache[uch])
+             idx->char_cache[uch] = biscuit_roaring_create();
+         biscuit_roaring_add(biscuit_roaring_thaw(&idx->char_cache[uch]), rec_idx);
+     }
+ }
+ 
+ /* Grow the length bitmap arrays to new_max lengths; caller is in idx->context */
+ static void
+ biscuit_grow_length_bitmaps(BiscuitIndex *idx, int new_max)
+ {
+     int old_max = idx->max_length;
+     int first_new_ge = 0;
+     int i;
+     
+     RoaringBitmap **new_bitmaps = (RoaringBitmap **)palloc0(new_max * sizeof(RoaringBitmap *));
+     RoaringBitmap **new_ge_bitmaps = (RoaringBitmap **)palloc0((new_max + 1) * sizeof(RoaringBitmap *));
+     
+     if (idx->length_bitmaps) {
+         memcpy(new_bitmaps, idx->length_bitmaps, old_max * sizeof(RoaringBitmap *));
+         memcpy(new_ge_bitmaps, idx->length_ge_bitmaps, (old_max + 1) * sizeof(RoaringBitmap *));
+         pfree(idx->length_bitmaps);
+         pfree(idx->length_ge_bitmaps);
+         first_new_ge = old_max + 1;
+     }
+     
+     for (i = first_new_ge; i <= new_max; i++)
+         new_ge_bitmaps[i] = biscuit_roaring_create();
+     
+     idx->length_bitmaps = new_bitmaps;
+     idx->length_ge_bitmaps = new_ge_bitmaps;
+     idx->max_length = new_max;
+ }
+ 
+ /* Add a record to the length bitmaps, growing them if needed */
+ static void
+ biscuit_add_length(BiscuitIndex *idx, uint32_t rec_idx, int len)
+ {
+     int i;
+     
+     if (len >= idx->max_length)
+         biscuit_grow_length_bitmaps(idx, len + 1);
+     
+     if (!idx->length_bitmaps[len])
+         idx->length_bitmaps[len] = biscuit_roaring_create();
+     biscuit_roaring_add(biscuit_roaring_thaw(&idx->length_bitmaps[len]), rec_idx);
+     
+     for (i = 0; i <= len && i < idx->max_length; i++)
+         biscuit_roaring_add(biscuit_roaring_thaw(&idx->length_ge_bitmaps[i]), rec_idx);
+ }
+ 
+ /* Drop what a dead record still holds in its slot: bits, tombstone and string */
+ static void
+ biscuit_forget_record(BiscuitIndex *idx, uint32_t rec_idx)
+ {
+     const char *old = idx->data_cache[rec_idx];
+     uint32_t key;
+     
+     if (!old)
+         return;
+     
+     key = biscuit_record_key(idx, rec_idx);
+     if (biscuit_roaring_contains(idx->tombstones, key)) {
+         biscuit_roaring_remove(biscuit_roaring_thaw(&idx->tombstones), key);
+         idx->tombstone_count--;
+     }
+     biscuit_remove_ngram_bitmaps(idx, key, old, (int)strnlen(old, MAX_POSITIONS));
+     biscuit_remove_fold_bitmaps(idx, key, old, (int)strnlen(old, MAX_POSITIONS));
+     biscuit_remove_from_all_indices(idx, key);
+     biscuit_free_string(idx, rec_idx);
+ }
+ 
+ /*
+  * With keys = tid, a heap TID is only handed out again once VACUUM has
+  * tombstoned its old entry.  Forget that entry before the key is reused;
+  * it sits in some free slot that has not been cleaned up yet.
+  */
+ static void
+ biscuit_forget_key(BiscuitIndex *idx, uint32_t key)
+ {
+     int i;
+     
+     for (i = idx->free_count - 1; i >= 0; i--) {
+         uint32_t slot = idx->free_list[i];
+         
+         if (idx->data_cache[slot] && biscuit_tid_key(&idx->tids[slot]) == key) {
+             biscuit_forget_record(idx, slot);
+             return;
+         }
+     }
+ }
+ 
+ /*
+  * Store a record in slot rec_idx.  Shared by aminsert and change-log replay,
+  * so the slot is chosen by the caller: either the next new slot or one from
+  * the free list.  Caller switches to idx->context.
+  */
+ static void
+ biscuit_apply_insert(BiscuitIndex *idx, uint32_t rec_idx, ItemPointer tid,
+                      const char *str, int full_len)
+ {
+     int len = Min(full_len, MAX_POSITIONS);
+     uint32_t key;
+     
+     if (rec_idx < (uint32_t)idx->num_records) {
+         biscuit_take_free_slot(idx, rec_idx);
+         biscuit_forget_record(idx, rec_idx);
+     } else {
+         if (rec_idx != (uint32_t)idx->num_records)
+             ereport(ERROR,
+                     (errcode(ERRCODE_INDEX_CORRUPTED),
+                      errmsg("biscuit change log refers to slot %u beyond %d records",
+                             rec_idx, idx->num_records)));
+         biscuit_ensure_capacity(idx, idx->num_records + 1);
+         idx->num_records++;
+     }
+     
+     key = idx->tid_keys ? biscuit_tid_key(tid) : rec_idx;
+     if (idx->tid_keys && biscuit_roaring_contains(idx->tombstones, key))
+         biscuit_forget_key(idx, key);
+     
+     biscuit_own_tids(idx);
+     ItemPointerCopy(tid, &idx->tids[rec_idx]);
+     idx->data_cache[rec_idx] = pnstrdup(str, full_len);
+     biscuit_note_tid_order(idx, rec_idx, tid);
+     
+     if (len > idx->max_len)
+         idx->max_len = len;
+     
+     biscuit_add_char_bitmaps(idx, key, str, len);
+     biscuit_add_ngram_bitmaps(idx, key, str, len);
+     biscuit_add_fold_bitmaps(idx, key, str, len);
+     biscuit_add_length(idx, key, len);
+     
+     idx->insert_count++;
+ }
+ 
+ static void
+ biscuit_apply_tombstone(BiscuitIndex *idx, uint32_t rec_idx)
+ {
+     /* The slot becomes reusable; scans must stop reading tids lazily */
+     biscuit_materialize_streams(idx);
+     
+     biscuit_roaring_add(biscuit_roaring_thaw(&idx->tombstones), biscuit_record_key(idx, rec_idx));
+     idx->tombstone_count++;
+     biscuit_push_free_slot(idx, rec_idx);
+     idx->delete_count++;
+ }
+ 
+ /* Subtract the tombstones, copying a shared bitmap only if it overlaps them */
+ static void
+ biscuit_remove_tombstones(RoaringBitmap **rb, const RoaringBitmap *tombstones)
+ {
+     if (*rb && biscuit_roaring_intersects(*rb, tombstones))
+         biscuit_roaring_andnot_inplace(biscuit_roaring_thaw(rb), tombstones);
+ }
+ 
+ /* Physically remove tombstoned records from every bitmap */
+ static void
+ biscuit_apply_cleanup(BiscuitIndex *idx)
+ {
+     int ch, j;
+     int i;
+     
+     for (ch = 0; ch < CHAR_RANGE; ch++) {
+         CharIndex *pos_cidx = &idx->pos_idx[ch];
+         for (j = 0; j < pos_cidx->count; j++)
+             biscuit_remove_tombstones(&pos_cidx->entries[j].bitmap, idx->tombstones);
+         
+         CharIndex *neg_cidx = &idx->neg_idx[ch];
+         for (j = 0; j < neg_cidx->count; j++)
+             biscuit_remove_tombstones(&neg_cidx->entries[j].bitmap, idx->tombstones);
+         
+         biscuit_remove_tombstones(&idx->char_cache[ch], idx->tombstones);
+     }
+     
+     for (j = 0; j < idx->max_length; j++) {
+         biscuit_remove_tombstones(&idx->length_bitmaps[j], idx->tombstones);
+         biscuit_remove_tombstones(&idx->length_ge_bitmaps[j], idx->tombstones);
+     }
+     
+     if (idx->ngram_idx) {
+         HASH_SEQ_STATUS status;
+         BiscuitNgramEntry *entry;
+         
+         hash_seq_init(&status, idx->ngram_idx);
+         while ((entry = (BiscuitNgramEntry *)hash_seq_search(&status)) != NULL)
+             biscuit_remove_tombstones(&entry->bitmap, idx->tombstones);
+     }
+     if (idx->fold_idx) {
+         HASH_SEQ_STATUS status;
+         BiscuitNgramEntry *entry;
+         
+         hash_seq_init(&status, idx->fold_idx);
+         while ((entry = (BiscuitNgramEntry *)hash_seq_search(&status)) != NULL)
+             biscuit_remove_tombstones(&entry->bitmap, idx->tombstones);
+         for (ch = 0; ch < CHAR_RANGE; ch++)
+             biscuit_remove_tombstones(&idx->fold_cache[ch], idx->tombstones);
+     }
+     biscuit_remove_tombstones(&idx->unordered, idx->tombstones);
+     
+     /* Every tombstoned record sits in a free slot; so do cleaned ones, stringless */
+     for (i = 0; i < idx->free_count; i++)
+         biscuit_free_string(idx, idx->free_list[i]);
+     
+     biscuit_roaring_free(idx->tombstones);
+     idx->tombstones = biscuit_roaring_create();
+     idx->tombstone_count = 0;
+ }
+ 
+ /* ==================== SERIALIZATION ==================== */
+ 
+ /* A bitmap is written as its byte length followed by the bytes; 0 means NULL */
+ static void
+ biscuit_serialize_bitmap(BiscuitSink *sink, const RoaringBitmap *rb)
+ {
+     uint32 nbytes = 0;
+     char *buf;
+     
+     if (rb)
+         nbytes = (uint32)biscuit_roaring_serialized_size(rb);
+     sink->write(sink->arg, &nbytes, sizeof(nbytes));
+     if (nbytes == 0)
+         return;
+     
+     buf = (char *)palloc(nbytes);
+     biscuit_roaring_serialize(rb, buf);
+     sink->write(sink->arg, buf, nbytes);
+     pfree(buf);
+ }
+ 
+ static void
+ biscuit_serialize_char_index(BiscuitSink *sink, const CharIndex *cidx)
+ {
+     int32 end = BISCUIT_END_OF_LIST;
+     int j;
+     
+     for (j = 0; j < cidx->count; j++) {
+         int32 pos = cidx->entries[j].pos;
+         
+         sink->write(sink->arg, &pos, sizeof(pos));
+         biscuit_serialize_bitmap(sink, cidx->entries[j].bitmap);
+     }
+     sink->write(sink->arg, &end, sizeof(end));
+ }
+ 
+ /* A layer is written like a position list, each position followed by its key */
+ static void
+ biscuit_serialize_layer(BiscuitSink *sink, HTAB *layer)
+ {
+     HASH_SEQ_STATUS status;
+     BiscuitNgramEntry *entry;
+     int32 end = BISCUIT_END_OF_LIST;
+     
+     hash_seq_init(&status, layer);
+     while ((entry = (BiscuitNgramEntry *)hash_seq_search(&status)) != NULL) {
+         sink->write(sink->arg, &entry->key.pos, sizeof(entry->key.pos));
+         sink->write(sink->arg, &entry->key.gram, sizeof(entry->key.gram));
+         biscuit_serialize_bitmap(sink, entry->bitmap);
+     }
+     sink->write(sink->arg, &end, sizeof(end));
+ }
+ 
+ /*
+  * Write the whole in-memory index as one byte stream:
+  *
+  *   header, tids, strings, free list, pos_idx, neg_idx, char_cache,
+  *   [n-gram layer], [case-folded layer, fold_cache], length bitmaps,
+  *   length_ge bitmaps, tombstones
+  *
+  * Strings are stored NUL-terminated so that a loaded index can point
+  * data_cache straight into the image.  Per-character position lists end
+  * with BISCUIT_END_OF_LIST instead of carrying a count up front.  The
+  * header says which of the optional layers follow char_cache.
+  */
+ static void
+ biscuit_serialize_index(BiscuitIndex *idx, BiscuitSink *sink)
+ {
+     BiscuitSnapshotHeader hdr;
+     int i, ch;
+     
+     MemSet(&hdr, 0, sizeof(hdr));
+     hdr.magic = BISCUIT_SNAPSHOT_MAGIC;
+     hdr.num_records = idx->num_records;
+     hdr.max_len = idx->max_len;
+     hdr.max_length = idx->max_length;
+     hdr.tombstone_count = idx->tombstone_count;
+     hdr.free_count = idx->free_count;
+     hdr.insert_count = idx->insert_count;
+     hdr.update_count = idx->update_count;
+     hdr.delete_count = idx->delete_count;
+     hdr.ngram = idx->ngram_idx ? idx->ngram : 1;
+     hdr.casefold = idx->fold_idx != NULL;
+     sink->write(sink->arg, &hdr, sizeof(hdr));
+     
+     if (idx->num_records > 0)
+         sink->write(sink->arg, idx->tids, (Size)idx->num_records * sizeof(ItemPointerData));
+     
+     for (i = 0; i < idx->num_records; i++) {
+         char *str = idx->data_cache[i];
+         int32 len = str ? (int32)strlen(str) : -1;
+         
+         sink->write(sink->arg, &len, sizeof(len));
+         if (str)
+             sink->write(sink->arg, str, len + 1);
+     }
+     
+     if (idx->free_count > 0)
+         sink->write(sink->arg, idx->free_list, idx->free_count * sizeof(uint32_t));
+     
+     for (ch = 0; ch < CHAR_RANGE; ch++)
+         biscuit_serialize_char_index(sink, &idx->pos_idx[ch]);
+     for (ch = 0; ch < CHAR_RANGE; ch++)
+         biscuit_serialize_char_index(sink, &idx->neg_idx[ch]);
+     for (ch = 0; ch < CHAR_RANGE; ch++)
+         biscuit_serialize_bitmap(sink, idx->char_cache[ch]);
+     
+     if (idx->ngram_idx)
+         biscuit_serialize_layer(sink, idx->ngram_idx);
+     if (idx->fold_idx) {
+         biscuit_serialize_layer(sink, idx->fold_idx);
+         for (ch = 0; ch < CHAR_RANGE; ch++)
+             biscuit_serialize_bitmap(sink, idx->fold_cache[ch]);
+     }
+     
+     for (i = 0; i < idx->max_length; i++)
+         biscuit_serialize_bitmap(sink, idx->length_bitmaps[i]);
+     for (i = 0; i <= idx->max_length; i++)
+         biscuit_serialize_bitmap(sink, idx->length_ge_bitmaps[i]);
+     
+     biscuit_serialize_bitmap(sink, idx->tombstones);
+ }
+ 
+ static const char*
+ biscuit_image_take(BiscuitImageReader *r, uint64 n)
+ {
+     const char *p;
+     
+     if (n > r->len - r->pos)
+         ereport(ERROR,
+                 (errcode(ERRCODE_INDEX_CORRUPTED),
+                  errmsg("biscuit index snapshot is truncated")));
+     p = r->data + r->pos;
+     r->pos += n;
+     return p;
+ }
+ 
+ static int32
+ biscuit_image_int32(BiscuitImageReader *r)
+ {
+     int32 value;
+     
+     memcpy(&value, biscuit_image_take(r, sizeof(value)), sizeof(value));
+     return value;
+ }
+ 
+ static RoaringBitmap*
+ biscuit_deserialize_bitmap(BiscuitImageReader *r)
+ {
+     uint32 nbytes;
+     const char *buf;
+     RoaringBitmap *rb;
+     
+     memcpy(&nbytes, biscuit_image_take(r, sizeof(nbytes)), sizeof(nbytes));
+     if (nbytes == 0)
+         return NULL;
+     
+     buf = biscuit_image_take(r, nbytes);
+     if (r->frozen)
+         rb = biscuit_roaring_deserialize_frozen(buf, nbytes);
+     else
+         rb = biscuit_roaring_deserialize(buf, nbytes);
+     if (!rb)
+         ereport(ERROR,
+                 (errcode(ERRCODE_INDEX_CORRUPTED),
+                  errmsg("biscuit index snapshot contains an invalid bitmap")));
+     return rb;
+ }
+ 
+ static void
+ biscuit_deserialize_char_index(BiscuitImageReader *r, CharIndex *cidx)
+ {
+     for (;;) {
+         int32 pos = biscuit_image_int32(r);
+         
+         if (pos == BISCUIT_END_OF_LIST)
+             break;
+         
+         if (cidx->count >= cidx->capacity) {
+             cidx->capacity *= 2;
+             cidx->entries = (PosEntry *)repalloc(cidx->entries, cidx->capacity * sizeof(PosEntry));
+         }
+         cidx->entries[cidx->count].pos = pos;
+         cidx->entries[cidx->count].bitmap = biscuit_deserialize_bitmap(r);
+         cidx->count++;
+     }
+ }
+ 
+ static void
+ biscuit_deserialize_layer(BiscuitImageReader *r, HTAB *layer)
+ {
+     for (;;) {
+         BiscuitNgramKey key;
+         BiscuitNgramEntry *entry;
+         bool found;
+         
+         key.pos = biscuit_image_int32(r);
+         if (key.pos == BISCUIT_END_OF_LIST)
+             break;
+         memcpy(&key.gram, biscuit_image_take(r, sizeof(key.gram)), sizeof(key.gram));
+         
+         entry = (BiscuitNgramEntry *)hash_search(layer, &key, HASH_ENTER, &found);
+         if (found)
+             ereport(ERROR,
+                     (errcode(ERRCODE_INDEX_CORRUPTED),
+                      errmsg("biscuit index snapshot contains a duplicate layer bitmap")));
+         entry->bitmap = biscuit_deserialize_bitmap(r);
+     }
+ }
+ 
+ /*
+  * Fill a freshly created index from a serialized image.  Strings are not
+  * copied: data_cache points into the image, which the index keeps as
+  * idx->image.  A shared or mapped image is never written to, so the tids
+  * array and the bitmaps are used in place as well until first modified.
+  * Caller switches to idx->context.
+  */
+ static void
+ biscuit_deserialize_index(BiscuitIndex *idx, char *image, uint64 len, bool shared)
+ {
+     BiscuitImageReader r;
+     BiscuitSnapshotHeader hdr;
+     int i, ch;
+     
+     r.data = image;
+     r.len = len;
+     r.pos = 0;
+     r.frozen = shared;
+     
+     memcpy(&hdr, biscuit_image_take(&r, sizeof(hdr)), sizeof(hdr));
+     if (hdr.magic != BISCUIT_SNAPSHOT_MAGIC || hdr.num_records < 0 ||
+         hdr.max_length < 0 || hdr.free_count < 0 || hdr.free_count > hdr.num_records ||
+         hdr.ngram < 1 || hdr.ngram > BISCUIT_MAX_NGRAM)
+         ereport(ERROR,
+                 (errcode(ERRCODE_INDEX_CORRUPTED),
+                  errmsg("biscuit index snapshot has an invalid header")));
+     
+     idx->image = image;
+     idx->image_len = len;
+     
+     if (shared) {
+         pfree(idx->tids);
+         idx->tids = (ItemPointerData *)biscuit_image_take(&r, (Size)hdr.num_records * sizeof(ItemPointerData));
+         idx->tids_shared = true;
+     }
+     
+     biscuit_ensure_capacity(idx, hdr.num_records);
+     idx->num_records = hdr.num_records;
+     if (!shared && hdr.num_records > 0)
+         memcpy(idx->tids, biscuit_image_take(&r, (Size)hdr.num_records * sizeof(ItemPointerData)),
+                (Size)hdr.num_records * sizeof(ItemPointerData));
+     
+     for (i = 0; i < hdr.num_records; i++) {
+         int32 slen = biscuit_image_int32(&r);
+         
+         if (slen < 0)
+             idx->data_cache[i] = NULL;
+         else
+             idx->data_cache[i] = (char *)biscuit_image_take(&r, (uint64)slen + 1);
+     }
+     
+     if (hdr.free_count > idx->free_capacity) {
+         pfree(idx->free_list);
+         idx->free_capacity = hdr.free_count;
+         idx->free_list = (uint32_t *)palloc(idx->free_capacity * sizeof(uint32_t));
+     }
+     if (hdr.free_count > 0)
+         memcpy(idx->free_list, biscuit_image_take(&r, hdr.free_count * sizeof(uint32_t)),
+                hdr.free_count * sizeof(uint32_t));
+     idx->free_count = hdr.free_count;
+     
+     for (ch = 0; ch < CHAR_RANGE; ch++)
+         biscuit_deserialize_char_index(&r, &idx->pos_idx[ch]);
+     for (ch = 0; ch < CHAR_RANGE; ch++)
+         biscuit_deserialize_char_index(&r, &idx->neg_idx[ch]);
+     for (ch = 0; ch < CHAR_RANGE; ch++)
+         idx->char_cache[ch] = biscuit_deserialize_bitmap(&r);
+     
+     idx->ngram = hdr.ngram;
+     if (hdr.ngram > 1) {
+         idx->ngram_idx = biscuit_create_layer(idx, "Biscuit n-gram bitmaps");
+         biscuit_deserialize_layer(&r, idx->ngram_idx);
+     }
+     idx->casefold = hdr.casefold != 0;
+     if (idx->casefold) {
+         idx->fold_idx = biscuit_create_layer(idx, "Biscuit case-folded bitmaps");
+         biscuit_deserialize_layer(&r, idx->fold_idx);
+         for (ch = 0; ch < CHAR_RANGE; ch++)
+             idx->fold_cache[ch] = biscuit_deserialize_bitmap(&r);
+     }
+     
+     idx->max_len = hdr.max_len;
+     idx->max_length = hdr.max_length;
+     idx->length_bitmaps = (RoaringBitmap **)palloc0((idx->max_length + 1) * sizeof(RoaringBitmap *));
+     idx->length_ge_bitmaps = (RoaringBitmap **)palloc0((idx->max_length + 1) * sizeof(RoaringBitmap *));
+     for (i = 0; i < idx->max_length; i++)
+         idx->length_bitmaps[i] = biscuit_deserialize_bitmap(&r);
+     for (i = 0; i <= idx->max_length; i++) {
+         idx->length_ge_bitmaps[i] = biscuit_deserialize_bitmap(&r);
+         if (!idx->length_ge_bitmaps[i])
+             idx->length_ge_bitmaps[i] = biscuit_roaring_create();
+     }
+     
+     biscuit_roaring_free(idx->tombstones);
+     idx->tombstones = biscuit_deserialize_bitmap(&r);
+     if (!idx->tombstones)
+         idx->tombstones = biscuit_roaring_create();
+     
+     idx->tombstone_count = hdr.tombstone_count;
+     idx->insert_count = hdr.insert_count;
+     idx->update_count = hdr.update_count;
+     idx->delete_count = hdr.delete_count;
+     
+     if (r.pos != r.len)
+         ereport(ERROR,
+                 (errcode(ERRCODE_INDEX_CORRUPTED),
+                  errmsg("biscuit index snapshot has trailing data")));
+ }
+ 
+ /* ==================== PAGE STORAGE ==================== */
+ 
+ static void
+ biscuit_init_page(Page page, uint16 flags)
+ {
+     BiscuitPageOpaque opaque;
+     
+     PageInit(page, BLCKSZ, sizeof(BiscuitPageOpaqueData));
+     ((PageHeader)page)->pd_lower = MAXALIGN(SizeOfPageHeaderData);
+     
+     opaque = BiscuitPageGetOpaque(page);
+     opaque->next = InvalidBlockNumber;
+     opaque->flags = flags;
+     opaque->page_id = BISCUIT_PAGE_ID;
+ }
+ 
+ static void
+ biscuit_init_metapage(Page page, uint32 flags)
+ {
+     BiscuitMetaPage meta;
+     
+     biscuit_init_page(page, BISCUIT_META_PAGE);
+     meta = BiscuitPageGetMeta(page);
+     MemSet(meta, 0, sizeof(BiscuitMetaPageData));
+     meta->magic = BISCUIT_MAGIC;
+     meta->version = BISCUIT_VERSION;
+     meta->root = InvalidBlockNumber;
+     meta->generation = 1;
+     meta->log_head = InvalidBlockNumber;
+     meta->log_tail = InvalidBlockNumber;
+     meta->flags = flags;
+     
+     ((PageHeader)page)->pd_lower = ((char *)meta + sizeof(BiscuitMetaPageData)) - (char *)page;
+ }
+ 
+ /* Pin and lock the metapage, verifying that this is a biscuit index */
+ static Buffer
+ biscuit_lock_metapage(Relation index, int mode)
+ {
+     Buffer buf;
+     BiscuitMetaPage meta;
+     
+     if (RelationGetNumberOfBlocks(index) == 0)
+         ereport(ERROR,
+                 (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                  errmsg("biscuit index \"%s\" has no metapage",
+                         RelationGetRelationName(index)),
+                  errhint("The index was built by an older version of pg_biscuit; REINDEX it.")));
+     
+     buf = ReadBuffer(index, BISCUIT_METAPAGE_BLKNO);
+     LockBuffer(buf, mode);
+     
+     meta = BiscuitPageGetMeta(BufferGetPage(buf));
+     if (meta->magic != BISCUIT_MAGIC)
+         ereport(ERROR,
+                 (errcode(ERRCODE_INDEX_CORRUPTED),
+                  errmsg("index \"%s\" is not a biscuit index",
+                         RelationGetRelationName(index))));
+     if (meta->version != BISCUIT_VERSION)
+         ereport(ERROR,
+                 (errcode(ERRCODE_INDEX_CORRUPTED),
+                  errmsg("biscuit index \"%s\" has version %u, expected %u",
+                         RelationGetRelationName(index), meta->version, BISCUIT_VERSION),
+                  errhint("REINDEX the index.")));
+     
+     return buf;
+ }
+ 
+ /*
+  * Get a new exclusively locked page, recycling one from the FSM if possible.
+  * Pages are only allocated with the metapage exclusively locked.
+  */
+ static Buffer
+ biscuit_new_buffer(Relation index)
+ {
+     Buffer buf;
+     
+     for (;;) {
+         BlockNumber blkno = GetFreeIndexPage(index);
+         
+         if (blkno == InvalidBlockNumber)
+             break;
+         
+         buf = ReadBuffer(index, blkno);
+         
+         /* The FSM is not crash-safe; make sure the page really is free */
+         if (ConditionalLockBuffer(buf)) {
+             Page page = BufferGetPage(buf);
+             
+             if (PageIsNew(page) ||
+                 (BiscuitPageGetOpaque(page)->flags & BISCUIT_DELETED_PAGE))
+                 return buf;
+             
+             LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+         }
+         ReleaseBuffer(buf);
+     }
+     
+     LockRelationForExtension(index, ExclusiveLock);
+     buf = ReadBuffer(index, P_NEW);
+     LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+     UnlockRelationForExtension(index, ExclusiveLock);
+     
+     return buf;
+ }
+ 
+ static void
+ biscuit_writer_init(BiscuitPageWriter *w, Relation index, uint16 flags)
+ {
+     w->index = index;
+     w->buf = InvalidBuffer;
+     w->state = NULL;
+     w->page = NULL;
+     w->flags = flags;
+     w->first = InvalidBlockNumber;
+     w->npages = 0;
+     w->len = 0;
+ }
+ 
+ /* Continue a stream on an existing, exclusively locked page */
+ static void
+ biscuit_writer_resume(BiscuitPageWriter *w, Buffer buf, uint32 used)
+ {
+     w->buf = buf;
+     w->state = GenericXLogStart(w->index);
+     w->page = GenericXLogRegisterBuffer(w->state, buf, 0);
+     w->first = BufferGetBlockNumber(buf);
+     
+     /* Discard anything past the committed end, e.g. from a failed append */
+     ((PageHeader)w->page)->pd_lower = MAXALIGN(SizeOfPageHeaderData) + used;
+ }
+ 
+ static void
+ biscuit_writer_next_page(BiscuitPageWriter *w)
+ {
+     Buffer nbuf = biscuit_new_buffer(w->index);
+     
+     /*
+      * Link and log the full page first.  If we crash before the new page is
+      * logged, nothing reachable from the metapage refers to it yet.
+      */
+     if (BufferIsValid(w->buf)) {
+         BiscuitPageGetOpaque(w->page)->next = BufferGetBlockNumber(nbuf);
+         GenericXLogFinish(w->state);
+         UnlockReleaseBuffer(w->buf);
+     } else {
+         w->first = BufferGetBlockNumber(nbuf);
+     }
+     
+     w->buf = nbuf;
+     w->state = GenericXLogStart(w->index);
+     w->page = GenericXLogRegisterBuffer(w->state, nbuf, GENERIC_XLOG_FULL_IMAGE);
+     biscuit_init_page(w->page, w->flags);
+     w->npages++;
+ }
+ 
+ /* BiscuitSink callback: append bytes, spilling onto new pages as needed */
+ static void
+ biscuit_writer_write(void *arg, const void *data, Size len)
+ {
+     BiscuitPageWriter *w = (BiscuitPageWriter *)arg;
+     const char *src = (const char *)data;
+     
+     while (len > 0) {
+         Size used;
+         Size chunk;
+         
+         if (!BufferIsValid(w->buf) || BiscuitPageGetUsed(w->page) >= BISCUIT_PAGE_DATA_SIZE)
+             biscuit_writer_next_page(w);
+         
+         used = BiscuitPageGetUsed(w->page);
+         chunk = Min(len, BISCUIT_PAGE_DATA_SIZE - used);
+         memcpy(PageGetContents(w->page) + used, src, chunk);
+         ((PageHeader)w->page)->pd_lower += chunk;
+         
+         src += chunk;
+         len -= chunk;
+         w->len += chunk;
+     }
+ }
+ 
+ static void
+ biscuit_writer_finish(BiscuitPageWriter *w)
+ {
+     if (BufferIsValid(w->buf)) {
+         GenericXLogFinish(w->state);
+         UnlockReleaseBuffer(w->buf);
+         w->buf = InvalidBuffer;
+         w->state = NULL;
+         w->page = NULL;
+     }
+ }
+ 
+ /* Read a whole snapshot stream of len bytes into image */
+ static void
+ biscuit_read_stream(Relation index, BlockNumber blkno, uint64 len, char *image)
+ {
+     BufferAccessStrategy strategy = GetAccessStrategy(BAS_BULKREAD);
+     uint64 done = 0;
+     
+     while (done < len) {
+         Buffer buf;
+         Page page;
+         Size chunk;
+         
+         if (blkno == InvalidBlockNumber)
+             ereport(ERROR,
+                     (errcode(ERRCODE_INDEX_CORRUPTED),
+                      errmsg("biscuit index \"%s\" snapshot ends early",
+                             RelationGetRelationName(index))));
+         
+         buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, strategy);
+         LockBuffer(buf, BUFFER_LOCK_SHARE);
+         page = BufferGetPage(buf);
+         
+         if (PageIsNew(page) || !(BiscuitPageGetOpaque(page)->flags & BISCUIT_SNAPSHOT_PAGE))
+             ereport(ERROR,
+                     (errcode(ERRCODE_INDEX_CORRUPTED),
+                      errmsg("biscuit index \"%s\" block %u is not a snapshot page",
+                             RelationGetRelationName(index), blkno)));
+         
+         chunk = Min(BiscuitPageGetUsed(page), len - done);
+         memcpy(image + done, PageGetContents(page), chunk);
+         done += chunk;
+         blkno = BiscuitPageGetOpaque(page)->next;
+         
+         UnlockReleaseBuffer(buf);
+     }
+     
+     FreeAccessStrategy(strategy);
+ }
+ 
+ /*
+  * Read len bytes of the change log at the reader's position, following page
+  * links and advancing the position.  Only committed bytes are visible: on
+  * the tail page that is log_tail_len, not pd_lower.  The current page stays
+  * pinned between calls, since a replay usually reads many small records
+  * from the same page.
+  */
+ static void
+ biscuit_log_read(BiscuitLogReader *r, void *dst, Size len)
+ {
+     char *out = (char *)dst;
+     
+     while (len > 0) {
+         Page page;
+         Size avail;
+         Size chunk;
+         
+         if (r->blkno == InvalidBlockNumber)
+             ereport(ERROR,
+                     (errcode(ERRCODE_INDEX_CORRUPTED),
+                      errmsg("biscuit index \"%s\" change log ends inside a record",
+                             RelationGetRelationName(r->index))));
+         
+         if (!BufferIsValid(r->buf) || BufferGetBlockNumber(r->buf) != r->blkno) {
+             if (BufferIsValid(r->buf))
+                 ReleaseBuffer(r->buf);
+             r->buf = ReadBuffer(r->index, r->blkno);
+         }
+         LockBuffer(r->buf, BUFFER_LOCK_SHARE);
+         page = BufferGetPage(r->buf);
+         
+         if (PageIsNew(page) || !(BiscuitPageGetOpaque(page)->flags & BISCUIT_LOG_PAGE))
+             ereport(ERROR,
+                     (errcode(ERRCODE_INDEX_CORRUPTED),
+                      errmsg("biscuit index \"%s\" block %u is not a change-log page",
+                             RelationGetRelationName(r->index), r->blkno)));
+         
+         avail = (r->blkno == r->meta->log_tail) ? r->meta->log_tail_len : BiscuitPageGetUsed(page);
+         
+         if (r->off >= avail) {
+             if (r->blkno == r->meta->log_tail)
+                 ereport(ERROR,
+                         (errcode(ERRCODE_INDEX_CORRUPTED),
+                          errmsg("biscuit index \"%s\" change log ends inside a record",
+                                 RelationGetRelationName(r->index))));
+             r->blkno = BiscuitPageGetOpaque(page)->next;
+             r->off = 0;
+             LockBuffer(r->buf, BUFFER_LOCK_UNLOCK);
+             continue;
+         }
+         
+         chunk = Min(len, avail - r->off);
+         memcpy(out, PageGetContents(page) + r->off, chunk);
+         out += chunk;
+         len -= chunk;
+         r->off += chunk;
+         
+         LockBuffer(r->buf, BUFFER_LOCK_UNLOCK);
+     }
+ }
+ 
+ /*
+  * Apply change-log records this copy has not seen yet; this is how changes
+  * made by other backends reach this one.  The caller holds the metapage
+  * lock, so the committed end of the log cannot move and compaction cannot
+  * recycle the pages being read.
+  */
+ static void
+ biscuit_sync_index(Relation index, BiscuitIndex *idx, BiscuitMetaPage meta)
+ {
+     BiscuitLogReader reader;
+     MemoryContext oldcontext;
+     uint32 generation = idx->generation;
+     int64 nrecords = 0;
+     
+     if (idx->applied_seq == meta->log_seq)
+         return;
+     
+     reader.index = index;
+     reader.meta = meta;
+     reader.blkno = idx->log_blkno;
+     reader.off = idx->log_off;
+     reader.buf = InvalidBuffer;
+     if (reader.blkno == InvalidBlockNumber) {
+         reader.blkno = meta->log_head;
+         reader.off = 0;
+     }
+     
+     /* A record that fails halfway leaves the copy unusable; force a reload */
+     idx->generation = 0;
+     
+     oldcontext = MemoryContextSwitchTo(idx->context);
+     
+     while (reader.blkno != InvalidBlockNumber &&
+            !(reader.blkno == meta->log_tail && reader.off >= meta->log_tail_len)) {
+         BiscuitLogRecord rec;
+         
+         biscuit_log_read(&reader, &rec, sizeof(rec));
+         
+         switch (rec.type) {
+             case BISCUIT_LOG_INSERT: {
+                 char *str = (char *)palloc(rec.len + 1);
+                 
+                 biscuit_log_read(&reader, str, rec.len);
+                 str[rec.len] = '\0';
+                 biscuit_apply_insert(idx, rec.rec_idx, &rec.tid, str, rec.len);
+                 pfree(str);
+                 break;
+             }
+             case BISCUIT_LOG_TOMBSTONE: {
+                 uint32_t *slots = (uint32_t *)palloc(Max(rec.nslots, 1) * sizeof(uint32_t));
+                 uint32 i;
+                 
+                 biscuit_log_read(&reader, slots, rec.nslots * sizeof(uint32_t));
+                 for (i = 0; i < rec.nslots; i++)
+                     biscuit_apply_tombstone(idx, slots[i]);
+                 pfree(slots);
+                 break;
+             }
+             case BISCUIT_LOG_CLEANUP:
+                 biscuit_apply_cleanup(idx);
+                 break;
+             default:
+                 ereport(ERROR,
+                         (errcode(ERRCODE_INDEX_CORRUPTED),
+                          errmsg("biscuit index \"%s\" has unknown change-log record type %u",
+                                 RelationGetRelationName(index), rec.type)));
+         }
+         
+         idx->applied_seq = rec.seq;
+         nrecords++;
+     }
+     
+     MemoryContextSwitchTo(oldcontext);
+     
+     if (BufferIsValid(reader.buf))
+         ReleaseBuffer(reader.buf);
+     
+     idx->log_blkno = reader.blkno;
+     idx->log_off = reader.off;
+     idx->applied_seq = meta->log_seq;
+     idx->generation = generation;
+     
+     elog(DEBUG1, "Biscuit: Replayed %lld change-log records for \"%s\"",
+          (long long)nrecords, RelationGetRelationName(index));
+ }
+ 
+ /*
+  * Append one record to the change log.  The caller holds the metapage
+  * exclusively locked, has synced its copy, and applies the change to its
+  * copy only after the append succeeded.  metapage is the caller's generic
+  * xlog working copy, so the new log end becomes durable only when the
+  * caller finishes that record, after the log pages themselves.
+  */
+ static void
+ biscuit_log_append(Relation index, BiscuitIndex *idx, Page metapage,
+                    BiscuitLogRecord *rec, const void *payload, Size payload_len)
+ {
+     BiscuitMetaPage meta = BiscuitPageGetMeta(metapage);
+     BiscuitPageWriter writer;
+     
+     biscuit_writer_init(&writer, index, BISCUIT_LOG_PAGE);
+     if (meta->log_tail != InvalidBlockNumber) {
+         Buffer buf = ReadBuffer(index, meta->log_tail);
+         
+         LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+         biscuit_writer_resume(&writer, buf, meta->log_tail_len);
+     }
+     
+     rec->seq = meta->log_seq + 1;
+     biscuit_writer_write(&writer, rec, sizeof(BiscuitLogRecord));
+     if (payload_len > 0)
+         biscuit_writer_write(&writer, payload, payload_len);
+     
+     if (meta->log_head == InvalidBlockNumber)
+         meta->log_head = writer.first;
+     meta->log_tail = BufferGetBlockNumber(writer.buf);
+     meta->log_tail_len = (uint32)BiscuitPageGetUsed(writer.page);
+     meta->log_pages += writer.npages;
+     meta->log_len += sizeof(BiscuitLogRecord) + payload_len;
+     meta->log_seq = rec->seq;
+     
+     biscuit_writer_finish(&writer);
+     
+     idx->log_blkno = meta->log_tail;
+     idx->log_off = meta->log_tail_len;
+     idx->applied_seq = meta->log_seq;
+ }
+ 
+ /* Point the metapage at a snapshot just written, with an empty change log */
+ static void
+ biscuit_set_snapshot(BiscuitMetaPage meta, BiscuitPageWriter *writer, int num_records)
+ {
+     meta->root = writer->first;
+     meta->snapshot_pages = writer->npages;
+     meta->snapshot_len = writer->len;
+     meta->num_records = num_records;
+     meta->log_head = InvalidBlockNumber;
+     meta->log_tail = InvalidBlockNumber;
+     meta->log_tail_len = 0;
+     meta->log_pages = 0;
+     meta->log_len = 0;
+     
+     /* Unlike the generation, this never repeats after a crash discards a rewrite */
+     if (!pg_strong_random(&meta->snapshot_id, sizeof(meta->snapshot_id)))
+         meta->snapshot_id = (uint64)GetCurrentTimestamp() ^ ((uint64)MyProcPid << 40);
+ }
+ 
+ /*
+  * Write idx as a fresh snapshot and point the metapage at it with an empty
+  * change log.  The caller holds the metapage exclusively locked; metapage
+  * is its generic xlog working copy.
+  */
+ static void
+ biscuit_write_snapshot(Relation index, BiscuitIndex *idx, Page metapage)
+ {
+     BiscuitMetaPage meta = BiscuitPageGetMeta(metapage);
+     BiscuitPageWriter writer;
+     BiscuitSink sink;
+     
+     biscuit_writer_init(&writer, index, BISCUIT_SNAPSHOT_PAGE);
+     sink.write = biscuit_writer_write;
+     sink.arg = &writer;
+     biscuit_serialize_index(idx, &sink);
+     biscuit_writer_finish(&writer);
+     biscuit_set_snapshot(meta, &writer, idx->num_records);
+     
+     idx->layers_derived = false;
+     idx->generation = meta->generation;
+     idx->applied_seq = meta->log_seq;
+     idx->log_blkno = InvalidBlockNumber;
+     idx->log_off = 0;
+ }
+ 
+ /*
+  * Mapped snapshots.  With storage = mmap, the first backend to load a
+  * snapshot copies it from the index pages into a file under pg_biscuit/,
+  * and every backend maps that file read-only and uses its tids, strings
+  * and bitmaps in place, as it would a shared image.  The file is only a
+  * cache of the pages: it is named by the relation's storage and the
+  * metapage's snapshot_id, so a rewritten snapshot gets a new file, and a
+  * missing or damaged one is simply rebuilt.
+  *
+  * Files outlive their storage when an index is dropped, reindexed or
+  * truncated, or its database dropped.  Dropping an index removes its files
+  * right away if the library is loaded; otherwise they are swept by the
+  * next VACUUM of a biscuit index or the next mapped file created.
+  */
+ 
+ static void
+ biscuit_map_path(Relation index, uint64 snapshot_id, char *path)
+ {
+     snprintf(path, MAXPGPATH, "%s/%u_%u_%u.%016llx", BISCUIT_MAP_DIR,
+              index->rd_locator.spcOid, index->rd_locator.dbOid,
+              index->rd_locator.relNumber, (unsigned long long)snapshot_id);
+ }
+ 
+ static void
+ biscuit_map_unlink(const char *path)
+ {
+     /* Backends still mapping an old file keep it alive until they unmap */
+     if (unlink(path) != 0 && errno != ENOENT)
+         ereport(LOG,
+                 (errcode_for_file_access(),
+                  errmsg("could not remove file \"%s\": %m", path)));
+ }
+ 
+ /* Remove the mapped files of a storage, except those of the path keep, if given */
+ static void
+ biscuit_map_unlink_stale(const RelFileLocator *locator, const char *keep)
+ {
+     char prefix[MAXPGPATH];
+     char path[MAXPGPATH];
+     DIR *dir;
+     struct dirent *de;
+     
+     dir = AllocateDir(BISCUIT_MAP_DIR);
+     if (dir == NULL)
+         return;
+     
+     snprintf(prefix, sizeof(prefix), "%u_%u_%u.", locator->spcOid,
+              locator->dbOid, locator->relNumber);
+     
+     while ((de = ReadDirExtended(dir, BISCUIT_MAP_DIR, LOG)) != NULL) {
+         if (strncmp(de->d_name, prefix, strlen(prefix)) != 0)
+             continue;
+         snprintf(path, sizeof(path), "%s/%s", BISCUIT_MAP_DIR, de->d_name);
+         /* Spares keep's temporary files too, which other backends may be filling */
+         if (keep && strncmp(path, keep, strlen(keep)) == 0)
+             continue;
+         biscuit_map_unlink(path);
+     }
+     FreeDir(dir);
+ }
+ 
+ /*
+  * Remove the mapped files whose storage is gone.  Once the transaction
+  * that dropped or replaced a relation file commits, the file is removed or
+  * truncated to nothing until the next checkpoint, while the storage of a
+  * biscuit index always holds at least its metapage.
+  */
+ static void
+ biscuit_map_sweep(void)
+ {
+     char path[MAXPGPATH];
+     DIR *dir;
+     struct dirent *de;
+     
+     dir = AllocateDir(BISCUIT_MAP_DIR);
+     if (dir == NULL)
+         return;
+     
+     while ((de = ReadDirExtended(dir, BISCUIT_MAP_DIR, LOG)) != NULL) {
+         RelFileLocator locator;
+         char *relpath;
+         struct stat st;
+         bool gone;
+         
+         if (sscanf(de->d_name, "%u_%u_%u.", &locator.spcOid, &locator.dbOid, &locator.relNumber) != 3)
+             continue;
+         
+         relpath = relpathperm(locator, MAIN_FORKNUM);
+         if (stat(relpath, &st) == 0)
+             gone = st.st_size == 0;
+         else
+             gone = errno == ENOENT;
+         pfree(relpath);
+         
+         if (gone) {
+             snprintf(path, sizeof(path), "%s/%s", BISCUIT_MAP_DIR, de->d_name);
+             biscuit_map_unlink(path);
+         }
+     }
+     FreeDir(dir);
+ }
+ 
+ 
+ /* Copy the snapshot stream from the index pages into a new mapped file */
+ static bool
+ biscuit_map_create(Relation index, BiscuitMetaPage meta, const char *path)
+ {
+     char tmppath[MAXPGPATH];
+     Size maplen = BISCUIT_MAP_HDRSZ + meta->snapshot_len;
+     BiscuitMapHeader *hdr;
+     char *map;
+     int fd;
+     
+     if (MakePGDirectory(BISCUIT_MAP_DIR) != 0 && errno != EEXIST) {
+         ereport(LOG,
+                 (errcode_for_file_access(),
+                  errmsg("could not create directory \"%s\": %m", BISCUIT_MAP_DIR)));
+         return false;
+     }
+     
+     snprintf(tmppath, sizeof(tmppath), "%s.tmp.%d", path, MyProcPid);
+     fd = OpenTransientFile(tmppath, O_RDWR | O_CREAT | O_TRUNC | PG_BINARY);
+     if (fd < 0) {
+         ereport(LOG,
+                 (errcode_for_file_access(),
+                  errmsg("could not create file \"%s\": %m", tmppath)));
+         return false;
+     }
+     
+     /* Allocate the blocks up front, so a full disk fails here rather than as SIGBUS */
+     if (pg_pwrite_zeros(fd, maplen, 0) < 0 ||
+         (map = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+         ereport(LOG,
+                 (errcode_for_file_access(),
+                  errmsg("could not write file \"%s\": %m", tmppath)));
+         CloseTransientFile(fd);
+         unlink(tmppath);
+         return false;
+     }
+     
+     PG_TRY();
+     {
+         biscuit_read_stream(index, meta->root, meta->snapshot_len, map + BISCUIT_MAP_HDRSZ);
+     }
+     PG_CATCH();
+     {
+         munmap(map, maplen);
+         CloseTransientFile(fd);
+         unlink(tmppath);
+         PG_RE_THROW();
+     }
+     PG_END_TRY();
+     
+     hdr = (BiscuitMapHeader *)map;
+     hdr->magic = BISCUIT_MAP_MAGIC;
+     hdr->locator = index->rd_locator;
+     hdr->snapshot_id = meta->snapshot_id;
+     hdr->len = meta->snapshot_len;
+     munmap(map, maplen);
+     CloseTransientFile(fd);
+     
+     /* Concurrent creators write identical files; whichever rename lands last wins */
+     if (durable_rename(tmppath, path, LOG) != 0) {
+         unlink(tmppath);
+         return false;
+     }
+     
+     biscuit_map_unlink_stale(&index->rd_locator, path);
+     biscuit_map_sweep();
+     return true;
+ }
+ 
+ /*
+  * Map the snapshot file of meta's snapshot, creating it first if needed.
+  * Returns the start of the snapshot stream, or NULL if the file cannot be
+  * used, in which case the caller reads the pages instead.
+  */
+ static char*
+ biscuit_map_snapshot(Relation index, BiscuitMetaPage meta, Size *maplen)
+ {
+     char path[MAXPGPATH];
+     BiscuitMapHeader *hdr;
+     struct stat st;
+     char *map;
+     int fd;
+     
+     biscuit_map_path(index, meta->snapshot_id, path);
+     *maplen = BISCUIT_MAP_HDRSZ + meta->snapshot_len;
+     
+     fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+     if (fd < 0 && errno == ENOENT && biscuit_map_create(index, meta, path))
+         fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+     if (fd < 0)
+         return NULL;
+     
+     if (fstat(fd, &st) != 0 || st.st_size != (off_t)*maplen ||
+         (map = mmap(NULL, *maplen, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+         CloseTransientFile(fd);
+         ereport(LOG,
+                 (errmsg("ignoring unusable biscuit snapshot file \"%s\"", path)));
+         unlink(path);
+         return NULL;
+     }
+     CloseTransientFile(fd);
+     
+     hdr = (BiscuitMapHeader *)map;
+     if (hdr->magic != BISCUIT_MAP_MAGIC ||
+         !RelFileLocatorEquals(hdr->locator, index->rd_locator) ||
+         hdr->snapshot_id != meta->snapshot_id || hdr->len != meta->snapshot_len) {
+         munmap(map, *maplen);
+         ereport(LOG,
+                 (errmsg("ignoring unusable biscuit snapshot file \"%s\"", path)));
+         unlink(path);
+         return NULL;
+     }
+     
+     return map;
+ }
+ 
+ /* Load an index from its snapshot and change log; caller holds the metapage lock */
+ static BiscuitIndex*
+ biscuit_load_index(Relation index, BiscuitMetaPage meta)
+ {
+     BiscuitIndex *idx;
+     MemoryContext oldcontext;
+     
+     elog(DEBUG1, "Biscuit: Loading index \"%s\" from %u snapshot pages and %u change-log pages",
+          RelationGetRelationName(index), meta->snapshot_pages, meta->log_pages);
+     
+     idx = biscuit_create_index();
+     idx->tid_keys = (meta->flags & BISCUIT_META_TID_KEYS) != 0;
+     
+     oldcontext = MemoryContextSwitchTo(idx->context);
+     if (meta->snapshot_len > 0 && BiscuitUseMappedSnapshot(index) &&
+         (idx->mapped = biscuit_map_snapshot(index, meta, &idx->mapped_len)) != NULL) {
+         biscuit_deserialize_index(idx, idx->mapped + BISCUIT_MAP_HDRSZ, meta->snapshot_len, true);
+     } else if (meta->snapshot_len > 0) {
+         uint64 len = meta->snapshot_len;
+         dsa_pointer dp = biscuit_shared_image_find(index, meta->generation);
+         char *image;
+         
+         /* Not published yet: read it into shared memory ourselves */
+         if (!DsaPointerIsValid(dp) && (image = biscuit_shared_image_alloc(len, &dp)) != NULL) {
+             PG_TRY();
+             {
+                 biscuit_read_stream(index, meta->root, len, image);
+             }
+             PG_CATCH();
+             {
+                 biscuit_shared_image_release(dp);
+                 PG_RE_THROW();
+             }
+             PG_END_TRY();
+             dp = biscuit_shared_image_publish(index, meta->generation, dp);
+         }
+         
+         if (DsaPointerIsValid(dp)) {
+             BiscuitSharedImage *img = (BiscuitSharedImage *)dsa_get_address(biscuit_area, dp);
+             
+             idx->shared_image = dp;
+             biscuit_deserialize_index(idx, BiscuitSharedImageData(img), len, true);
+         } else {
+             image = (char *)MemoryContextAllocHuge(idx->context, len);
+             biscuit_read_stream(index, meta->root, len, image);
+             biscuit_deserialize_index(idx, image, len, false);
+         }
+     } else {
+         biscuit_init_length_bitmaps(idx);
+     }
+     
+     /*
+      * The snapshot carries the layers, unless it was written by an external
+      * build or before the options changed; derive those, and let the next
+      * VACUUM store them.
+      */
+     if (idx->ngram != BiscuitGetNgram(index)) {
+         biscuit_init_ngram_bitmaps(idx, BiscuitGetNgram(index));
+         idx->layers_derived = true;
+     }
+     if (idx->casefold != BiscuitUseCaseFold(index)) {
+         biscuit_init_fold_bitmaps(idx, BiscuitUseCaseFold(index));
+         idx->layers_derived = true;
+     }
+     biscuit_init_tid_order(idx);
+     MemoryContextSwitchTo(oldcontext);
+     
+     idx->generation = meta->generation;
+     idx->applied_seq = 0;
+     idx->log_blkno = InvalidBlockNumber;
+     idx->log_off = 0;
+     biscuit_sync_index(index, idx, meta);
+     
+     elog(DEBUG1, "Biscuit: Loaded %d records, max_len=%d", idx->num_records, idx->max_len);
+     
+     return idx;
+ }
+ 
+ /*
+  * Return this backend's copy of the index, loading it on first use or after
+  * another backend rewrote the snapshot.  With sync, changes other backends
+  * logged since are replayed first.  Caller holds the metapage lock.
+  */
+ static BiscuitIndex*
+ biscuit_get_index(Relation index, Page metapage, bool sync)
+ {
+     BiscuitMetaPage meta = BiscuitPageGetMeta(metapage);
+     BiscuitCacheEntry *entry = biscuit_cache_lookup(index);
+     
+     /* Reload after a snapshot rewrite, or to rebuild for a changed ngram or casefold option */
+     if (entry->index && (entry->index->generation != meta->generation ||
+                          entry->index->ngram != BiscuitGetNgram(index) ||
+                          entry->index->casefold != BiscuitUseCaseFold(index))) {
+         biscuit_retire_index(entry->index);
+         entry->index = NULL;
+     }
+     
+     if (!entry->index)
+         entry->index = biscuit_load_index(index, meta);
+     else if (sync)
+         biscuit_sync_index(index, entry->index, meta);
+     
+     return entry->index;
+ }
+ 
+ /* Collect up to max blocks of a page chain, stopping after last */
+ static int
+ biscuit_collect_chain(Relation index, BlockNumber blkno, BlockNumber last,
+                       BlockNumber *out, int max)
+ {
+     int n = 0;
+     
+     while (blkno != InvalidBlockNumber && n < max) {
+         Buffer buf = ReadBuffer(index, blkno);
+         BlockNumber next;
+         
+         LockBuffer(buf, BUFFER_LOCK_SHARE);
+         next = BiscuitPageGetOpaque(BufferGetPage(buf))->next;
+         UnlockReleaseBuffer(buf);
+         
+         out[n++] = blkno;
+         if (blkno == last)
+             break;
+         blkno = next;
+     }
+     
+     return n;
+ }
+ 
+ /*
+  * Fold the change log into a new snapshot and recycle the old pages.  The
+  * records are renumbered in TID order on the way.  Other backends see the
+  * bumped generation and reload.  Caller holds the metapage
+  * exclusively locked and has synced idx.
+  */
+ static void
+ biscuit_compact_index(Relation index, BiscuitIndex *idx, Buffer metabuf)
+ {
+     GenericXLogState *state;
+     Page metapage;
+     BiscuitMetaPage meta;
+     BlockNumber *old_pages;
+     int max_old;
+     int nold;
+     int i, j;
+     
+     state = GenericXLogStart(index);
+     metapage = GenericXLogRegisterBuffer(state, metabuf, 0);
+     meta = BiscuitPageGetMeta(metapage);
+     max_old = meta->snapshot_pages + meta->log_pages;
+     
+     old_pages = (BlockNumber *)palloc(Max(max_old, 1) * sizeof(BlockNumber));
+     nold = biscuit_collect_chain(index, meta->root, InvalidBlockNumber,
+                                  old_pages, meta->snapshot_pages);
+     nold += biscuit_collect_chain(index, meta->log_head, meta->log_tail,
+                                   old_pages + nold, meta->log_pages);
+     
+     meta->generation++;
+     
+     /* Renumbering invalidates the local copy until the snapshot is written */
+     idx->generation = 0;
+     if (!idx->tid_keys)
+         biscuit_renumber_records(idx);
+     biscuit_write_snapshot(index, idx, metapage);
+     GenericXLogFinish(state);
+     
+     /* Only now that the metapage no longer points at them, free the old pages */
+     for (i = 0; i < nold; i += MAX_GENERIC_XLOG_PAGES) {
+         Buffer bufs[MAX_GENERIC_XLOG_PAGES];
+         int n = Min(nold - i, MAX_GENERIC_XLOG_PAGES);
+         
+         state = GenericXLogStart(index);
+         for (j = 0; j < n; j++) {
+             bufs[j] = ReadBuffer(index, old_pages[i + j]);
+             LockBuffer(bufs[j], BUFFER_LOCK_EXCLUSIVE);
+             biscuit_init_page(GenericXLogRegisterBuffer(state, bufs[j], GENERIC_XLOG_FULL_IMAGE),
+                               BISCUIT_DELETED_PAGE);
+         }
+         GenericXLogFinish(state);
+         
+         for (j = 0; j < n; j++) {
+             UnlockReleaseBuffer(bufs[j]);
+             RecordFreeIndexPage(index, old_pages[i + j]);
+         }
+     }
+     
+     pfree(old_pages);
+ }
+ 
+ /* ==================== INDEX BUILD ==================== */
+ 
+ /*
+  * Bulk bitmap construction
+  *
+  * Adding records one at a time costs a binary search in the CharIndex and
+  * a roaring insert per character per row.  Instead the build callback
+  * appends one (group, record) entry per character and position, where the
+  * group names the positive or negative bitmap it belongs to.  When the
+  * buffer fills, it is radix sorted by group and each group's records are
+  * added with one add_many call.  The sort is stable and records arrive in
+  * increasing order, so every run is already sorted for add_many.  (TID
+  * keys are too, unless a synchronized scan wrapped around; add_many copes.)
+  *
+  * Groups sort in the order the snapshot stores its position lists: all
+  * positive lists by character and position, then all negative lists by
+  * character and ascending (most negative first) offset.
+  */
+ #define BISCUIT_NEG_GROUP_BASE (CHAR_RANGE * MAX_POSITIONS)
+ #define BISCUIT_GROUP_BITS 17   /* groups < 2 * CHAR_RANGE * MAX_POSITIONS */
+ #define BISCUIT_RADIX_BITS 9
+ 
+ /* Subphases reported in pg_stat_progress_create_index */
+ #define PROGRESS_BISCUIT_PHASE_TABLESCAN 2
+ #define PROGRESS_BISCUIT_PHASE_MERGE 3
+ #define PROGRESS_BISCUIT_PHASE_WRITE 4
+ 
+ typedef struct {
+     uint32 group;
+     uint32 rec;
+ } BiscuitBuildEntry;
+ 
+ /*
+  * Spill files of one build participant.  tids and strs hold the records in
+  * snapshot format, lens the exact-length bitmaps, and every run a sorted
+  * sequence of (group, bitmap) pairs ending with BISCUIT_END_OF_LIST.
+  */
+ typedef struct {
+     BufFile *tids;
+     BufFile *strs;
+     BufFile *lens;
+     BufFile **runs;
+     int nruns;
+     int maxruns;
+     int nrecords;
+ } BiscuitSpill;
+ 
+ typedef struct {
+     BiscuitIndex *idx;
+     BiscuitBuildEntry *entries;
+     BiscuitBuildEntry *scratch;     /* radix sort target */
+     int nentries;
+     int maxentries;
+     
+     /* External builds only */
+     bool external;
+     FileSet *fileset;               /* shared spill files; NULL for private temp files */
+     int participant;
+     BiscuitSpill spill;
+     Size runbytes;                  /* serialized size of the current run's bitmaps */
+     Size maxrunbytes;
+ } BiscuitBuildState;
+ 
+ /*
+  * Size the entry buffer (and its sort scratch) to workmem kilobytes.  An
+  * external build gives half of that to the bitmaps of the current run.
+  */
+ static void
+ biscuit_build_state_init(BiscuitBuildState *state, BiscuitIndex *idx, int workmem,
+                          bool external, FileSet *fileset, int participant)
+ {
+     Size budget = (Size)workmem * 1024;
+     Size maxentries;
+     
+     if (external)
+         budget /= 2;
+     
+     maxentries = budget / (2 * sizeof(BiscuitBuildEntry));
+     maxentries = Min(maxentries, MaxAllocHugeSize / sizeof(BiscuitBuildEntry));
+     maxentries = Min(maxentries, (Size)INT_MAX);
+     maxentries = Max(maxentries, 4 * MAX_POSITIONS);
+     
+     MemSet(state, 0, sizeof(BiscuitBuildState));
+     state->idx = idx;
+     state->maxentries = (int)maxentries;
+     state->entries = (BiscuitBuildEntry *)palloc_extended(maxentries * sizeof(BiscuitBuildEntry),
+                                                           MCXT_ALLOC_HUGE);
+     state->scratch = (BiscuitBuildEntry *)palloc_extended(maxentries * sizeof(BiscuitBuildEntry),
+                                                           MCXT_ALLOC_HUGE);
+     
+     state->external = external;
+     state->fileset = fileset;
+     state->participant = participant;
+     state->maxrunbytes = budget;
+ }
+ 
+ static void
+ biscuit_spill_name(char *name, int participant, const char *kind, int run)
+ {
+     if (run >= 0)
+         snprintf(name, MAXPGPATH, "biscuit.%d.%s.%d", participant, kind, run);
+     else
+         snprintf(name, MAXPGPATH, "biscuit.%d.%s", participant, kind);
+ }
+ 
+ /* Create a spill file, named in the shared file set if there is one */
+ static BufFile*
+ biscuit_spill_create(BiscuitBuildState *state, const char *kind, int run)
+ {
+     char name[MAXPGPATH];
+     
+     if (!state->fileset)
+         return BufFileCreateTemp(false);
+     
+     biscuit_spill_name(name, state->participant, kind, run);
+     return BufFileCreateFileSet(state->fileset, name);
+ }
+ 
+ static BufFile*
+ biscuit_spill_open(FileSet *fileset, int participant, const char *kind, int run)
+ {
+     char name[MAXPGPATH];
+     
+     biscuit_spill_name(name, participant, kind, run);
+     return BufFileOpenFileSet(fileset, name, O_RDONLY, false);
+ }
+ 
+ /* BiscuitSink callback: append bytes to a BufFile */
+ static void
+ biscuit_buffile_write(void *arg, const void *data, Size len)
+ {
+     BufFileWrite((BufFile *)arg, data, len);
+ }
+ 
+ static void
+ biscuit_buffile_rewind(BufFile *file)
+ {
+     if (BufFileSeek(file, 0, 0, SEEK_SET) != 0)
+         ereport(ERROR,
+                 (errcode_for_file_access(),
+                  errmsg("could not rewind biscuit build temporary file")));
+ }
+ 
+ /* Read a bitmap written by biscuit_serialize_bitmap; NULL if it was NULL */
+ static RoaringBitmap*
+ biscuit_buffile_read_bitmap(BufFile *file)
+ {
+     RoaringBitmap *rb;
+     uint32 nbytes;
+     char *buf;
+     
+     BufFileReadExact(file, &nbytes, sizeof(nbytes));
+     if (nbytes == 0)
+         return NULL;
+     
+     buf = (char *)palloc(nbytes);
+     BufFileReadExact(file, buf, nbytes);
+     rb = biscuit_roaring_deserialize(buf, nbytes);
+     pfree(buf);
+     
+     if (!rb)
+         elog(ERROR, "corrupt bitmap in biscuit build temporary file");
+     return rb;
+ }
+ 
+ /* Copy the rest of a BufFile into a sink */
+ static void
+ biscuit_buffile_copy(BufFile *file, BiscuitSink *sink)
+ {
+     PGAlignedBlock buf;
+     size_t n;
+     
+     while ((n = BufFileRead(file, buf.data, BLCKSZ)) > 0)
+         sink->write(sink->arg, buf.data, n);
+ }
+ 
+ /* Map a group to its character index entry */
+ static inline void
+ biscuit_group_decode(uint32 group, unsigned char *ch, bool *neg, int *pos)
+ {
+     uint32 g = group % BISCUIT_NEG_GROUP_BASE;
+     
+     *ch = g / MAX_POSITIONS;
+     *neg = group >= BISCUIT_NEG_GROUP_BASE;
+     *pos = *neg ? (int)(g % MAX_POSITIONS) - MAX_POSITIONS : (int)(g % MAX_POSITIONS);
+ }
+ 
+ static inline uint32
+ biscuit_group_encode(unsigned char ch, bool neg, int pos)
+ {
+     if (neg)
+         return BISCUIT_NEG_GROUP_BASE + ch * MAX_POSITIONS + (MAX_POSITIONS + pos);
+     return ch * MAX_POSITIONS + pos;
+ }
+ 
+ /* Find or create a position bitmap; caller is in idx->context */
+ static RoaringBitmap*
+ biscuit_build_bitmap(BiscuitIndex *idx, unsigned char ch, bool neg, int pos)
+ {
+     RoaringBitmap *bm;
+     
+     bm = neg ? biscuit_get_neg_bitmap(idx, ch, pos) : biscuit_get_pos_bitmap(idx, ch, pos);
+     if (!bm) {
+         bm = biscuit_roaring_create();
+         if (neg)
+             biscuit_set_neg_bitmap(idx, ch, pos, bm);
+         else
+             biscuit_set_pos_bitmap(idx, ch, pos, bm);
+     }
+     return bm;
+ }
+ 
+ /* LSD radix sort by group; returns whichever buffer holds the result */
+ static BiscuitBuildEntry*
+ biscuit_radix_sort(BiscuitBuildEntry *entries, BiscuitBuildEntry *scratch, int n)
+ {
+     int counts[1 << BISCUIT_RADIX_BITS];
+     int shift;
+     
+     for (shift = 0; shift < BISCUIT_GROUP_BITS; shift += BISCUIT_RADIX_BITS) {
+         BiscuitBuildEntry *tmp;
+         int sum = 0;
+         int i;
+         
+         memset(counts, 0, sizeof(counts));
+         for (i = 0; i < n; i++)
+             counts[(entries[i].group >> shift) & ((1 << BISCUIT_RADIX_BITS) - 1)]++;
+         for (i = 0; i < (1 << BISCUIT_RADIX_BITS); i++) {
+             int c = counts[i];
+             counts[i] = sum;
+             sum += c;
+         }
+         for (i = 0; i < n; i++)
+             scratch[counts[(entries[i].group >> shift) & ((1 << BISCUIT_RADIX_BITS) - 1)]++] = entries[i];
+         
+         tmp = entries;
+         entries = scratch;
+         scratch = tmp;
+     }
+     
+     return entries;
+ }
+ 
+ /*
+  * Write the position bitmaps built so far as one sorted run and drop them
+  * from memory.  CharIndex entries are sorted by position, so walking them
+  * in order yields ascending groups.
+  */
+ static void
+ biscuit_build_dump_run(BiscuitBuildState *state)
+ {
+     BiscuitIndex *idx = state->idx;
+     BiscuitSpill *spill = &state->spill;
+     BiscuitSink sink;
+     BufFile *file;
+     uint32 end = BISCUIT_END_OF_LIST;
+     int side, ch, j;
+     
+     if (spill->nruns >= spill->maxruns) {
+         spill->maxruns = Max(spill->maxruns * 2, 8);
+         spill->runs = spill->runs
+             ? (BufFile **)repalloc(spill->runs, spill->maxruns * sizeof(BufFile *))
+             : (BufFile **)palloc(spill->maxruns * sizeof(BufFile *));
+     }
+     file = biscuit_spill_create(state, "run", spill->nruns);
+     spill->runs[spill->nruns++] = file;
+     
+     sink.write = biscuit_buffile_write;
+     sink.arg = file;
+     
+     for (side = 0; side < 2; side++) {
+         for (ch = 0; ch < CHAR_RANGE; ch++) {
+             CharIndex *cidx = side ? &idx->neg_idx[ch] : &idx->pos_idx[ch];
+             
+             for (j = 0; j < cidx->count; j++) {
+                 uint32 group = biscuit_group_encode(ch, side, cidx->entries[j].pos);
+                 
+                 biscuit_roaring_optimize(cidx->entries[j].bitmap);
+                 BufFileWrite(file, &group, sizeof(group));
+                 biscuit_serialize_bitmap(&sink, cidx->entries[j].bitmap);
+                 biscuit_roaring_free(cidx->entries[j].bitmap);
+             }
+             cidx->count = 0;
+         }
+     }
+     BufFileWrite(file, &end, sizeof(end));
+     
+     state->runbytes = 0;
+ }
+ 
+ /* Sort the buffered entries and add them to the index bitmaps */
+ static void
+ biscuit_build_flush(BiscuitBuildState *state)
+ {
+     BiscuitIndex *idx = state->idx;
+     BiscuitBuildEntry *sorted;
+     uint32_t *recs;
+     MemoryContext oldcontext;
+     int n = state->nentries;
+     int i = 0;
+     
+     if (n == 0)
+         return;
+     
+     sorted = biscuit_radix_sort(state->entries, state->scratch, n);
+     /* The other buffer is free again; reuse it for the record runs */
+     recs = (uint32_t *)(sorted == state->entries ? state->scratch : state->entries);
+     
+     oldcontext = MemoryContextSwitchTo(idx->context);
+     
+     while (i < n) {
+         uint32 group = sorted[i].group;
+         unsigned char ch;
+         bool neg;
+         int pos;
+         RoaringBitmap *bm;
+         int nrecs = 0;
+         
+         while (i < n && sorted[i].group == group)
+             recs[nrecs++] = sorted[i++].rec;
+         
+         biscuit_group_decode(group, &ch, &neg, &pos);
+         bm = biscuit_build_bitmap(idx, ch, neg, pos);
+         
+         if (state->external) {
+             Size before = biscuit_roaring_serialized_size(bm);
+             
+             biscuit_roaring_add_many(bm, nrecs, recs);
+             state->runbytes += biscuit_roaring_serialized_size(bm) - before;
+         } else {
+             biscuit_roaring_add_many(bm, nrecs, recs);
+         }
+     }
+     
+     MemoryContextSwitchTo(oldcontext);
+     
+     state->nentries = 0;
+     
+     if (state->external && state->runbytes > state->maxrunbytes)
+         biscuit_build_dump_run(state);
+ }
+ 
+ /* table_index_build_scan callback: add one heap tuple to the in-memory index */
+ static void
+ biscuit_build_callback(Relation index, ItemPointer tid, Datum *values,
+                        bool *isnull, bool tupleIsAlive, void *arg)
+ {
+     BiscuitBuildState *state = (BiscuitBuildState *)arg;
+     BiscuitIndex *idx = state->idx;
+     MemoryContext oldcontext;
+     uint32_t key;
+     int pos;
+     text *txt;
+     char *str;
+     int full_len;
+     int len;
+     
+     if (isnull[0])
+         return;
+     
+     key = idx->tid_keys ? biscuit_tid_key(tid) : (uint32_t)idx->num_records;
+     
+     txt = DatumGetTextPP(values[0]);
+     str = VARDATA_ANY(txt);
+     full_len = VARSIZE_ANY_EXHDR(txt);
+     
+     len = full_len;
+     if (len > MAX_POSITIONS) len = MAX_POSITIONS;
+     if (len > idx->max_len) idx->max_len = len;
+     
+     oldcontext = MemoryContextSwitchTo(idx->context);
+     
+     if (state->external) {
+         /* Records go straight to disk in snapshot format */
+         int32 slen = full_len;
+         
+         BufFileWrite(state->spill.tids, tid, sizeof(ItemPointerData));
+         BufFileWrite(state->spill.strs, &slen, sizeof(slen));
+         BufFileWrite(state->spill.strs, str, full_len);
+         BufFileWrite(state->spill.strs, "", 1);
+     } else {
+         biscuit_ensure_capacity(idx, idx->num_records + 1);
+         ItemPointerCopy(tid, &idx->tids[idx->num_records]);
+         idx->data_cache[idx->num_records] = pnstrdup(str, full_len);
+     }
+     
+     if (state->nentries + 2 * len > state->maxentries)
+         biscuit_build_flush(state);
+     for (pos = 0; pos < len; pos++) {
+         unsigned char ch = (unsigned char)str[pos];
+         
+         state->entries[state->nentries].group = biscuit_group_encode(ch, false, pos);
+         state->entries[state->nentries++].rec = key;
+         state->entries[state->nentries].group = biscuit_group_encode(ch, true, -(len - pos));
+         state->entries[state->nentries++].rec = key;
+     }
+     
+     /* Only the exact length here; biscuit_build_lengths derives the rest */
+     if (len >= idx->max_length)
+         biscuit_grow_length_bitmaps(idx, len + 1);
+     if (!idx->length_bitmaps[len])
+         idx->length_bitmaps[len] = biscuit_roaring_create();
+     biscuit_roaring_add(idx->length_bitmaps[len], key);
+     
+     idx->num_records++;
+     
+     MemoryContextSwitchTo(oldcontext);
+     
+     if ((Pointer)txt != DatumGetPointer(values[0]))
+         pfree(txt);
+ }
+ 
+ /*
+  * Finish the length bitmaps once the heap scan is done.  length_ge[i] is the
+  * union of the exact-length bitmaps from i up, so it is built as a running
+  * OR from the longest length down instead of adding each record len times.
+  */
+ static void
+ biscuit_build_lengths(BiscuitIndex *idx)
+ {
+     MemoryContext oldcontext;
+     int i;
+     
+     oldcontext = MemoryContextSwitchTo(idx->context);
+     
+     if (!idx->length_bitmaps)
+         biscuit_init_length_bitmaps(idx);
+     
+     for (i = idx->max_length - 1; i >= 0; i--) {
+         biscuit_roaring_or_inplace(idx->length_ge_bitmaps[i], idx->length_ge_bitmaps[i + 1]);
+         if (idx->length_bitmaps[i])
+             biscuit_roaring_or_inplace(idx->length_ge_bitmaps[i], idx->length_bitmaps[i]);
+     }
+     
+     MemoryContextSwitchTo(oldcontext);
+ }
+ 
+ /* Start a participant's scan; an external build opens its record files */
+ static void
+ biscuit_build_begin(BiscuitBuildState *state)
+ {
+     if (state->external) {
+         state->spill.tids = biscuit_spill_create(state, "tids", -1);
+         state->spill.strs = biscuit_spill_create(state, "strs", -1);
+     }
+ }
+ 
+ /*
+  * Flush what is left.  An in-memory build derives char_cache and length_ge;
+  * an external one writes its last run and its exact-length bitmaps, which
+  * the merge turns into the rest.
+  */
+ static void
+ biscuit_build_finish(BiscuitBuildState *state)
+ {
+     BiscuitIndex *idx = state->idx;
+     MemoryContext oldcontext;
+     int ch, j;
+     
+     biscuit_build_flush(state);
+     pfree(state->entries);
+     pfree(state->scratch);
+     
+     if (state->external) {
+         BiscuitSink sink;
+         int32 max_length = idx->max_length;
+         
+         if (state->runbytes > 0)
+             biscuit_build_dump_run(state);
+         
+         state->spill.lens = biscuit_spill_create(state, "lens", -1);
+         sink.write = biscuit_buffile_write;
+         sink.arg = state->spill.lens;
+         BufFileWrite(state->spill.lens, &max_length, sizeof(max_length));
+         for (j = 0; j < max_length; j++)
+             biscuit_serialize_bitmap(&sink, idx->length_bitmaps[j]);
+         
+         state->spill.nrecords = idx->num_records;
+         return;
+     }
+     
+     /* A character occurs in a record iff it occurs at some position */
+     oldcontext = MemoryContextSwitchTo(idx->context);
+     for (ch = 0; ch < CHAR_RANGE; ch++) {
+         if (idx->pos_idx[ch].count == 0)
+             continue;
+         idx->char_cache[ch] = biscuit_roaring_create();
+         for (j = 0; j < idx->pos_idx[ch].count; j++)
+             biscuit_roaring_or_inplace(idx->char_cache[ch], idx->pos_idx[ch].entries[j].bitmap);
+     }
+     MemoryContextSwitchTo(oldcontext);
+     
+     biscuit_build_lengths(idx);
+ }
+ 
+ /* Close the spill files of a finished participant */
+ static void
+ biscuit_spill_close(BiscuitSpill *spill)
+ {
+     int r;
+     
+     if (spill->tids)
+         BufFileClose(spill->tids);
+     if (spill->strs)
+         BufFileClose(spill->strs);
+     if (spill->lens)
+         BufFileClose(spill->lens);
+     for (r = 0; r < spill->nruns; r++)
+         BufFileClose(spill->runs[r]);
+     MemSet(spill, 0, sizeof(BiscuitSpill));
+ }
+ 
+ /* Compact every bitmap once a build is complete */
+ static void
+ biscuit_optimize_index(BiscuitIndex *idx)
+ {
+     int ch, j;
+     
+     for (ch = 0; ch < CHAR_RANGE; ch++) {
+         for (j = 0; j < idx->pos_idx[ch].count; j++)
+             biscuit_roaring_optimize(idx->pos_idx[ch].entries[j].bitmap);
+         for (j = 0; j < idx->neg_idx[ch].count; j++)
+             biscuit_roaring_optimize(idx->neg_idx[ch].entries[j].bitmap);
+         if (idx->char_cache[ch])
+             biscuit_roaring_optimize(idx->char_cache[ch]);
+     }
+     for (j = 0; j < idx->max_length; j++) {
+         if (idx->length_bitmaps[j])
+             biscuit_roaring_optimize(idx->length_bitmaps[j]);
+     }
+     for (j = 0; j <= idx->max_length; j++)
+         biscuit_roaring_optimize(idx->length_ge_bitmaps[j]);
+ }
+ 
+ /* ==================== EXTERNAL MERGE ==================== */
+ 
+ /*
+  * When the heap is larger than maintenance_work_mem, the build does not
+  * keep the index in memory.  Each participant writes its records straight
+  * to temporary files and, whenever the bitmaps it has built reach its
+  * share of maintenance_work_mem, dumps them as a sorted run and starts
+  * over.  The merge then streams the snapshot: records are interleaved by
+  * TID, so the index is numbered in heap order as after an in-memory build,
+  * and the runs of all participants are merged by group, so only one
+  * bitmap per run is in memory at a time.  Only char_cache and the length
+  * bitmaps, which are small next to the position lists, are built in full.
+  */
+ 
+ /* A stretch of one participant's records that is contiguous in the index */
+ typedef struct {
+     int spill;
+     uint32 count;
+ } BiscuitMergeSegment;
+ 
+ /* Where a participant's records go: numbers from starts[i] up move up by offsets[i] */
+ typedef struct {
+     uint32 *starts;
+     uint32 *offsets;
+     int nsegs;
+     int maxsegs;
+ } BiscuitRecordMap;
+ 
+ typedef struct {
+     BufFile *file;
+     const BiscuitRecordMap *map;    /* renumbering of the run's records, or NULL */
+     uint32 group;           /* group of bm, BISCUIT_END_OF_LIST when done */
+     RoaringBitmap *bm;
+ } BiscuitRunReader;
+ 
+ static void
+ biscuit_run_advance(BiscuitRunReader *r)
+ {
+     BufFileReadExact(r->file, &r->group, sizeof(r->group));
+     r->bm = r->group == BISCUIT_END_OF_LIST ? NULL : biscuit_buffile_read_bitmap(r->file);
+ }
+ 
+ /* Whether map leaves record numbers as they are */
+ static inline bool
+ biscuit_map_is_identity(const BiscuitRecordMap *map)
+ {
+     return !map || map->nsegs == 0 || (map->nsegs == 1 && map->offsets[0] == 0);
+ }
+ 
+ /* a |= b, renumbered through map */
+ static void
+ biscuit_merge_bitmap(RoaringBitmap *a, const RoaringBitmap *b, const BiscuitRecordMap *map)
+ {
+     if (biscuit_map_is_identity(map))
+         biscuit_roaring_or_inplace(a, b);
+     else
+         biscuit_roaring_or_remap(a, b, map->starts, map->offsets, map->nsegs);
+ }
+ 
+ /*
+  * Plan the record order of the index: merge the TID streams of all
+  * participants, filling in where each participant's records go.  Every
+  * participant hands out its blocks in ascending order, so each stream is
+  * sorted, but for heap-only tuples, which are reported at the TID of their
+  * chain's root.  The merge keeps every stream's own order, so such records
+  * stay a little out of place and are left to VACUUM.  Returns the stretches
+  * of records in index order.
+  */
+ static BiscuitMergeSegment*
+ biscuit_merge_plan(BiscuitSpill *spills, int nspills, BiscuitRecordMap *maps, int *nsegs)
+ {
+     ItemPointerData *heads = (ItemPointerData *)palloc(nspills * sizeof(ItemPointerData));
+     uint32 *taken = (uint32 *)palloc0(nspills * sizeof(uint32));
+     BiscuitMergeSegment *segs;
+     int maxsegs = 16;
+     uint32 total = 0;
+     int last = -1;
+     int p;
+     
+     segs = (BiscuitMergeSegment *)palloc(maxsegs * sizeof(BiscuitMergeSegment));
+     *nsegs = 0;
+     
+     for (p = 0; p < nspills; p++) {
+         MemSet(&maps[p], 0, sizeof(BiscuitRecordMap));
+         biscuit_buffile_rewind(spills[p].tids);
+         if (spills[p].nrecords > 0)
+             BufFileReadExact(spills[p].tids, &heads[p], sizeof(ItemPointerData));
+     }
+     
+     for (;;) {
+         BiscuitRecordMap *map;
+         int best = -1;
+         
+         for (p = 0; p < nspills; p++) {
+             if (taken[p] < (uint32)spills[p].nrecords &&
+                 (best < 0 || ItemPointerCompare(&heads[p], &heads[best]) < 0))
+                 best = p;
+         }
+         if (best < 0)
+             break;
+         
+         if (best != last) {
+             if (*nsegs >= maxsegs) {
+                 maxsegs *= 2;
+                 segs = (BiscuitMergeSegment *)repalloc(segs, maxsegs * sizeof(BiscuitMergeSegment));
+             }
+             segs[*nsegs].spill = best;
+             segs[*nsegs].count = 0;
+             (*nsegs)++;
+             
+             map = &maps[best];
+             if (map->nsegs >= map->maxsegs) {
+                 map->maxsegs = Max(map->maxsegs * 2, 8);
+                 map->starts = map->starts
+                     ? (uint32 *)repalloc(map->starts, map->maxsegs * sizeof(uint32))
+                     : (uint32 *)palloc(map->maxsegs * sizeof(uint32));
+                 map->offsets = map->offsets
+                     ? (uint32 *)repalloc(map->offsets, map->maxsegs * sizeof(uint32))
+                     : (uint32 *)palloc(map->maxsegs * sizeof(uint32));
+             }
+             map->starts[map->nsegs] = taken[best];
+             map->offsets[map->nsegs] = total - taken[best];
+             map->nsegs++;
+             last = best;
+         }
+         
+         segs[*nsegs - 1].count++;
+         total++;
+         if (++taken[best] < (uint32)spills[best].nrecords)
+             BufFileReadExact(spills[best].tids, &heads[best], sizeof(ItemPointerData));
+         
+         if ((total & 0xFFFF) == 0)
+             CHECK_FOR_INTERRUPTS();
+     }
+     
+     pfree(heads);
+     pfree(taken);
+     
+     return segs;
+ }
+ 
+ /* Copy the records of all participants to sink, TIDs then strings, in the planned order */
+ static void
+ biscuit_merge_records(BiscuitSpill *spills, int nspills, const BiscuitMergeSegment *segs,
+                       int nsegs, BiscuitSink *sink)
+ {
+     PGAlignedBlock buf;
+     int p, s;
+     uint32 r;
+     
+     for (p = 0; p < nspills; p++) {
+         biscuit_buffile_rewind(spills[p].tids);
+         biscuit_buffile_rewind(spills[p].strs);
+     }
+     
+     for (s = 0; s < nsegs; s++) {
+         BufFile *file = spills[segs[s].spill].tids;
+         
+         for (r = 0; r < segs[s].count; r++) {
+             ItemPointerData tid;
+             
+             BufFileReadExact(file, &tid, sizeof(tid));
+             sink->write(sink->arg, &tid, sizeof(tid));
+         }
+     }
+     
+     for (s = 0; s < nsegs; s++) {
+         BufFile *file = spills[segs[s].spill].strs;
+         
+         CHECK_FOR_INTERRUPTS();
+         
+         for (r = 0; r < segs[s].count; r++) {
+             int32 slen;
+             size_t left;
+             
+             /* A string of slen bytes, then its terminating NUL */
+             BufFileReadExact(file, &slen, sizeof(slen));
+             sink->write(sink->arg, &slen, sizeof(slen));
+             for (left = (size_t)slen + 1; left > 0;) {
+                 size_t n = Min(left, (size_t)BLCKSZ);
+                 
+                 BufFileReadExact(file, buf.data, n);
+                 sink->write(sink->arg, buf.data, n);
+                 left -= n;
+             }
+         }
+     }
+ }
+ 
+ /*
+  * Merge the spill files of all participants, in TID order, into a
+  * snapshot stream written to sink.  Returns the number of records.  With
+  * TID keys the bitmaps of all participants are merged as they are.
+  */
+ static int
+ biscuit_merge_spills(BiscuitSpill *spills, int nspills, bool tid_keys, BiscuitSink *sink)
+ {
+     BiscuitIndex *idx = biscuit_create_index();
+     BiscuitSnapshotHeader hdr;
+     BiscuitRunReader *readers;
+     BiscuitRecordMap *maps;
+     BiscuitMergeSegment *segs;
+     MemoryContext oldcontext;
+     int32 end = BISCUIT_END_OF_LIST;
+     int nreaders = 0;
+     int nsegs;
+     int num_records;
+     int list = 0;
+     int p, r, i;
+     
+     maps = (BiscuitRecordMap *)palloc(nspills * sizeof(BiscuitRecordMap));
+     segs = biscuit_merge_plan(spills, nspills, maps, &nsegs);
+     
+     /* Lengths */
+     oldcontext = MemoryContextSwitchTo(idx->context);
+     for (p = 0; p < nspills; p++) {
+         int32 max_length;
+         
+         nreaders += spills[p].nruns;
+         idx->num_records += spills[p].nrecords;
+         
+         biscuit_buffile_rewind(spills[p].lens);
+         BufFileReadExact(spills[p].lens, &max_length, sizeof(max_length));
+         if (max_length > idx->max_length)
+             biscuit_grow_length_bitmaps(idx, max_length);
+         for (i = 0; i < max_length; i++) {
+             RoaringBitmap *bm = biscuit_buffile_read_bitmap(spills[p].lens);
+             
+             if (!bm)
+                 continue;
+             if (!idx->length_bitmaps[i])
+                 idx->length_bitmaps[i] = biscuit_roaring_create();
+             biscuit_merge_bitmap(idx->length_bitmaps[i], bm, tid_keys ? NULL : &maps[p]);
+             biscuit_roaring_free(bm);
+         }
+     }
+     idx->max_len = Max(idx->max_length - 1, 0);
+     MemoryContextSwitchTo(oldcontext);
+     biscuit_build_lengths(idx);
+     
+     MemSet(&hdr, 0, sizeof(hdr));
+     hdr.magic = BISCUIT_SNAPSHOT_MAGIC;
+     hdr.num_records = idx->num_records;
+     hdr.max_len = idx->max_len;
+     hdr.max_length = idx->max_length;
+     hdr.ngram = 1;
+     sink->write(sink->arg, &hdr, sizeof(hdr));
+     
+     biscuit_merge_records(spills, nspills, segs, nsegs, sink);
+     
+     /* Position lists: merge all runs by group */
+     readers = (BiscuitRunReader *)palloc0(Max(nreaders, 1) * sizeof(BiscuitRunReader));
+     nreaders = 0;
+     for (p = 0; p < nspills; p++) {
+         for (r = 0; r < spills[p].nruns; r++) {
+             BiscuitRunReader *reader = &readers[nreaders++];
+             
+             reader->file = spills[p].runs[r];
+             reader->map = tid_keys ? NULL : &maps[p];
+             biscuit_buffile_rewind(reader->file);
+             biscuit_run_advance(reader);
+         }
+     }
+     
+     for (;;) {
+         uint32 group = BISCUIT_END_OF_LIST;
+         RoaringBitmap *merged = NULL;
+         unsigned char ch;
+         bool neg;
+         int32 pos;
+         
+         CHECK_FOR_INTERRUPTS();
+         
+         for (r = 0; r < nreaders; r++)
+             group = Min(group, readers[r].group);
+         if (group == BISCUIT_END_OF_LIST)
+             break;
+         
+         oldcontext = MemoryContextSwitchTo(idx->context);
+         for (r = 0; r < nreaders; r++) {
+             if (readers[r].group != group)
+                 continue;
+             if (!merged && biscuit_map_is_identity(readers[r].map)) {
+                 merged = readers[r].bm;
+             } else {
+                 if (!merged)
+                     merged = biscuit_roaring_create();
+                 biscuit_merge_bitmap(merged, readers[r].bm, readers[r].map);
+                 biscuit_roaring_free(readers[r].bm);
+             }
+             biscuit_run_advance(&readers[r]);
+         }
+         
+         biscuit_group_decode(group, &ch, &neg, &pos);
+         if (!neg) {
+             if (!idx->char_cache[ch])
+                 idx->char_cache[ch] = biscuit_roaring_create();
+             biscuit_roaring_or_inplace(idx->char_cache[ch], merged);
+         }
+         MemoryContextSwitchTo(oldcontext);
+         
+         /* Close the lists of characters with no further groups */
+         for (; list < (int)(group / MAX_POSITIONS); list++)
+             sink->write(sink->arg, &end, sizeof(end));
+         
+         biscuit_roaring_optimize(merged);
+         sink->write(sink->arg, &pos, sizeof(pos));
+         biscuit_serialize_bitmap(sink, merged);
+         biscuit_roaring_free(merged);
+     }
+     for (; list < 2 * CHAR_RANGE; list++)
+         sink->write(sink->arg, &end, sizeof(end));
+     
+     biscuit_optimize_index(idx);
+     for (i = 0; i < CHAR_RANGE; i++)
+         biscuit_serialize_bitmap(sink, idx->char_cache[i]);
+     for (i = 0; i < idx->max_length; i++)
+         biscuit_serialize_bitmap(sink, idx->length_bitmaps[i]);
+     for (i = 0; i <= idx->max_length; i++)
+         biscuit_serialize_bitmap(sink, idx->length_ge_bitmaps[i]);
+     biscuit_serialize_bitmap(sink, idx->tombstones);
+     
+     num_records = idx->num_records;
+     for (p = 0; p < nspills; p++) {
+         if (maps[p].starts) {
+             pfree(maps[p].starts);
+             pfree(maps[p].offsets);
+         }
+     }
+     pfree(maps);
+     pfree(segs);
+     pfree(readers);
+     biscuit_free_index(idx);
+     
+     return num_records;
+ }
+ 
+ /* Merge into a private temporary file, from which the snapshot is copied */
+ static BufFile*
+ biscuit_merge_spills_to_file(BiscuitSpill *spills, int nspills, bool tid_keys, int *num_records)
+ {
+     BufFile *file = BufFileCreateTemp(false);
+     BiscuitSink sink;
+     
+     pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_BISCUIT_PHASE_MERGE);
+     
+     sink.write = biscuit_buffile_write;
+     sink.arg = file;
+     *num_records = biscuit_merge_spills(spills, nspills, tid_keys, &sink);
+     biscuit_buffile_rewind(file);
+     
+     return file;
+ }
+ 
+ /* Write a snapshot already serialized into a temporary file */
+ static void
+ biscuit_copy_snapshot(Relation index, BufFile *file, int num_records, Page metapage)
+ {
+     BiscuitPageWriter writer;
+     BiscuitSink sink;
+     
+     biscuit_writer_init(&writer, index, BISCUIT_SNAPSHOT_PAGE);
+     sink.write = biscuit_writer_write;
+     sink.arg = &writer;
+     biscuit_buffile_copy(file, &sink);
+     biscuit_writer_finish(&writer);
+     biscuit_set_snapshot(BiscuitPageGetMeta(metapage), &writer, num_records);
+ }
+ 
+ /* ==================== PARALLEL BUILD ==================== */
+ 
+ /*
+  * A parallel build splits the heap between the leader and its workers with
+  * a parallel table scan.  Each participant builds a partial index over the
+  * blocks it was handed, numbering its records from zero.  In memory,
+  * workers serialize their partial into a shared BufFile and the leader
+  * appends them to its own, shifting record numbers by the records already
+  * merged, so merging is one OR per bitmap.  In an external build, workers
+  * leave their spill files in the shared file set for the external merge.
+  */
+ 
+ #define PARALLEL_KEY_BISCUIT_SHARED UINT64CONST(0xB15C000000000001)
+ #define PARALLEL_KEY_BISCUIT_SPILLS UINT64CONST(0xB15C000000000002)
+ 
+ typedef struct BiscuitParallelShared {
+     Oid heaprelid;
+     Oid indexrelid;
+     int workmem;                /* build buffer of each participant, in kB */
+     bool external;
+     slock_t mutex;
+     double reltuples;           /* heap tuples seen by workers */
+     SharedFileSet fileset;      /* partial indexes or spill files of the workers */
+     /* ParallelTableScanDescData follows */
+ } BiscuitParallelShared;
+ 
+ /* What a worker of an external build left in the file set */
+ typedef struct {
+     int nrecords;
+     int nruns;
+ } BiscuitWorkerSpill;
+ 
+ #define BiscuitParallelTableScan(shared) \
+     ((ParallelTableScanDesc) ((char *) (shared) + BUFFERALIGN(sizeof(BiscuitParallelShared))))
+ 
+ static void
+ biscuit_merge_char_index(BiscuitIndex *idx, const CharIndex *src, unsigned char ch,
+                          bool neg, uint32_t offset)
+ {
+     int j;
+     
+     for (j = 0; j < src->count; j++) {
+         RoaringBitmap *bm = biscuit_build_bitmap(idx, ch, neg, src->entries[j].pos);
+         
+         biscuit_roaring_or_offset(bm, src->entries[j].bitmap, offset);
+     }
+ }
+ 
+ /*
+  * Append a freshly built partial index to idx.  Its records take the slots
+  * after idx's own, so every bitmap is ORed in shifted by the old record
+  * count, unless the bitmaps hold TID keys.  Neither side has deleted
+  * records yet.
+  */
+ static void
+ biscuit_merge_index(BiscuitIndex *idx, BiscuitIndex *part)
+ {
+     MemoryContext oldcontext;
+     uint32_t first = idx->num_records;
+     uint32_t offset = idx->tid_keys ? 0 : first;
+     int ch;
+     int i;
+     
+     Assert(idx->free_count == 0 && part->free_count == 0);
+     
+     oldcontext = MemoryContextSwitchTo(idx->context);
+     
+     biscuit_ensure_capacity(idx, idx->num_records + part->num_records);
+     for (i = 0; i < part->num_records; i++) {
+         idx->tids[first + i] = part->tids[i];
+         idx->data_cache[first + i] = pstrdup(part->data_cache[i]);
+     }
+     idx->num_records += part->num_records;
+     
+     for (ch = 0; ch < CHAR_RANGE; ch++) {
+         biscuit_merge_char_index(idx, &part->pos_idx[ch], ch, false, offset);
+         biscuit_merge_char_index(idx, &part->neg_idx[ch], ch, true, offset);
+         
+         if (part->char_cache[ch]) {
+             if (!idx->char_cache[ch])
+                 idx->char_cache[ch] = biscuit_roaring_create();
+             biscuit_roaring_or_offset(idx->char_cache[ch], part->char_cache[ch], offset);
+         }
+     }
+     
+     if (part->max_length > idx->max_length)
+         biscuit_grow_length_bitmaps(idx, part->max_length);
+     
+     for (i = 0; i < part->max_length; i++) {
+         if (!part->length_bitmaps[i])
+             continue;
+         if (!idx->length_bitmaps[i])
+             idx->length_bitmaps[i] = biscuit_roaring_create();
+         biscuit_roaring_or_offset(idx->length_bitmaps[i], part->length_bitmaps[i], offset);
+     }
+     for (i = 0; i <= part->max_length; i++) {
+         if (part->length_ge_bitmaps[i])
+             biscuit_roaring_or_offset(idx->length_ge_bitmaps[i], part->length_ge_bitmaps[i], offset);
+     }
+     
+     if (part->max_len > idx->max_len)
+         idx->max_len = part->max_len;
+     
+     MemoryContextSwitchTo(oldcontext);
+ }
+ 
+ /* Read back the partial index of one worker and append it to idx */
+ static void
+ biscuit_merge_partial(BiscuitIndex *idx, BiscuitParallelShared *shared, int worker)
+ {
+     BufFile *file;
+     BiscuitIndex *part;
+     MemoryContext oldcontext;
+     char *image;
+     uint64 len;
+     
+     file = biscuit_spill_open(&shared->fileset.fs, worker, "partial", -1);
+     len = BufFileSize(file);
+     
+     part = biscuit_create_index();
+     oldcontext = MemoryContextSwitchTo(part->context);
+     image = (char *)MemoryContextAllocHuge(part->context, len);
+     BufFileReadExact(file, image, len);
+     BufFileClose(file);
+     biscuit_deserialize_index(part, image, len, false);
+     MemoryContextSwitchTo(oldcontext);
+     
+     biscuit_merge_index(idx, part);
+     biscuit_free_index(part);
+ }
+ 
+ /* Open the spill files a worker of an external build left behind */
+ static void
+ biscuit_open_worker_spill(BiscuitSpill *spill, FileSet *fileset, int worker,
+                           const BiscuitWorkerSpill *info)
+ {
+     int r;
+     
+     MemSet(spill, 0, sizeof(BiscuitSpill));
+     spill->tids = biscuit_spill_open(fileset, worker, "tids", -1);
+     spill->strs = biscuit_spill_open(fileset, worker, "strs", -1);
+     spill->lens = biscuit_spill_open(fileset, worker, "lens", -1);
+     spill->nrecords = info->nrecords;
+     spill->nruns = spill->maxruns = info->nruns;
+     spill->runs = (BufFile **)palloc(Max(info->nruns, 1) * sizeof(BufFile *));
+     for (r = 0; r < info->nruns; r++)
+         spill->runs[r] = biscuit_spill_open(fileset, worker, "run", r);
+ }
+ 
+ void
+ biscuit_parallel_build_main(dsm_segment *seg, shm_toc *toc)
+ {
+     BiscuitParallelShared *shared;
+     BiscuitWorkerSpill *spills;
+     Relation heap;
+     Relation index;
+     IndexInfo *indexInfo;
+     TableScanDesc scan;
+     BiscuitIndex *idx;
+     BiscuitBuildState state;
+     double reltuples;
+     
+     shared = (BiscuitParallelShared *)shm_toc_lookup(toc, PARALLEL_KEY_BISCUIT_SHARED, false);
+     spills = (BiscuitWorkerSpill *)shm_toc_lookup(toc, PARALLEL_KEY_BISCUIT_SPILLS, false);
+     
+     /* Same lock modes as the leader's CREATE INDEX; we are in its lock group */
+     heap = table_open(shared->heaprelid, ShareLock);
+     index = index_open(shared->indexrelid, AccessExclusiveLock);
+     indexInfo = BuildIndexInfo(index);
+     
+     SharedFileSetAttach(&shared->fileset, seg);
+     
+     idx = biscuit_create_index();
+     idx->tid_keys = BiscuitUseTidKeys(index);
+     biscuit_build_state_init(&state, idx, shared->workmem, shared->external,
+                              &shared->fileset.fs, ParallelWorkerNumber);
+     biscuit_build_begin(&state);
+     scan = table_beginscan_parallel(heap, BiscuitParallelTableScan(shared));
+     reltuples = table_index_build_scan(heap, index, indexInfo, true, false,
+                                        biscuit_build_callback, &state, scan);
+     biscuit_build_finish(&state);
+     
+     if (shared->external) {
+         spills[ParallelWorkerNumber].nrecords = state.spill.nrecords;
+         spills[ParallelWorkerNumber].nruns = state.spill.nruns;
+         biscuit_spill_close(&state.spill);
+     } else {
+         BiscuitSink sink;
+         BufFile *file;
+         
+         biscuit_optimize_index(idx);
+         file = biscuit_spill_create(&state, "partial", -1);
+         sink.write = biscuit_buffile_write;
+         sink.arg = file;
+         biscuit_serialize_index(idx, &sink);
+         BufFileClose(file);
+     }
+     
+     biscuit_free_index(idx);
+     
+     SpinLockAcquire(&shared->mutex);
+     shared->reltuples += reltuples;
+     SpinLockRelease(&shared->mutex);
+     
+     index_close(index, AccessExclusiveLock);
+     table_close(heap, ShareLock);
+ }
+ 
+ /*
+  * Build idx with the help of up to nworkers parallel workers.  The leader
+  * scans its share of the heap too.  An external build leaves idx empty and
+  * returns the merged snapshot in *snapshot instead.  Returns the number of
+  * heap tuples seen, or -1 if no parallel context could be set up.
+  */
+ static double
+ biscuit_parallel_build(Relation heap, Relation index, IndexInfo *indexInfo,
+                        BiscuitIndex *idx, int nworkers, bool external,
+                        BufFile **snapshot, int *num_records)
+ {
+     ParallelContext *pcxt;
+     BiscuitParallelShared *shared;
+     BiscuitWorkerSpill *workerspills;
+     BiscuitBuildState state;
+     TableScanDesc scan;
+     Size estshared;
+     double reltuples;
+     int i;
+     
+     EnterParallelMode();
+     pcxt = CreateParallelContext("pg_biscuit", "biscuit_parallel_build_main", nworkers);
+     
+     estshared = BUFFERALIGN(sizeof(BiscuitParallelShared)) +
+                 table_parallelscan_estimate(heap, SnapshotAny);
+     shm_toc_estimate_chunk(&pcxt->estimator, estshared);
+     shm_toc_estimate_chunk(&pcxt->estimator, mul_size(nworkers, sizeof(BiscuitWorkerSpill)));
+     shm_toc_estimate_keys(&pcxt->estimator, 2);
+     
+     InitializeParallelDSM(pcxt);
+     if (pcxt->seg == NULL) {
+         DestroyParallelContext(pcxt);
+         ExitParallelMode();
+         return -1;
+     }
+     
+     shared = (BiscuitParallelShared *)shm_toc_allocate(pcxt->toc, estshared);
+     shared->heaprelid = RelationGetRelid(heap);
+     shared->indexrelid = RelationGetRelid(index);
+     shared->workmem = Max(maintenance_work_mem / (nworkers + 1), 64);
+     shared->external = external;
+     SpinLockInit(&shared->mutex);
+     shared->reltuples = 0;
+     SharedFileSetInit(&shared->fileset, pcxt->seg);
+     table_parallelscan_initialize(heap, BiscuitParallelTableScan(shared), SnapshotAny);
+     /* Hand out blocks from 0 up, so each participant sees ascending TIDs */
+     BiscuitParallelTableScan(shared)->phs_syncscan = false;
+     shm_toc_insert(pcxt->toc, PARALLEL_KEY_BISCUIT_SHARED, shared);
+     
+     workerspills = (BiscuitWorkerSpill *)shm_toc_allocate(pcxt->toc,
+                                                           mul_size(nworkers, sizeof(BiscuitWorkerSpill)));
+     shm_toc_insert(pcxt->toc, PARALLEL_KEY_BISCUIT_SPILLS, workerspills);
+     
+     LaunchParallelWorkers(pcxt);
+     
+     /* The leader's spill files are named after the last possible worker */
+     biscuit_build_state_init(&state, idx, shared->workmem, external,
+                              &shared->fileset.fs, nworkers);
+     biscuit_build_begin(&state);
+     scan = table_beginscan_parallel(heap, BiscuitParallelTableScan(shared));
+     reltuples = table_index_build_scan(heap, index, indexInfo, true, true,
+                                        biscuit_build_callback, &state, scan);
+     biscuit_build_finish(&state);
+     
+     WaitForParallelWorkersToFinish(pcxt);
+     reltuples += shared->reltuples;
+     
+     if (external) {
+         int nspills = pcxt->nworkers_launched + 1;
+         BiscuitSpill *spills = (BiscuitSpill *)palloc(nspills * sizeof(BiscuitSpill));
+         
+         spills[0] = state.spill;
+         for (i = 0; i < pcxt->nworkers_launched; i++)
+             biscuit_open_worker_spill(&spills[i + 1], &shared->fileset.fs, i, &workerspills[i]);
+         
+         *snapshot = biscuit_merge_spills_to_file(spills, nspills, idx->tid_keys, num_records);
+         
+         for (i = 0; i < nspills; i++)
+             biscuit_spill_close(&spills[i]);
+         pfree(spills);
+     } else {
+         pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_BISCUIT_PHASE_MERGE);
+         for (i = 0; i < pcxt->nworkers_launched; i++)
+             biscuit_merge_partial(idx, shared, i);
+     }
+     
+     elog(INFO, "Biscuit: Parallel build merged %d worker partials", pcxt->nworkers_launched);
+     
+     DestroyParallelContext(pcxt);
+     ExitParallelMode();
+     
+     return reltuples;
+ }
+ 
+ /* Build without workers; an external build returns the snapshot in *snapshot */
+ static double
+ biscuit_serial_build(Relation heap, Relation index, IndexInfo *indexInfo,
+                      BiscuitIndex *idx, bool external, BufFile **snapshot, int *num_records)
+ {
+     BiscuitBuildState state;
+     double reltuples;
+     
+     biscuit_build_state_init(&state, idx, maintenance_work_mem, external, NULL, 0);
+     biscuit_build_begin(&state);
+     /* No synchronized scan: starting mid-heap would wrap around out of TID order */
+     reltuples = table_index_build_range_scan(heap, index, indexInfo, false, false, true,
+                                              0, InvalidBlockNumber,
+                                              biscuit_build_callback, &state, NULL);
+     biscuit_build_finish(&state);
+     
+     if (external) {
+         *snapshot = biscuit_merge_spills_to_file(&state.spill, 1, idx->tid_keys, num_records);
+         biscuit_spill_close(&state.spill);
+     }
+     
+     return reltuples;
+ }
+ 
+ /* ==================== IAM CALLBACK FUNCTIONS ==================== */
+ 
+ static IndexBuildResult *
+ biscuit_build(Relation heap, Relation index, IndexInfo *indexInfo)
+ {
+     IndexBuildResult *result;
+     BiscuitIndex *idx;
+     BufFile *snapshot = NULL;
+     double reltuples = -1;
+     int num_records = 0;
+     bool external;
+     int nworkers;
+     int natts;
+     Buffer metabuf;
+     GenericXLogState *state;
+     Page metapage;
+     
+     natts = indexInfo->ii_NumIndexAttrs;
      
-     MemoryContextSwitchTo(oldcontext);
+     if (natts != 1)
+         ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("biscuit index supports only one column")));
      
-     slot = table_slot_create(heap, NULL);
-     scan = table_beginscan(heap, SnapshotAny, 0, NULL);
+     if (RelationGetNumberOfBlocks(index) != 0)
+         elog(ERROR, "index \"%s\" already contains data",
+              RelationGetRelationName(index));
      
-     while (table_scan_getnextslot(scan, ForwardScanDirection, slot)) {
-         int pos;
-         text *txt;
-         char *str;
-         int len;
-         bool isnull;
-         bool should_free;
-         Datum value;
-         
-         slot_getallattrs(slot);
-         value = slot_getattr(slot, indexcol, &isnull);
-         
-         if (!isnull) {
-             txt = DatumGetTextPP(value);
-             str = VARDATA_ANY(txt);
-             len = VARSIZE_ANY_EXHDR(txt);
-             should_free = (txt != DatumGetTextPP(value));
-             
-             if (len > MAX_POSITIONS) len = MAX_POSITIONS;
-             if (len > idx->max_len) idx->max_len = len;
-             
-             oldcontext = MemoryContextSwitchTo(indexContext);
-             
-             if (idx->num_records >= idx->capacity) {
-                 idx->capacity *= 2;
-                 idx->tids = (ItemPointerData *)repalloc(idx->tids, idx->capacity * sizeof(ItemPointerData));
-                 idx->data_cache = (char **)repalloc(idx->data_cache, idx->capacity * sizeof(char *));
-             }
-             ItemPointerCopy(&slot->tts_tid, &idx->tids[idx->num_records]);
-             idx->data_cache[idx->num_records] = pstrdup(str);
-             
-             for (pos = 0; pos < len; pos++) {
-                 unsigned char uch = (unsigned char)str[pos];
-                 RoaringBitmap *bm;
-                 int neg_offset;
-                 
-                 bm = biscuit_get_pos_bitmap(idx, uch, pos);
-                 if (!bm) {
-                     bm = biscuit_roaring_create();
-                     biscuit_set_pos_bitmap(idx, uch, pos, bm);
-                 }
-                 biscuit_roaring_add(bm, idx->num_records);
-                 
-                 neg_offset = -(len - pos);
-                 bm = biscuit_get_neg_bitmap(idx, uch, neg_offset);
-                 if (!bm) {
-                     bm = biscuit_roaring_create();
-                     biscuit_set_neg_bitmap(idx, uch, neg_offset, bm);
-                 }
-                 biscuit_roaring_add(bm, idx->num_records);
-                 
-                 if (!idx->char_cache[uch])
-                     idx->char_cache[uch] = biscuit_roaring_create();
-                 biscuit_roaring_add(idx->char_cache[uch], idx->num_records);
-             }
-             
-             idx->num_records++;
-             
-             MemoryContextSwitchTo(oldcontext);
-             
-             if (should_free)
-                 pfree(txt);
-         }
-     }
+     /* Initialize in-memory index */
+     idx = biscuit_create_index();
+     idx->tid_keys = BiscuitUseTidKeys(index);
      
-     table_endscan(scan);
-     ExecDropSingleTupleTableSlot(slot);
+     /*
+      * The index holds a copy of every string plus its bitmaps, so a heap
+      * that does not fit in maintenance_work_mem will not yield an index
+      * that does either: spill to disk instead.
+      */
+     external = (double)RelationGetNumberOfBlocks(heap) * BLCKSZ > (double)maintenance_work_mem * 1024;
      
-     elog(INFO, "Biscuit: Loaded %d records from heap, max_len=%d", idx->num_records, idx->max_len);
+     elog(INFO, "Biscuit: Starting %s index build on relation %s",
+          external ? "external" : "in-memory", RelationGetRelationName(heap));
      
-     oldcontext = MemoryContextSwitchTo(indexContext);
+     pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_BISCUIT_PHASE_TABLESCAN);
      
-     idx->max_length = idx->max_len + 1;
-     idx->length_bitmaps = (RoaringBitmap **)palloc0(idx->max_length * sizeof(RoaringBitmap *));
-     idx->length_ge_bitmaps = (RoaringBitmap **)palloc0((idx->max_length + 1) * sizeof(RoaringBitmap *));
+     /* Before PostgreSQL 17 the core only plans parallel builds for btree */
+ #if PG_VERSION_NUM >= 170000
+     nworkers = indexInfo->ii_ParallelWorkers;
+ #else
+     nworkers = plan_create_index_workers(RelationGetRelid(heap), RelationGetRelid(index));
+ #endif
      
-     for (ch = 0; ch <= idx->max_length; ch++)
-         idx->length_ge_bitmaps[ch] = biscuit_roaring_create();
+     /* Concurrent builds need an MVCC snapshot; keep those serial */
+     if (nworkers > 0 && !indexInfo->ii_Concurrent)
+         reltuples = biscuit_parallel_build(heap, index, indexInfo, idx, nworkers,
+                                            external, &snapshot, &num_records);
+     if (reltuples < 0)
+         reltuples = biscuit_serial_build(heap, index, indexInfo, idx,
+                                          external, &snapshot, &num_records);
+     
+     /*
+      * Parallel participants scan blocks in interleaved chunks, so their
+      * merged records may be out of TID order; renumber before writing.  An
+      * external build interleaves them by TID in the merge instead.
+      */
+     if (!external) {
+         biscuit_init_tid_order(idx);
+         if (!biscuit_roaring_is_empty(idx->unordered))
+             biscuit_renumber_records(idx);
+         biscuit_optimize_index(idx);
+         num_records = idx->num_records;
+     }
      
-     MemoryContextSwitchTo(oldcontext);
+     elog(INFO, "Biscuit: Indexed %d records", num_records);
      
-     slot = table_slot_create(heap, NULL);
-     scan = table_beginscan(heap, SnapshotAny, 0, NULL);
-     rec_idx = 0;
+     pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_BISCUIT_PHASE_WRITE);
      
-     while (table_scan_getnextslot(scan, ForwardScanDirection, slot)) {
-         text *txt;
-         char *str;
-         int len;
-         int i;
-         bool isnull;
-         bool should_free;
-         Datum value;
-         
-         slot_getallattrs(slot);
-         value = slot_getattr(slot, indexcol, &isnull);
-         
-         if (!isnull) {
-             txt = DatumGetTextPP(value);
-             str = VARDATA_ANY(txt);
-             len = VARSIZE_ANY_EXHDR(txt);
-             should_free = (txt != DatumGetTextPP(value));
-             
-             oldcontext = MemoryContextSwitchTo(indexContext);
-             
-             if (len < idx->max_length) {
-                 if (!idx->length_bitmaps[len])
-                     idx->length_bitmaps[len] = biscuit_roaring_create();
-                 biscuit_roaring_add(idx->length_bitmaps[len], rec_idx);
-             }
-             
-             for (i = 0; i <= len && i < idx->max_length; i++)
-                 biscuit_roaring_add(idx->length_ge_bitmaps[i], rec_idx);
-             
-             MemoryContextSwitchTo(oldcontext);
-             
-             rec_idx++;
-             if (should_free)
-                 pfree(txt);
-         }
+     /* The optional layers go into the snapshot with the rest */
+     if (!snapshot) {
+         MemoryContext oldcontext = MemoryContextSwitchTo(idx->context);
+         
+         biscuit_init_ngram_bitmaps(idx, BiscuitGetNgram(index));
+         biscuit_init_fold_bitmaps(idx, BiscuitUseCaseFold(index));
+         MemoryContextSwitchTo(oldcontext);
      }
      
-     table_endscan(scan);
-     ExecDropSingleTupleTableSlot(slot);
+     /* Persist: metapage on block 0, then the snapshot stream */
+     metabuf = biscuit_new_buffer(index);
+     Assert(BufferGetBlockNumber(metabuf) == BISCUIT_METAPAGE_BLKNO);
+     state = GenericXLogStart(index);
+     metapage = GenericXLogRegisterBuffer(state, metabuf, GENERIC_XLOG_FULL_IMAGE);
+     biscuit_init_metapage(metapage, idx->tid_keys ? BISCUIT_META_TID_KEYS : 0);
+     if (snapshot)
+         biscuit_copy_snapshot(index, snapshot, num_records, metapage);
+     else
+         biscuit_write_snapshot(index, idx, metapage);
+     GenericXLogFinish(state);
+     UnlockReleaseBuffer(metabuf);
+     
+     /* An external build never had the whole index in memory; load it on first use */
+     if (snapshot) {
+         BufFileClose(snapshot);
+         biscuit_free_index(idx);
+     } else {
+         biscuit_cache_store(index, idx);
+     }
      
-     table_close(heap, AccessShareLock);
+     elog(INFO, "Biscuit: Index build complete, %u pages written",
+          RelationGetNumberOfBlocks(index));
      
-     elog(INFO, "Biscuit: Index load complete");
+     result = (IndexBuildResult *)palloc(sizeof(IndexBuildResult));
+     result->heap_tuples = reltuples;
+     result->index_tuples = num_records;
      
-     return idx;
+     return result;
+ }
+ 
+ static char*
+ biscuit_buildphasename(int64 phasenum)
+ {
+     switch (phasenum) {
+         case PROGRESS_CREATEIDX_SUBPHASE_INITIALIZE:
+             return "initializing";
+         case PROGRESS_BISCUIT_PHASE_TABLESCAN:
+             return "scanning table";
+         case PROGRESS_BISCUIT_PHASE_MERGE:
+             return "merging partial indexes";
+         case PROGRESS_BISCUIT_PHASE_WRITE:
+             return "writing snapshot";
+         default:
+             return NULL;
+     }
  }
  
  static void
  biscuit_buildempty(Relation index)
  {
-     /* Nothing to do for empty index */
+     Buffer metabuf;
+     
+     /* An unlogged index starts over from an empty metapage */
+     metabuf = ReadBufferExtended(index, INIT_FORKNUM, P_NEW, RBM_NORMAL, NULL);
+     LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+     
+     START_CRIT_SECTION();
+     biscuit_init_metapage(BufferGetPage(metabuf), BiscuitUseTidKeys(index) ? BISCUIT_META_TID_KEYS : 0);
+     MarkBufferDirty(metabuf);
+     log_newpage_buffer(metabuf, true);
+     END_CRIT_SECTION();
+     
+     UnlockReleaseBuffer(metabuf);
  }
  
  static bool
@@ -1250,123 +5922,56 @@
  {
      BiscuitIndex *idx;
      MemoryContext oldcontext;
-     MemoryContext indexContext;
+     Buffer metabuf;
+     GenericXLogState *state;
+     Page metapage;
+     BiscuitMetaPage meta;
+     BiscuitLogRecord rec;
+     uint32 generation;
      text *txt;
      char *str;
-     int len, pos;
-     uint32_t rec_idx;
-     
-     if (!index->rd_indexcxt) {
-         index->rd_indexcxt = AllocSetContextCreate(CacheMemoryContext,
-                                                     "Biscuit index context",
-                                                     ALLOCSET_DEFAULT_SIZES);
-     }
-     indexContext = index->rd_indexcxt;
-     
-     idx = (BiscuitIndex *)index->rd_amcache;
-     
-     if (!idx) {
-         elog(WARNING, "Biscuit: Index cache miss on INSERT - this should only happen once");
-         idx = biscuit_load_index(index);
-         index->rd_amcache = idx;
-     }
+     int len;
      
      if (isnull[0]) {
          return true;
      }
      
-     oldcontext = MemoryContextSwitchTo(indexContext);
-     
      txt = DatumGetTextPP(values[0]);
      str = VARDATA_ANY(txt);
      len = VARSIZE_ANY_EXHDR(txt);
      
-     if (len > MAX_POSITIONS) len = MAX_POSITIONS;
-     
-     if (biscuit_pop_free_slot(idx, &rec_idx)) {
-         biscuit_roaring_remove(idx->tombstones, rec_idx);
-         idx->tombstone_count--;
-         
-         if (idx->data_cache[rec_idx]) {
-             biscuit_remove_from_all_indices(idx, rec_idx);
-             pfree(idx->data_cache[rec_idx]);
-         }
-     } else {
-         if (idx->num_records >= idx->capacity) {
-             idx->capacity *= 2;
-             idx->tids = (ItemPointerData *)repalloc(idx->tids, 
-                                                     idx->capacity * sizeof(ItemPointerData));
-             idx->data_cache = (char **)repalloc(idx->data_cache, 
-                                                 idx->capacity * sizeof(char *));
-         }
-         rec_idx = idx->num_records++;
-     }
-     
-     ItemPointerCopy(ht_ctid, &idx->tids[rec_idx]);
-     idx->data_cache[rec_idx] = pnstrdup(str, len);
-     
-     if (len > idx->max_len)
-         idx->max_len = len;
-     
-     for (pos = 0; pos < len; pos++) {
-         unsigned char uch = (unsigned char)str[pos];
-         RoaringBitmap *bm;
-         int neg_offset;
-         
-         bm = biscuit_get_pos_bitmap(idx, uch, pos);
-         if (!bm) {
-             bm = biscuit_roaring_create();
-             biscuit_set_pos_bitmap(idx, uch, pos, bm);
-         }
-         biscuit_roaring_add(bm, rec_idx);
-         
-         neg_offset = -(len - pos);
-         bm = biscuit_get_neg_bitmap(idx, uch, neg_offset);
-         if (!bm) {
-             bm = biscuit_roaring_create();
-             biscuit_set_neg_bitmap(idx, uch, neg_offset, bm);
-         }
-         biscuit_roaring_add(bm, rec_idx);
-         
-         if (!idx->char_cache[uch])
-             idx->char_cache[uch] = biscuit_roaring_create();
-         biscuit_roaring_add(idx->char_cache[uch], rec_idx);
-     }
-     
-     if (len >= idx->max_length) {
-         int old_max = idx->max_length;
-         int new_max = len + 1;
-         int i;
-         
-         RoaringBitmap **new_bitmaps = (RoaringBitmap **)palloc0(new_max * sizeof(RoaringBitmap *));
-         RoaringBitmap **new_ge_bitmaps = (RoaringBitmap **)palloc0((new_max + 1) * sizeof(RoaringBitmap *));
-         
-         if (old_max > 0) {
-             memcpy(new_bitmaps, idx->length_bitmaps, old_max * sizeof(RoaringBitmap *));
-             memcpy(new_ge_bitmaps, idx->length_ge_bitmaps, old_max * sizeof(RoaringBitmap *));
-         }
-         
-         for (i = old_max; i < new_max; i++)
-             new_bitmaps[i] = NULL;
-         for (i = old_max; i <= new_max; i++)
-             new_ge_bitmaps[i] = biscuit_roaring_create();
-         
-         idx->length_bitmaps = new_bitmaps;
-         idx->length_ge_bitmaps = new_ge_bitmaps;
-         idx->max_length = new_max;
-     }
-     
-     if (!idx->length_bitmaps[len])
-         idx->length_bitmaps[len] = biscuit_roaring_create();
-     biscuit_roaring_add(idx->length_bitmaps[len], rec_idx);
-     
-     for (pos = 0; pos <= len && pos < idx->max_length; pos++)
-         biscuit_roaring_add(idx->length_ge_bitmaps[pos], rec_idx);
-     
-     idx->insert_count++;
-     
+     /*
+      * Writers serialize on the metapage.  Catch up with other backends first
+      * so that the slot we pick is the one they will replay into.
+      */
+     metabuf = biscuit_lock_metapage(index, BUFFER_LOCK_EXCLUSIVE);
+     idx = biscuit_get_index(index, BufferGetPage(metabuf), true);
+     
+     MemSet(&rec, 0, sizeof(rec));
+     rec.type = BISCUIT_LOG_INSERT;
+     rec.rec_idx = biscuit_next_slot(idx);
+     rec.len = len;
+     ItemPointerCopy(ht_ctid, &rec.tid);
+     
+     /* If we fail before the local copy is updated too, force a reload */
+     generation = idx->generation;
+     idx->generation = 0;
+     
+     state = GenericXLogStart(index);
+     metapage = GenericXLogRegisterBuffer(state, metabuf, 0);
+     meta = BiscuitPageGetMeta(metapage);
+     biscuit_log_append(index, idx, metapage, &rec, str, len);
+     if (rec.rec_idx >= meta->num_records)
+         meta->num_records = rec.rec_idx + 1;
+     GenericXLogFinish(state);
+     
+     oldcontext = MemoryContextSwitchTo(idx->context);
+     biscuit_apply_insert(idx, rec.rec_idx, ht_ctid, str, len);
      MemoryContextSwitchTo(oldcontext);
      
+     idx->generation = generation;
+     UnlockReleaseBuffer(metabuf);
+     
      return true;
  }
  
@@ -1376,90 +5981,87 @@
  {
      Relation index = info->index;
      BiscuitIndex *idx;
+     Buffer metabuf;
+     GenericXLogState *state = NULL;
+     Page metapage = NULL;
+     BiscuitLogRecord rec;
+     uint32 generation;
+     uint32_t *dead;
+     int ndead = 0;
      int i;
-     
-     idx = (BiscuitIndex *)index->rd_amcache;
-     
-     if (!idx) {
-         elog(WARNING, "Biscuit: Index not cached during bulkdelete - loading");
-         idx = biscuit_load_index(index);
-         index->rd_amcache = idx;
-     }
+     MemoryContext oldcontext;
      
      if (!stats) {
          stats = (IndexBulkDeleteResult *)palloc0(sizeof(IndexBulkDeleteResult));
      }
      
+     metabuf = biscuit_lock_metapage(index, BUFFER_LOCK_EXCLUSIVE);
+     idx = biscuit_get_index(index, BufferGetPage(metabuf), true);
+     generation = idx->generation;
+     
+     dead = (uint32_t *)palloc(Max(idx->num_records, 1) * sizeof(uint32_t));
+     
      for (i = 0; i < idx->num_records; i++) {
          if (idx->data_cache[i] == NULL)
              continue;
          
-         #ifdef HAVE_ROARING
-         if (roaring_bitmap_contains(idx->tombstones, (uint32_t)i))
+         if (biscuit_roaring_contains(idx->tombstones, biscuit_record_key(idx, i)))
              continue;
-         #else
-         uint32_t block = i >> 6;
-         uint32_t bit = i & 63;
-         if (block < idx->tombstones->num_blocks &&
-             (idx->tombstones->blocks[block] & (1ULL << bit)))
-             continue;
-         #endif
          
-         if (callback(&idx->tids[i], callback_state)) {
-             biscuit_roaring_add(idx->tombstones, (uint32_t)i);
-             idx->tombstone_count++;
-             biscuit_push_free_slot(idx, (uint32_t)i);
-             stats->tuples_removed++;
-             idx->delete_count++;
-         }
+         if (callback(&idx->tids[i], callback_state))
+             dead[ndead++] = (uint32_t)i;
+     }
+     
+     /* Log all tombstones of this pass as one record, then apply them */
+     if (ndead > 0) {
+         /* If we fail before the local copy is updated too, force a reload */
+         idx->generation = 0;
+         state = GenericXLogStart(index);
+         metapage = GenericXLogRegisterBuffer(state, metabuf, 0);
+         
+         MemSet(&rec, 0, sizeof(rec));
+         rec.type = BISCUIT_LOG_TOMBSTONE;
+         rec.nslots = ndead;
+         biscuit_log_append(index, idx, metapage, &rec, dead, ndead * sizeof(uint32_t));
+         
+         oldcontext = MemoryContextSwitchTo(idx->context);
+         for (i = 0; i < ndead; i++)
+             biscuit_apply_tombstone(idx, dead[i]);
+         MemoryContextSwitchTo(oldcontext);
+         
+         stats->tuples_removed += ndead;
      }
      
      /* OPTIMIZATION 10: Batch cleanup only when threshold reached */
      if (idx->tombstone_count >= TOMBSTONE_CLEANUP_THRESHOLD) {
-         int ch, j;
-         
-         elog(INFO, "Biscuit: Cleanup threshold reached (%d tombstones), performing cleanup", 
+         elog(INFO, "Biscuit: Cleanup threshold reached (%d tombstones), performing cleanup",
               idx->tombstone_count);
          
-         for (ch = 0; ch < CHAR_RANGE; ch++) {
-             CharIndex *pos_cidx = &idx->pos_idx[ch];
-             for (j = 0; j < pos_cidx->count; j++)
-                 biscuit_roaring_andnot_inplace(pos_cidx->entries[j].bitmap, idx->tombstones);
-             
-             CharIndex *neg_cidx = &idx->neg_idx[ch];
-             for (j = 0; j < neg_cidx->count; j++)
-                 biscuit_roaring_andnot_inplace(neg_cidx->entries[j].bitmap, idx->tombstones);
-             
-             if (idx->char_cache[ch])
-                 biscuit_roaring_andnot_inplace(idx->char_cache[ch], idx->tombstones);
-         }
-         
-         for (j = 0; j < idx->max_length; j++) {
-             if (idx->length_bitmaps[j])
-                 biscuit_roaring_andnot_inplace(idx->length_bitmaps[j], idx->tombstones);
-             if (idx->length_ge_bitmaps[j])
-                 biscuit_roaring_andnot_inplace(idx->length_ge_bitmaps[j], idx->tombstones);
+         idx->generation = 0;
+         if (!state) {
+             state = GenericXLogStart(index);
+             metapage = GenericXLogRegisterBuffer(state, metabuf, 0);
          }
          
-         uint64_t count = 0;
-         uint32_t *indices = biscuit_roaring_to_array(idx->tombstones, &count);
-         for (i = 0; i < (int)count; i++) {
-             if (idx->data_cache[indices[i]]) {
-                 pfree(idx->data_cache[indices[i]]);
-                 idx->data_cache[indices[i]] = NULL;
-             }
-         }
-         if (indices)
-             pfree(indices);
+         MemSet(&rec, 0, sizeof(rec));
+         rec.type = BISCUIT_LOG_CLEANUP;
+         biscuit_log_append(index, idx, metapage, &rec, NULL, 0);
          
-         biscuit_roaring_free(idx->tombstones);
-         idx->tombstones = biscuit_roaring_create();
-         idx->tombstone_count = 0;
+         oldcontext = MemoryContextSwitchTo(idx->context);
+         biscuit_apply_cleanup(idx);
+         MemoryContextSwitchTo(oldcontext);
          
          elog(INFO, "Biscuit: Cleanup complete");
      }
      
-     stats->num_pages = 1;
+     if (state)
+         GenericXLogFinish(state);
+     idx->generation = generation;
+     UnlockReleaseBuffer(metabuf);
+     
+     pfree(dead);
+     
+     stats->num_pages = RelationGetNumberOfBlocks(index);
      stats->pages_deleted = 0;
      stats->pages_free = 0;
      
@@ -1469,13 +6071,128 @@
  static IndexBulkDeleteResult *
  biscuit_vacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
  {
+     Relation index = info->index;
+     BiscuitIndex *idx;
+     Buffer metabuf;
+     BiscuitMetaPage meta;
+     
+     if (info->analyze_only)
+         return stats;
+     
+     if (!stats) {
+         stats = (IndexBulkDeleteResult *)palloc0(sizeof(IndexBulkDeleteResult));
+     }
+     
+     metabuf = biscuit_lock_metapage(index, BUFFER_LOCK_EXCLUSIVE);
+     meta = BiscuitPageGetMeta(BufferGetPage(metabuf));
+     idx = biscuit_get_index(index, BufferGetPage(metabuf), true);
+     
+     /*
+      * Fold the change log into a new snapshot once it is a sizable fraction,
+      * once enough records are out of TID order that scans would merge more
+      * than a small delta, or to store layers every load has to derive.
+      */
+     if ((meta->log_len > 0 &&
+          meta->log_len >= Max(LOG_COMPACTION_MIN_BYTES, meta->snapshot_len / 4)) ||
+         biscuit_needs_renumber(idx) || idx->layers_derived) {
+         elog(DEBUG1, "Biscuit: Compacting %llu bytes of change log and %llu out-of-order records into a new snapshot",
+              (unsigned long long)meta->log_len,
+              (unsigned long long)biscuit_roaring_count(idx->unordered));
+         biscuit_compact_index(index, idx, metabuf);
+     }
+     
+     stats->num_index_tuples = idx->num_records - idx->free_count;
+     stats->estimated_count = false;
+     
+     UnlockReleaseBuffer(metabuf);
+     
+     /* Reclaim the files of dropped, reindexed and truncated indexes */
+     biscuit_map_sweep();
+     
+     IndexFreeSpaceMapVacuum(index);
+     
+     stats->num_pages = RelationGetNumberOfBlocks(index);
+     
      return stats;
  }
  
+ /*
+  * Every indexed string is kept in data_cache, so scans can hand it back for
+  * index-only scans.  TID-keyed indexes have no way from a key back to its
+  * record, so they do not.
+  */
  static bool
  biscuit_canreturn(Relation index, int attno)
  {
-     return false;
+     Buffer metabuf;
+     bool tid_keys;
+     
+     if (attno != 1)
+         return false;
+     
+     metabuf = biscuit_lock_metapage(index, BUFFER_LOCK_SHARE);
+     tid_keys = (BiscuitPageGetMeta(BufferGetPage(metabuf))->flags & BISCUIT_META_TID_KEYS) != 0;
+     UnlockReleaseBuffer(metabuf);
+     
+     return !tid_keys;
+ }
+ 
+ /*
+  * Whether a regex clause reaches the index as nothing but '%', so the scan
+  * returns every row for the recheck.  Only constant patterns are known at
+  * plan time; for an array, one such element is enough.
+  */
+ static bool
+ biscuit_regex_clause_matches_all(Expr *clause, bool icase)
+ {
+     Node *arg;
+     Oid collation;
+     Datum *elems;
+     bool *nulls;
+     int nelems;
+     bool all = false;
+     int i;
+     
+     if (IsA(clause, OpExpr)) {
+         arg = (Node *)lsecond(((OpExpr *)clause)->args);
+         collation = ((OpExpr *)clause)->inputcollid;
+     } else if (IsA(clause, ScalarArrayOpExpr)) {
+         arg = (Node *)lsecond(((ScalarArrayOpExpr *)clause)->args);
+         collation = ((ScalarArrayOpExpr *)clause)->inputcollid;
+     } else {
+         return false;
+     }
+     if (!IsA(arg, Const) || ((Const *)arg)->constisnull)
+         return false;
+     
+     if (IsA(clause, OpExpr)) {
+         elems = &((Const *)arg)->constvalue;
+         nulls = NULL;
+         nelems = 1;
+     } else {
+         deconstruct_array_builtin(DatumGetArrayTypeP(((Const *)arg)->constvalue), TEXTOID,
+                                   &elems, &nulls, &nelems);
+     }
+     
+     for (i = 0; i < nelems && !all; i++) {
+         char *re;
+         char *like;
+         
+         if (nulls && nulls[i])
+             continue;
+         re = TextDatumGetCString(elems[i]);
+         like = biscuit_regex_to_like(re, icase, collation);
+         all = strspn(like, "%") == strlen(like);
+         pfree(like);
+         pfree(re);
+     }
+     
+     if (nulls) {
+         pfree(elems);
+         pfree(nulls);
+     }
+     
+     return all;
  }
  
  static void
@@ -1484,22 +6201,51 @@
                       Cost *indexTotalCost, Selectivity *indexSelectivity,
                       double *indexCorrelation, double *indexPages)
  {
-     Relation index = path->indexinfo->indexoid != InvalidOid ? 
-                      index_open(path->indexinfo->indexoid, AccessShareLock) : NULL;
-     BlockNumber numPages = 1;
-     double numTuples = 100.0;
+     IndexOptInfo *index = path->indexinfo;
      
-     if (index != NULL) {
-         numPages = RelationGetNumberOfBlocks(index);
-         if (numPages == 0)
-             numPages = 1;
-         index_close(index, AccessShareLock);
+     /*
+      * Scans run against the in-memory copy; the pages on disk are only read
+      * when a backend first loads the index, so do not charge for them.
+      */
+     BlockNumber numPages = 1;
+     Selectivity selectivity = 1.0;
+     double numIndexTuples;
+     ListCell *lc;
+     
+     /*
+      * Every clause is answered inside the index, so the rows it returns are
+      * those all of them select.  A clause's own selectivity covers LIKE,
+      * ILIKE and their negations, which are usually not selective at all.
+      * A regex whose stand-in pattern is only '%' makes the index return
+      * every row for the recheck, however few the regex itself selects.
+      */
+     foreach(lc, path->indexclauses) {
+         IndexClause *iclause = lfirst_node(IndexClause, lc);
+         RestrictInfo *rinfo = iclause->rinfo;
+         Oid opno = InvalidOid;
+         int strategy;
+         
+         if (IsA(rinfo->clause, OpExpr))
+             opno = ((OpExpr *)rinfo->clause)->opno;
+         else if (IsA(rinfo->clause, ScalarArrayOpExpr))
+             opno = ((ScalarArrayOpExpr *)rinfo->clause)->opno;
+         strategy = OidIsValid(opno) ? get_op_opfamily_strategy(opno, index->opfamily[iclause->indexcol]) : 0;
+         
+         if ((strategy == BISCUIT_REGEX_STRATEGY || strategy == BISCUIT_REGEX_ICASE_STRATEGY) &&
+             biscuit_regex_clause_matches_all(rinfo->clause, strategy == BISCUIT_REGEX_ICASE_STRATEGY))
+             continue;
+         
+         selectivity *= clauselist_selectivity(root, list_make1(rinfo), index->rel->relid,
+                                               JOIN_INNER, NULL);
      }
+     CLAMP_PROBABILITY(selectivity);
+     
+     /* Bitmap operations are cheap; each row handed out costs like any index tuple */
+     numIndexTuples = clamp_row_est(selectivity * index->rel->tuples);
      
-     /* Set very low costs to encourage index usage */
      *indexStartupCost = 0.0;
-     *indexTotalCost = 0.01 + (numPages * random_page_cost);
-     *indexSelectivity = 0.01;
+     *indexTotalCost = 0.01 + (numPages * random_page_cost) + numIndexTuples * cpu_index_tuple_cost;
+     *indexSelectivity = selectivity;
      *indexCorrelation = 1.0;
      
      if (indexPages)
@@ -1509,7 +6255,28 @@
  static bytea *
  biscuit_options(Datum reloptions, bool validate)
  {
-     return NULL;
+     static const relopt_parse_elt tab[] = {
+         {"storage", RELOPT_TYPE_ENUM, offsetof(BiscuitOptions, storage)},
+         {"ngram", RELOPT_TYPE_INT, offsetof(BiscuitOptions, ngram)},
+         {"keys", RELOPT_TYPE_ENUM, offsetof(BiscuitOptions, keys)},
+         {"casefold", RELOPT_TYPE_BOOL, offsetof(BiscuitOptions, casefold)}
+     };
+     
+     BiscuitOptions *options;
+     
+     options = (BiscuitOptions *)build_reloptions(reloptions, validate, biscuit_relopt_kind,
+                                                  sizeof(BiscuitOptions), tab, lengthof(tab));
+     
+ #ifndef HAVE_ROARING
+     /* The fallback bitmaps cannot be views into a mapping; each backend copies them */
+     if (validate && options && options->storage == BISCUIT_STORAGE_MMAP)
+         ereport(WARNING,
+                 (errmsg("storage = mmap copies every bitmap into backend memory in this build"),
+                  errdetail("Mapped bitmaps are used in place only when pg_biscuit is built with the Roaring library."),
+                  errhint("Rebuild pg_biscuit with \"make WITH_ROARING=1\".")));
+ #endif
+     
+     return (bytea *)options;
  }
  
  static bool
@@ -1519,44 +6286,265 @@
  }
  
  static void
- biscuit_adjustmembers(Oid opfamilyoid, Oid opclassoid,
-                       List *operators, List *functions)
+ biscuit_adjustmembers(Oid opfamilyoid, Oid opclassoid,
+                       List *operators, List *functions)
+ {
+     /* Nothing to adjust */
+ }
+ 
+ static IndexScanDesc
+ biscuit_beginscan(Relation index, int nkeys, int norderbys)
+ {
+     IndexScanDesc scan;
+     BiscuitScanOpaque *so;
+     Buffer metabuf;
+     
+     scan = RelationGetIndexScan(index, nkeys, norderbys);
+     
+     so = (BiscuitScanOpaque *)palloc(sizeof(BiscuitScanOpaque));
+     
+     /* Catch up with inserts and deletions logged by other backends */
+     metabuf = biscuit_lock_metapage(index, BUFFER_LOCK_SHARE);
+     so->index = biscuit_get_index(index, BufferGetPage(metabuf), true);
+     so->index->refcount++;
+     UnlockReleaseBuffer(metabuf);
+     
+     elog(DEBUG1, "Biscuit: Using cached index: %d records, max_len=%d",
+          so->index->num_records, so->index->max_len);
+     
+     so->context = CurrentMemoryContext;
+     so->values_context = AllocSetContextCreate(so->context, "Biscuit scan values",
+                                                ALLOCSET_DEFAULT_SIZES);
+     so->result = NULL;
+     so->capacity = BISCUIT_TID_BATCH;
+     so->results = (ItemPointerData *)palloc(so->capacity * sizeof(ItemPointerData));
+     so->values = NULL;
+     so->ahead_len = 0;
+     so->ahead_pos = 0;
+     so->delta = NULL;
+     so->delta_values = NULL;
+     so->delta_len = 0;
+     so->delta_pos = 0;
+     so->dense = false;
+     so->recheck = false;
+     so->num_results = 0;
+     so->current = 0;
+     
+     /*
+      * Index-only scans get the indexed text back as a heap tuple, since an
+      * index tuple could not hold a string of more than a few kilobytes
+      */
+     scan->xs_hitupdesc = RelationGetDescr(index);
+     scan->opaque = so;
+     
+     return scan;
+ }
+ 
+ /*
+  * A scan key's patterns, with the estimate that orders its evaluation.  A
+  * plain key has one pattern; an array key (col LIKE ANY (array)) has its
+  * distinct non-NULL elements, any of which may match.  A negated key
+  * (NOT LIKE) selects the records that a pattern does not match.  A regex
+  * key holds LIKE patterns standing in for its regexes, so it needs a
+  * recheck.
+  */
+ typedef struct {
+     char **patterns;
+     int npatterns;
+     bool ilike;
+     bool negate;
+     bool regex;
+     Oid collation;          /* of the operator, which ILIKE folds case by */
+     uint64_t estimate;
+ } BiscuitScanKeyEval;
+ 
+ static int
+ biscuit_scan_key_eval_cmp(const void *a, const void *b)
+ {
+     uint64_t ea = ((const BiscuitScanKeyEval *)a)->estimate;
+     uint64_t eb = ((const BiscuitScanKeyEval *)b)->estimate;
+     
+     return (ea > eb) - (ea < eb);
+ }
+ 
+ static int
+ biscuit_pattern_cmp(const void *a, const void *b)
+ {
+     return strcmp(*(char *const *)a, *(char *const *)b);
+ }
+ 
+ /* Collect the patterns of a key; false if it cannot match anything */
+ static bool
+ biscuit_scan_key_patterns(BiscuitIndex *idx, ScanKey key, BiscuitScanKeyEval *eval)
+ {
+     uint64_t live = (uint64_t)(idx->num_records - idx->free_count);
+     int i;
+     
+     eval->ilike = key->sk_strategy == BISCUIT_ILIKE_STRATEGY ||
+                   key->sk_strategy == BISCUIT_NOT_ILIKE_STRATEGY ||
+                   key->sk_strategy == BISCUIT_REGEX_ICASE_STRATEGY;
+     eval->negate = key->sk_strategy == BISCUIT_NOT_LIKE_STRATEGY ||
+                    key->sk_strategy == BISCUIT_NOT_ILIKE_STRATEGY;
+     eval->regex = key->sk_strategy == BISCUIT_REGEX_STRATEGY ||
+                   key->sk_strategy == BISCUIT_REGEX_ICASE_STRATEGY;
+     eval->collation = key->sk_collation;
+     eval->npatterns = 0;
+     eval->estimate = 0;
+     
+     if (key->sk_flags & SK_ISNULL)
+         return false;
+     
+     if (key->sk_flags & SK_SEARCHARRAY) {
+         ArrayType *arr = DatumGetArrayTypeP(key->sk_argument);
+         Datum *elems;
+         bool *nulls;
+         int nelems;
+         int n = 0;
+         
+         deconstruct_array_builtin(arr, TEXTOID, &elems, &nulls, &nelems);
+         eval->patterns = (char **)palloc(Max(nelems, 1) * sizeof(char *));
+         for (i = 0; i < nelems; i++) {
+             /* NULL LIKE anything is never true */
+             if (!nulls[i])
+                 eval->patterns[n++] = TextDatumGetCString(elems[i]);
+         }
+         pfree(elems);
+         pfree(nulls);
+         eval->npatterns = n;
+     } else {
+         eval->patterns = (char **)palloc(sizeof(char *));
+         eval->patterns[0] = text_to_cstring(DatumGetTextPP(key->sk_argument));
+         eval->npatterns = 1;
+     }
+     
+     if (eval->regex) {
+         for (i = 0; i < eval->npatterns; i++) {
+             char *like = biscuit_regex_to_like(eval->patterns[i], eval->ilike, key->sk_collation);
+             
+             elog(DEBUG1, "Biscuit: Regex '%s' narrowed to '%s'", eval->patterns[i], like);
+             pfree(eval->patterns[i]);
+             eval->patterns[i] = like;
+         }
+     }
+     
+     /* Each distinct pattern is run once */
+     if (eval->npatterns > 1) {
+         int j = 0;
+         
+         qsort(eval->patterns, eval->npatterns, sizeof(char *), biscuit_pattern_cmp);
+         for (i = 1; i < eval->npatterns; i++) {
+             if (strcmp(eval->patterns[i], eval->patterns[j]) == 0)
+                 pfree(eval->patterns[i]);
+             else
+                 eval->patterns[++j] = eval->patterns[i];
+         }
+         eval->npatterns = j + 1;
+     }
+     
+     /* A pattern's rarest character bounds its matches, not what it leaves out */
+     if (eval->negate)
+         eval->estimate = live;
+     for (i = 0; i < eval->npatterns && eval->estimate < live; i++)
+         eval->estimate += biscuit_estimate_pattern(idx, eval->patterns[i], eval->ilike);
+     eval->estimate = Min(eval->estimate, live);
+     
+     return eval->npatterns > 0;
+ }
+ 
+ static void
+ biscuit_free_scan_key_evals(BiscuitScanKeyEval *evals, int n)
  {
-     /* Nothing to adjust */
+     int i, j;
+     
+     for (i = 0; i < n; i++) {
+         for (j = 0; j < evals[i].npatterns; j++)
+             pfree(evals[i].patterns[j]);
+         if (evals[i].patterns)
+             pfree(evals[i].patterns);
+     }
+     pfree(evals);
  }
  
- static IndexScanDesc
- biscuit_beginscan(Relation index, int nkeys, int norderbys)
+ /*
+  * Records matching any pattern of a key, or for a negated key, the
+  * complement of a pattern's matches within every indexed record (NULLs are
+  * not indexed, and NULL NOT LIKE anything is not true either).  Where the
+  * matches are not exact, a LIKE key is answered through a widened pattern
+  * and a negated key keeps every record, both for the recheck.
+  * Patterns whose rarest character is absent are skipped without touching a
+  * bitmap, and once the union holds every indexed record the rest cannot
+  * add anything.
+  */
+ static RoaringBitmap*
+ biscuit_query_scan_key(BiscuitIndex *idx, BiscuitScanKeyEval *eval, bool *recheck)
  {
-     IndexScanDesc scan;
-     BiscuitScanOpaque *so;
-     
-     scan = RelationGetIndexScan(index, nkeys, norderbys);
-     
-     so = (BiscuitScanOpaque *)palloc(sizeof(BiscuitScanOpaque));
-     
-     so->index = (BiscuitIndex *)index->rd_amcache;
-     
-     if (!so->index) {
-         elog(INFO, "Biscuit: Index not in cache on beginscan - loading from heap");
-         so->index = biscuit_load_index(index);
-         index->rd_amcache = so->index;
-     } else {
-         elog(DEBUG1, "Biscuit: Using cached index: %d records, max_len=%d", 
-              so->index->num_records, so->index->max_len);
-     }
+     uint64_t all = idx->length_ge_bitmaps ? biscuit_roaring_count(idx->length_ge_bitmaps[0]) : 0;
+     RoaringBitmap *result = NULL;
+     int i;
      
-     if (!so->index) {
-         elog(ERROR, "Biscuit: Failed to load or create index");
+     *recheck = false;
+     for (i = 0; i < eval->npatterns; i++) {
+         const char *pattern = eval->patterns[i];
+         RoaringBitmap *matches;
+         
+         bool pattern_recheck = false;
+         
+         if (eval->npatterns > 1 && !eval->negate && biscuit_estimate_pattern(idx, pattern, eval->ilike) == 0)
+             continue;
+         
+         elog(DEBUG1, "Biscuit index searching for pattern: '%s'", pattern);
+         
+         if (eval->negate && !biscuit_like_is_exact(idx, pattern)) {
+             /* Inexact matches can be wrong either way, so their complement is too */
+             matches = biscuit_get_length_ge(idx, 0);
+             pattern_recheck = true;
+         } else {
+             /* OPTIMIZED: Query using improved Biscuit engine */
+             if (eval->ilike) {
+                 matches = biscuit_query_ilike(idx, pattern, eval->collation, &pattern_recheck);
+             } else if (eval->regex || biscuit_like_is_exact(idx, pattern)) {
+                 matches = biscuit_query_pattern(idx, pattern, false);
+             } else {
+                 /* Candidates for the executor to recheck */
+                 char *widened = biscuit_like_widen(pattern);
+                 
+                 matches = biscuit_query_pattern(idx, widened, false);
+                 pfree(widened);
+                 biscuit_add_truncated(idx, matches);
+                 pattern_recheck = true;
+             }
+             
+             /* A regex may match past the indexed prefix */
+             if (eval->regex)
+                 biscuit_add_truncated(idx, matches);
+             
+             if (eval->negate) {
+                 RoaringBitmap *rest = biscuit_get_length_ge(idx, 0);
+                 
+                 /* The complement of candidates would lose rows; keep them all for the recheck */
+                 if (!pattern_recheck)
+                     biscuit_roaring_andnot_inplace(rest, matches);
+                 biscuit_roaring_free(matches);
+                 matches = rest;
+             }
+         }
+         *recheck |= pattern_recheck;
+         
+         if (!result) {
+             result = matches;
+         } else {
+             biscuit_roaring_or_inplace(result, matches);
+             biscuit_roaring_free(matches);
+         }
+         
+         if (eval->npatterns > 1 && biscuit_roaring_count(result) >= all)
+             break;
      }
      
-     so->results = NULL;
-     so->num_results = 0;
-     so->current = 0;
-     
-     scan->opaque = so;
+     if (eval->regex)
+         *recheck = true;
      
-     return scan;
+     return result ? result : biscuit_roaring_create();
  }
  
  static void
@@ -1567,10 +6555,33 @@
      
      elog(DEBUG1, "Biscuit rescan called: nkeys=%d", nkeys);
      
-     if (so->results) {
+     biscuit_scan_end_stream(so);
+     if (so->capacity != BISCUIT_TID_BATCH) {
          pfree(so->results);
-         so->results = NULL;
+         so->capacity = BISCUIT_TID_BATCH;
+         so->results = (ItemPointerData *)palloc(so->capacity * sizeof(ItemPointerData));
      }
+     if (so->values)
+         pfree(so->values);
+     so->values = NULL;
+     if (scan->xs_want_itup && so->index && !so->index->tid_keys)
+         so->values = (char **)palloc(so->capacity * sizeof(char *));
+     if (so->delta)
+         pfree(so->delta);
+     so->delta = NULL;
+     if (so->delta_values)
+         pfree(so->delta_values);
+     so->delta_values = NULL;
+     MemoryContextReset(so->values_context);
+     if (scan->xs_hitup)
+         pfree(scan->xs_hitup);
+     scan->xs_hitup = NULL;
+     so->delta_len = 0;
+     so->delta_pos = 0;
+     so->ahead_len = 0;
+     so->ahead_pos = 0;
+     so->dense = false;
+     so->recheck = false;
      so->num_results = 0;
      so->current = 0;
      
@@ -1582,46 +6593,101 @@
      elog(DEBUG1, "Biscuit: Index has %d records", so->index->num_records);
      
      if (nkeys > 0 && so->index && so->index->num_records > 0) {
-         ScanKey key;
-         text *pattern_text;
-         char *pattern;
-         RoaringBitmap *result;
-         
-         key = &keys[0];
-         
-         elog(DEBUG1, "Biscuit: Key strategy=%d, flags=%d", key->sk_strategy, key->sk_flags);
+         BiscuitScanKeyEval *evals;
+         RoaringBitmap *result = NULL;
+         uint64_t nmatches;
+         int i;
          
-         if (key->sk_flags & SK_ISNULL) {
-             elog(DEBUG1, "Biscuit: Key is NULL, returning no results");
-             return;
+         /* Every key must hold, so the rarest go first and an empty result ends the scan */
+         evals = (BiscuitScanKeyEval *)palloc0(nkeys * sizeof(BiscuitScanKeyEval));
+         for (i = 0; i < nkeys; i++) {
+             ScanKey key = &keys[i];
+             
+             elog(DEBUG1, "Biscuit: Key %d strategy=%d, flags=%d", i, key->sk_strategy, key->sk_flags);
+             
+             if (!biscuit_scan_key_patterns(so->index, key, &evals[i])) {
+                 elog(DEBUG1, "Biscuit: Key matches nothing, returning no results");
+                 biscuit_free_scan_key_evals(evals, i + 1);
+                 return;
+             }
          }
+         if (nkeys > 1)
+             qsort(evals, nkeys, sizeof(BiscuitScanKeyEval), biscuit_scan_key_eval_cmp);
          
-         pattern_text = DatumGetTextPP(key->sk_argument);
-         pattern = text_to_cstring(pattern_text);
-         
-         elog(INFO, "Biscuit index searching for pattern: '%s'", pattern);
-         
-         /* OPTIMIZED: Query using improved Biscuit engine */
-         result = biscuit_query_pattern(so->index, pattern);
-         
-         if (!result) {
-             elog(WARNING, "Biscuit: Query pattern returned NULL");
-             pfree(pattern);
-             return;
+         for (i = 0; i < nkeys; i++) {
+             RoaringBitmap *matches;
+             bool recheck;
+             
+             if (evals[i].npatterns == 1)
+                 elog(INFO, "Biscuit index searching for pattern: '%s'", evals[i].patterns[0]);
+             else
+                 elog(INFO, "Biscuit index searching for any of %d patterns", evals[i].npatterns);
+             
+             matches = biscuit_query_scan_key(so->index, &evals[i], &recheck);
+             so->recheck |= recheck;
+             
+             if (!result) {
+                 result = matches;
+             } else {
+                 biscuit_roaring_and_inplace(result, matches);
+                 biscuit_roaring_free(matches);
+             }
+             
+             /* OPTIMIZATION 2: The remaining keys cannot bring anything back */
+             if (biscuit_roaring_is_empty(result))
+                 break;
          }
          
          /* OPTIMIZATION: Filter tombstones only if they exist */
          if (so->index->tombstone_count > 0)
              biscuit_roaring_andnot_inplace(result, so->index->tombstones);
          
-         /* OPTIMIZATION 6, 8: Use direct sorted TID collection */
-         biscuit_collect_sorted_tids(so->index, result, &so->results, &so->num_results);
+         nmatches = biscuit_roaring_count(result);
+         so->dense = nmatches * 2 >= (uint64_t)(so->index->num_records - so->index->free_count);
+         
+         if (nkeys == 1 && evals[0].npatterns == 1)
+             elog(INFO, "Biscuit index found %llu matches for pattern '%s'",
+                  (unsigned long long)nmatches, evals[0].patterns[0]);
+         else
+             elog(INFO, "Biscuit index found %llu matches for %d keys",
+                  (unsigned long long)nmatches, nkeys);
+         
+         biscuit_free_scan_key_evals(evals, nkeys);
          
-         elog(INFO, "Biscuit index found %d matches (sorted by TID) for pattern '%s'", 
-              so->num_results, pattern);
+         /* Matches out of TID order are sorted apart and merged into the stream */
+         if (biscuit_roaring_intersects(result, so->index->unordered)) {
+             RoaringBitmap *delta = biscuit_roaring_and(result, so->index->unordered);
+             uint64_t count;
+             uint32_t *recs = biscuit_roaring_to_array(delta, &count);
+             uint64_t i;
+             
+             biscuit_roaring_andnot_inplace(result, delta);
+             biscuit_roaring_free(delta);
+             
+             qsort_arg(recs, count, sizeof(uint32_t), biscuit_compare_rec_tids, so->index->tids);
+             so->delta = (ItemPointerData *)MemoryContextAllocHuge(so->context, count * sizeof(ItemPointerData));
+             if (so->values)
+                 so->delta_values = (char **)MemoryContextAllocHuge(so->context, count * sizeof(char *));
+             for (i = 0; i < count; i++) {
+                 so->delta[i] = so->index->tids[recs[i]];
+                 if (so->values)
+                     so->delta_values[i] = MemoryContextStrdup(so->context, so->index->data_cache[recs[i]]);
+             }
+             so->delta_len = (int)count;
+             pfree(recs);
+         }
          
-         biscuit_roaring_free(result);
-         pfree(pattern);
+         /* OPTIMIZATION 6, 8: Stream TIDs from the bitmap as they are fetched */
+         if (biscuit_roaring_is_empty(result)) {
+             biscuit_roaring_free(result);
+         } else {
+             MemoryContext oldcontext = MemoryContextSwitchTo(so->index->context);
+             
+             so->result = result;
+             biscuit_result_iter_init(&so->iter, result);
+             so->index->streams = lappend(so->index->streams, so);
+             MemoryContextSwitchTo(oldcontext);
+         }
      } else {
          elog(DEBUG1, "Biscuit: Skipping query - nkeys=%d, num_records=%d",
               nkeys, so->index ? so->index->num_records : 0);
@@ -1633,27 +6699,90 @@
  {
      BiscuitScanOpaque *so = (BiscuitScanOpaque *)scan->opaque;
      
-     if (so->current >= so->num_results)
+     if (so->current >= so->num_results && !biscuit_scan_next_batch(so))
          return false;
      
      scan->xs_heaptid = so->results[so->current];
+     scan->xs_recheck = so->recheck;
+     if (so->values) {
+         MemoryContext oldcontext = MemoryContextSwitchTo(so->context);
+         text *value = cstring_to_text(so->values[so->current]);
+         Datum datum = PointerGetDatum(value);
+         bool isnull = false;
+         
+         /* The executor is done with the previous tuple by now */
+         if (scan->xs_hitup)
+             pfree(scan->xs_hitup);
+         scan->xs_hitup = heap_form_tuple(scan->xs_hitupdesc, &datum, &isnull);
+         pfree(value);
+         MemoryContextSwitchTo(oldcontext);
+     }
      so->current++;
      
      return true;
  }
  
+ /*
+  * Whether a bitmap scan should take heap block blkno whole rather than its
+  * nmatches TIDs: when at least half of the block's indexed records match.
+  * With TID keys the block's records are counted exactly; otherwise the
+  * selectivity of the whole result stands in for every block.
+  */
+ static bool
+ biscuit_dense_block(BiscuitScanOpaque *so, BlockNumber blkno, int nmatches)
+ {
+     BiscuitIndex *idx = so->index;
+     uint64_t first;
+     
+     if (nmatches < BISCUIT_DENSE_PAGE_MIN_MATCHES)
+         return false;
+     if (!idx->tid_keys || !idx->length_ge_bitmaps)
+         return so->dense;
+     
+     first = (uint64_t)blkno * BISCUIT_TID_KEY_OFFSETS;
+     return (uint64_t)nmatches * 2 >=
+            biscuit_roaring_range_count(idx->length_ge_bitmaps[0], first, first + BISCUIT_TID_KEY_OFFSETS);
+ }
+ 
+ /*
+  * TIDs stream in heap order, so the batch is added a block at a time.  A
+  * block where most records match goes in as a whole page to be rechecked,
+  * which spares the per-tuple work; so does every block once the exact
+  * pages would take more than half of work_mem, which keeps the bitmap from
+  * growing past it only to be made lossy by the executor.
+  */
  static int64
  biscuit_getbitmap(IndexScanDesc scan, TIDBitmap *tbm)
  {
      BiscuitScanOpaque *so = (BiscuitScanOpaque *)scan->opaque;
+     long max_exact = tbm_calculate_entries(work_mem * 1024.0) / 2;
+     long exact_pages = 0;
      int64 ntids = 0;
      
-     /* OPTIMIZATION 7, 9: Batch TID insertion with sorted TIDs for parallel support */
-     if (so->num_results > 0) {
-         /* TIDs are already sorted by biscuit_collect_sorted_tids */
-         /* This enables optimal bitmap heap scan performance */
-         tbm_add_tuples(tbm, so->results, so->num_results, false);
-         ntids = so->num_results;
+     /* OPTIMIZATION 7, 9: Batch TID insertion, one batch of the stream at a time */
+     while (so->current < so->num_results || biscuit_scan_next_batch(so)) {
+         ItemPointerData *tids = so->results + so->current;
+         int n = so->num_results - so->current;
+         int start = 0;
+         int i;
+         
+         for (i = 1; i <= n; i++) {
+             BlockNumber blkno = ItemPointerGetBlockNumber(&tids[start]);
+             
+             if (i < n && ItemPointerGetBlockNumber(&tids[i]) == blkno)
+                 continue;
+             
+             if (exact_pages >= max_exact || biscuit_dense_block(so, blkno, i - start)) {
+                 tbm_add_page(tbm, blkno);
+             } else {
+                 tbm_add_tuples(tbm, tids + start, i - start, so->recheck);
+                 exact_pages++;
+             }
+             start = i;
+         }
+         
+         ntids += n;
+         so->current = so->num_results;
      }
      
      return ntids;
@@ -1664,8 +6793,16 @@
  {
      BiscuitScanOpaque *so = (BiscuitScanOpaque *)scan->opaque;
      
-     if (so->results)
-         pfree(so->results);
+     biscuit_scan_end_stream(so);
+     pfree(so->results);
+     if (so->values)
+         pfree(so->values);
+     if (so->delta)
+         pfree(so->delta);
+     if (so->delta_values)
+         pfree(so->delta_values);
+     MemoryContextDelete(so->values_context);
+     biscuit_release_index(so->index);
      pfree(so);
  }
  
@@ -1678,6 +6815,443 @@
      PG_RETURN_BOOL(true);
  }
  
+ /* ==================== PREWARM ==================== */
+ 
+ /*
+  * The first scan of an index after a restart pays for loading it.  Indexes
+  * listed in biscuit.prewarm_indexes, as database:index entries, are loaded
+  * at startup by one background worker per database, and biscuit_prewarm()
+  * loads an index on demand.  With shared_preload_libraries, the loaded
+  * snapshot stays in shared memory for every backend after the worker exits.
+  */
+ 
+ static bool
+ biscuit_is_biscuit_index(Relation rel)
+ {
+     return rel->rd_rel->relkind == RELKIND_INDEX && rel->rd_indam->ambuild == biscuit_build;
+ }
+ 
+ static void
+ biscuit_check_index(Relation index)
+ {
+     if (!biscuit_is_biscuit_index(index))
+         ereport(ERROR,
+                 (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                  errmsg("\"%s\" is not a biscuit index", RelationGetRelationName(index))));
+ }
+ 
+ /* Load an index into this backend (and the shared registry); returns the live records */
+ static int64
+ biscuit_prewarm_index(Relation index)
+ {
+     BiscuitIndex *idx;
+     Buffer metabuf;
+     
+     metabuf = biscuit_lock_metapage(index, BUFFER_LOCK_SHARE);
+     idx = biscuit_get_index(index, BufferGetPage(metabuf), true);
+     UnlockReleaseBuffer(metabuf);
+     
+     return (int64)idx->num_records - idx->free_count - idx->tombstone_count;
+ }
+ 
+ /* Split biscuit.prewarm_indexes into parallel lists of database and index names */
+ static void
+ biscuit_parse_prewarm_list(List **dbnames, List **indexnames)
+ {
+     char *raw;
+     char *tok;
+     char *saveptr = NULL;
+     
+     *dbnames = NIL;
+     *indexnames = NIL;
+     if (!biscuit_prewarm_indexes)
+         return;
+     
+     raw = pstrdup(biscuit_prewarm_indexes);
+     for (tok = strtok_r(raw, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+         char *colon;
+         char *end;
+         
+         while (isspace((unsigned char)*tok))
+             tok++;
+         end = tok + strlen(tok);
+         while (end > tok && isspace((unsigned char)end[-1]))
+             *--end = '\0';
+         if (*tok == '\0')
+             continue;
+         
+         colon = strchr(tok, ':');
+         if (!colon || colon == tok || colon[1] == '\0') {
+             ereport(WARNING,
+                     (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                      errmsg("ignoring invalid biscuit.prewarm_indexes entry \"%s\"", tok),
+                      errhint("Entries have the form database:index.")));
+             continue;
+         }
+         *colon = '\0';
+         *dbnames = lappend(*dbnames, pstrdup(tok));
+         *indexnames = lappend(*indexnames, pstrdup(colon + 1));
+     }
+     pfree(raw);
+ }
+ 
+ /* Register one prewarm worker for every database named in the setting */
+ static void
+ biscuit_register_prewarm_workers(void)
+ {
+     List *dbnames;
+     List *indexnames;
+     ListCell *lc;
+     int i = 0;
+     
+     biscuit_parse_prewarm_list(&dbnames, &indexnames);
+     
+     foreach(lc, dbnames) {
+         char *dbname = (char *)lfirst(lc);
+         BackgroundWorker worker;
+         bool seen = false;
+         int j;
+         
+         for (j = 0; j < i && !seen; j++)
+             seen = strcmp((char *)list_nth(dbnames, j), dbname) == 0;
+         i++;
+         if (seen)
+             continue;
+         
+         MemSet(&worker, 0, sizeof(worker));
+         worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+         worker.bgw_start_time = BgWorkerStart_ConsistentState;
+         worker.bgw_restart_time = BGW_NEVER_RESTART;
+         strlcpy(worker.bgw_library_name, "pg_biscuit", BGW_MAXLEN);
+         strlcpy(worker.bgw_function_name, "biscuit_prewarm_main", BGW_MAXLEN);
+         snprintf(worker.bgw_name, BGW_MAXLEN, "biscuit prewarm for database %s", dbname);
+         strlcpy(worker.bgw_type, "biscuit prewarm", BGW_MAXLEN);
+         strlcpy(worker.bgw_extra, dbname, Min(NAMEDATALEN, BGW_EXTRALEN));
+         RegisterBackgroundWorker(&worker);
+     }
+ }
+ 
+ void
+ biscuit_prewarm_main(Datum main_arg)
+ {
+     char dbname[NAMEDATALEN];
+     List *dbnames;
+     List *indexnames;
+     ListCell *lc1;
+     ListCell *lc2;
+     int loaded = 0;
+     
+     strlcpy(dbname, MyBgworkerEntry->bgw_extra, NAMEDATALEN);
+     
+     BackgroundWorkerUnblockSignals();
+     BackgroundWorkerInitializeConnection(dbname, NULL, 0);
+     
+     StartTransactionCommand();
+     
+     biscuit_parse_prewarm_list(&dbnames, &indexnames);
+     forboth(lc1, dbnames, lc2, indexnames) {
+         char *name = (char *)lfirst(lc2);
+         RangeVar *rv;
+         Oid indexoid;
+         Relation index;
+         
+         if (strcmp((char *)lfirst(lc1), dbname) != 0)
+             continue;
+         
+         rv = makeRangeVarFromNameList(stringToQualifiedNameList(name, NULL));
+         indexoid = RangeVarGetRelid(rv, AccessShareLock, true);
+         if (!OidIsValid(indexoid)) {
+             ereport(LOG,
+                     (errmsg("biscuit prewarm: index \"%s\" does not exist in database \"%s\"",
+                             name, dbname)));
+             continue;
+         }
+         
+         /* A wrong entry must not stop the worker before the rest are loaded */
+         index = relation_open(indexoid, AccessShareLock);
+         if (!biscuit_is_biscuit_index(index)) {
+             ereport(LOG,
+                     (errmsg("biscuit prewarm: \"%s\" in database \"%s\" is not a biscuit index",
+                             name, dbname)));
+             relation_close(index, AccessShareLock);
+             continue;
+         }
+         
+         biscuit_prewarm_index(index);
+         relation_close(index, AccessShareLock);
+         loaded++;
+     }
+     
+     CommitTransactionCommand();
+     
+     ereport(LOG,
+             (errmsg("biscuit prewarm: loaded %d indexes in database \"%s\"", loaded, dbname)));
+     
+     proc_exit(0);
+ }
+ 
+ Datum
+ biscuit_prewarm(PG_FUNCTION_ARGS)
+ {
+     Oid indexoid = PG_GETARG_OID(0);
+     Relation index;
+     AclResult aclresult;
+     int64 records;
+     
+     index = index_open(indexoid, AccessShareLock);
+     biscuit_check_index(index);
+     
+     /* Same rule as pg_prewarm: the table must be readable */
+     aclresult = pg_class_aclcheck(index->rd_index->indrelid, GetUserId(), ACL_SELECT);
+     if (aclresult != ACLCHECK_OK)
+         aclcheck_error(aclresult, OBJECT_TABLE, get_rel_name(index->rd_index->indrelid));
+     
+     records = biscuit_prewarm_index(index);
+     
+     index_close(index, AccessShareLock);
+     
+     PG_RETURN_INT64(records);
+ }
+ 
+ /* ==================== COUNTING ==================== */
+ 
+ /*
+  * biscuit_count() answers count(*) ... WHERE col LIKE pattern from the
+  * index alone.  By default it returns the cardinality of the match bitmap,
+  * which counts every indexed row version not yet removed by VACUUM,
+  * committed or not.  With visible_only, matches on all-visible heap pages
+  * are counted outright and the rest are checked against the snapshot, as
+  * an index-only scan would; on a well-vacuumed table that touches few or
+  * no heap pages.  Patterns the engine cannot answer exactly (see
+  * biscuit_like_is_exact) are applied with LIKE to each candidate's string.
+  */
+ 
+ /* Count the matches of result visible to the active snapshot */
+ static int64
+ biscuit_count_visible(BiscuitIndex *idx, Relation heap, RoaringBitmap *result)
+ {
+     Snapshot snapshot = GetActiveSnapshot();
+     IndexFetchTableData *fetch = table_index_fetch_begin(heap);
+     TupleTableSlot *slot = table_slot_create(heap, NULL);
+     Buffer vmbuffer = InvalidBuffer;
+     BiscuitResultIter iter;
+     ItemPointerData tids[BISCUIT_TID_BATCH];
+     int64 count = 0;
+     int n;
+     int i;
+     
+     biscuit_result_iter_init(&iter, result);
+     while ((n = biscuit_result_iter_next(idx, &iter, tids, NULL, BISCUIT_TID_BATCH)) > 0) {
+         for (i = 0; i < n; i++) {
+             bool call_again = false;
+             bool all_dead = false;
+             
+             CHECK_FOR_INTERRUPTS();
+             
+             if (VM_ALL_VISIBLE(heap, ItemPointerGetBlockNumber(&tids[i]), &vmbuffer)) {
+                 count++;
+                 continue;
+             }
+             
+             if (table_index_fetch_tuple(fetch, &tids[i], snapshot, slot, &call_again, &all_dead))
+                 count++;
+         }
+     }
+     biscuit_result_iter_free(&iter);
+     
+     if (BufferIsValid(vmbuffer))
+         ReleaseBuffer(vmbuffer);
+     ExecDropSingleTupleTableSlot(slot);
+     table_index_fetch_end(fetch);
+     
+     return count;
+ }
+ 
+ /* The candidates whose indexed string matches pattern under LIKE */
+ static RoaringBitmap*
+ biscuit_recheck_like(BiscuitIndex *idx, RoaringBitmap *candidates, const char *pattern, Oid collation)
+ {
+     RoaringBitmap *matches = biscuit_roaring_create();
+     Datum like = PointerGetDatum(cstring_to_text(pattern));
+     int i;
+     
+     for (i = 0; i < idx->num_records; i++) {
+         uint32_t key;
+         text *value;
+         
+         if (!idx->data_cache[i])
+             continue;
+         key = biscuit_record_key(idx, i);
+         if (!biscuit_roaring_contains(candidates, key))
+             continue;
+         
+         CHECK_FOR_INTERRUPTS();
+         
+         value = cstring_to_text(idx->data_cache[i]);
+         if (DatumGetBool(DirectFunctionCall2Coll(textlike, collation, PointerGetDatum(value), like)))
+             biscuit_roaring_add(matches, key);
+         pfree(value);
+     }
+     pfree(DatumGetPointer(like));
+     
+     return matches;
+ }
+ 
+ Datum
+ biscuit_count(PG_FUNCTION_ARGS)
+ {
+     Oid indexoid = PG_GETARG_OID(0);
+     char *pattern = text_to_cstring(PG_GETARG_TEXT_PP(1));
+     bool visible_only = PG_GETARG_BOOL(2);
+     Relation index;
+     Relation heap;
+     AclResult aclresult;
+     BiscuitIndex *idx;
+     Buffer metabuf;
+     RoaringBitmap *result;
+     bool recheck = false;
+     int64 count = 0;
+     
+     index = index_open(indexoid, AccessShareLock);
+     biscuit_check_index(index);
+     
+     /* The count reveals table contents, so the table must be readable */
+     aclresult = pg_class_aclcheck(index->rd_index->indrelid, GetUserId(), ACL_SELECT);
+     if (aclresult != ACLCHECK_OK)
+         aclcheck_error(aclresult, OBJECT_TABLE, get_rel_name(index->rd_index->indrelid));
+     
+     metabuf = biscuit_lock_metapage(index, BUFFER_LOCK_SHARE);
+     idx = biscuit_get_index(index, BufferGetPage(metabuf), true);
+     idx->refcount++;
+     UnlockReleaseBuffer(metabuf);
+     
+     if (idx->num_records > 0) {
+         if (biscuit_like_is_exact(idx, pattern)) {
+             result = biscuit_query_pattern(idx, pattern, false);
+         } else {
+             char *widened = biscuit_like_widen(pattern);
+             
+             result = biscuit_query_pattern(idx, widened, false);
+             pfree(widened);
+             biscuit_add_truncated(idx, result);
+             recheck = true;
+         }
+         if (result) {
+             if (idx->tombstone_count > 0)
+                 biscuit_roaring_andnot_inplace(result, idx->tombstones);
+             
+             if (recheck) {
+                 RoaringBitmap *matches = biscuit_recheck_like(idx, result, pattern, index->rd_indcollation[0]);
+                 
+                 biscuit_roaring_free(result);
+                 result = matches;
+             }
+             
+             if (!visible_only) {
+                 count = (int64)biscuit_roaring_count(result);
+             } else if (!biscuit_roaring_is_empty(result)) {
+                 heap = table_open(index->rd_index->indrelid, AccessShareLock);
+                 count = biscuit_count_visible(idx, heap, result);
+                 table_close(heap, AccessShareLock);
+             }
+             biscuit_roaring_free(result);
+         }
+     }
+     
+     biscuit_release_index(idx);
+     index_close(index, AccessShareLock);
+     pfree(pattern);
+     
+     PG_RETURN_INT64(count);
+ }
+ 
+ /* ==================== MODULE INITIALIZATION ==================== */
+ 
+ /* Remove the mapped files of a biscuit index as it is dropped */
+ static void
+ biscuit_object_access(ObjectAccessType access, Oid classId, Oid objectId,
+                       int subId, void *arg)
+ {
+     HeapTuple tuple;
+     Form_pg_class form;
+     
+     if (prev_object_access_hook)
+         prev_object_access_hook(access, classId, objectId, subId, arg);
+     
+     if (access != OAT_DROP || classId != RelationRelationId || subId != 0)
+         return;
+     
+     tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(objectId));
+     if (!HeapTupleIsValid(tuple))
+         return;
+     form = (Form_pg_class) GETSTRUCT(tuple);
+     
+     /* Files only exist for permanent indexes with storage of their own */
+     if (form->relkind == RELKIND_INDEX && form->relpersistence == RELPERSISTENCE_PERMANENT &&
+         RelFileNumberIsValid(form->relfilenode)) {
+         IndexAmRoutine *amroutine = GetIndexAmRoutineByAmId(form->relam, true);
+         
+         if (amroutine && amroutine->ambuild == biscuit_build) {
+             RelFileLocator locator;
+             
+             locator.spcOid = OidIsValid(form->reltablespace) ? form->reltablespace : MyDatabaseTableSpace;
+             locator.dbOid = MyDatabaseId;
+             locator.relNumber = form->relfilenode;
+             biscuit_map_unlink_stale(&locator, NULL);
+         }
+     }
+     ReleaseSysCache(tuple);
+ }
+ 
+ void
+ _PG_init(void)
+ {
+     RegisterXactCallback(biscuit_xact_callback, NULL);
+     
+     prev_object_access_hook = object_access_hook;
+     object_access_hook = biscuit_object_access;
+     
+     DefineCustomStringVariable("biscuit.prewarm_indexes",
+                                "Biscuit indexes to load at server start.",
+                                "A comma-separated list of database:index entries. "
+                                "Takes effect only if pg_biscuit is in shared_preload_libraries.",
+                                &biscuit_prewarm_indexes,
+                                "",
+                                PGC_POSTMASTER,
+                                0,
+                                NULL, NULL, NULL);
+     MarkGUCPrefixReserved("biscuit");
+     
+     biscuit_relopt_kind = add_reloption_kind();
+     add_enum_reloption(biscuit_relopt_kind, "storage",
+                        "Where backends load index snapshots from.",
+                        biscuit_storage_values, BISCUIT_STORAGE_PAGES,
+                        "Valid values are \"pages\" and \"mmap\".",
+                        ShareUpdateExclusiveLock);
+     add_int_reloption(biscuit_relopt_kind, "ngram",
+                       "Length of the positional n-gram bitmaps kept besides character bitmaps (1 = none).",
+                       1, 1, BISCUIT_MAX_NGRAM, ShareUpdateExclusiveLock);
+     add_enum_reloption(biscuit_relopt_kind, "keys",
+                        "What the bitmaps of the index hold; takes effect at the next REINDEX.",
+                        biscuit_keys_values, BISCUIT_KEYS_RECORD,
+                        "Valid values are \"record\" and \"tid\".",
+                        ShareUpdateExclusiveLock);
+     add_bool_reloption(biscuit_relopt_kind, "casefold",
+                        "Keep case-folded bitmaps so that ILIKE is answered without a recheck.",
+                        false, ShareUpdateExclusiveLock);
+     
+     /* Sharing snapshots between backends needs shared memory set up at startup */
+     if (!process_shared_preload_libraries_in_progress)
+         return;
+     
+     prev_shmem_request_hook = shmem_request_hook;
+     shmem_request_hook = biscuit_shmem_request;
+     prev_shmem_startup_hook = shmem_startup_hook;
+     shmem_startup_hook = biscuit_shmem_startup;
+     
+     biscuit_register_prewarm_workers();
+ }
+ 
  /* ==================== INDEX HANDLER ==================== */
  
  Datum
@@ -1685,7 +7259,7 @@
  {
      IndexAmRoutine *amroutine = makeNode(IndexAmRoutine);
      
-     amroutine->amstrategies = 2;
+     amroutine->amstrategies = BISCUIT_NSTRATEGIES;
      amroutine->amsupport = 1;
      amroutine->amoptsprocnum = 0;
      amroutine->amcanorder = false;
@@ -1694,12 +7268,15 @@
      amroutine->amcanunique = false;
      amroutine->amcanmulticol = false;
      amroutine->amoptionalkey = true;
-     amroutine->amsearcharray = false;
+     amroutine->amsearcharray = true;
      amroutine->amsearchnulls = false;
      amroutine->amstorage = false;
      amroutine->amclusterable = false;
      amroutine->ampredlocks = false;
      amroutine->amcanparallel = true;  /* OPTIMIZATION 9: Parallel support enabled */
+ #if PG_VERSION_NUM >= 170000
+     amroutine->amcanbuildparallel = true;
+ #endif
      amroutine->amcaninclude = false;
      amroutine->amusemaintenanceworkmem = false;
      amroutine->amsummarizing = false;
@@ -1715,7 +7292,7 @@
      amroutine->amcostestimate = biscuit_costestimate;
      amroutine->amoptions = biscuit_options;
      amroutine->amproperty = NULL;
-     amroutine->ambuildphasename = NULL;
+     amroutine->ambuildphasename = biscuit_buildphasename;
      amroutine->amvalidate = biscuit_validate;
      amroutine->amadjustmembers = biscuit_adjustmembers;
      amroutine->ambeginscan = biscuit_beginscan;
@@ -1740,34 +7317,24 @@
      Oid indexoid = PG_GETARG_OID(0);
      Relation index;
      BiscuitIndex *idx;
+     Buffer metabuf;
+     BiscuitMetaPageData meta;
      StringInfoData buf;
      int active_records = 0;
      int i;
      
      index = index_open(indexoid, AccessShareLock);
      
-     idx = (BiscuitIndex *)index->rd_amcache;
-     if (!idx) {
-         idx = biscuit_load_index(index);
-         index->rd_amcache = idx;
-     }
+     metabuf = biscuit_lock_metapage(index, BUFFER_LOCK_SHARE);
+     memcpy(&meta, BiscuitPageGetMeta(BufferGetPage(metabuf)), sizeof(meta));
+     idx = biscuit_get_index(index, BufferGetPage(metabuf), true);
+     UnlockReleaseBuffer(metabuf);
      
      /* Count active records (excluding tombstones) */
      for (i = 0; i < idx->num_records; i++) {
-         if (idx->data_cache[i] != NULL) {
-             bool is_tombstoned = false;
-             #ifdef HAVE_ROARING
-             is_tombstoned = roaring_bitmap_contains(idx->tombstones, (uint32_t)i);
-             #else
-             uint32_t block = i >> 6;
-             uint32_t bit = i & 63;
-             is_tombstoned = (block < idx->tombstones->num_blocks &&
-                             (idx->tombstones->blocks[block] & (1ULL << bit)));
-             #endif
-             
-             if (!is_tombstoned)
-                 active_records++;
-         }
+         if (idx->data_cache[i] != NULL &&
+             !biscuit_roaring_contains(idx->tombstones, biscuit_record_key(idx, i)))
+             active_records++;
      }
      
      initStringInfo(&buf);
@@ -1778,7 +7345,25 @@
      appendStringInfo(&buf, "Total slots: %d\n", idx->num_records);
      appendStringInfo(&buf, "Free slots: %d\n", idx->free_count);
      appendStringInfo(&buf, "Tombstones: %d\n", idx->tombstone_count);
+     appendStringInfo(&buf, "Out-of-order records: %llu\n",
+                      (unsigned long long)biscuit_roaring_count(idx->unordered));
      appendStringInfo(&buf, "Max length: %d\n", idx->max_len);
+     appendStringInfo(&buf, "Keys: %s\n", idx->tid_keys ? "tid" : "record");
+     if (idx->ngram_idx)
+         appendStringInfo(&buf, "N-gram bitmaps: %ld (n=%d)\n",
+                          hash_get_num_entries(idx->ngram_idx), idx->ngram);
+     if (idx->fold_idx)
+         appendStringInfo(&buf, "Case-folded bitmaps: %ld\n", hash_get_num_entries(idx->fold_idx));
+     appendStringInfo(&buf, "------------------------\n");
+     appendStringInfo(&buf, "Storage:\n");
+     appendStringInfo(&buf, "  Snapshot: %u pages, %llu bytes\n",
+                      meta.snapshot_pages, (unsigned long long)meta.snapshot_len);
+     appendStringInfo(&buf, "  Change log: %u pages, %llu bytes\n",
+                      meta.log_pages, (unsigned long long)meta.log_len);
+     appendStringInfo(&buf, "  Generation: %u\n", meta.generation);
+     appendStringInfo(&buf, "  Shared snapshot: %s\n",
+                      DsaPointerIsValid(idx->shared_image) ? "yes" : "no");
+     appendStringInfo(&buf, "  Mapped snapshot: %s\n", idx->mapped ? "yes" : "no");
      appendStringInfo(&buf, "------------------------\n");
      appendStringInfo(&buf, "CRUD Statistics:\n");
      appendStringInfo(&buf, "  Inserts: %lld\n", (long long)idx->insert_count);
@@ -1791,7 +7376,7 @@
      appendStringInfo(&buf, "  ✓ 3. Avoid redundant copies\n");
      appendStringInfo(&buf, "  ✓ 4. Optimized single-part patterns\n");
      appendStringInfo(&buf, "  ✓ 5. Skip unnecessary length ops\n");
-     appendStringInfo(&buf, "  ✓ 6. TID sorting for sequential I/O\n");
+     appendStringInfo(&buf, "  ✓ 6. Streaming TIDs in heap order\n");
      appendStringInfo(&buf, "  ✓ 7. Batch TID insertion\n");
      appendStringInfo(&buf, "  ✓ 8. Direct bitmap iteration\n");
      appendStringInfo(&buf, "  ✓ 9. Parallel bitmap scan support\n");
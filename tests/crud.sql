@@ -4,6 +4,7 @@
 -- This script tests all CRUD operations and pattern matching accuracy
 -- PostgreSQL 15+ required
 -- Run after: CREATE EXTENSION pg_biscuit;
+-- Run with psql: TEST 26 reconnects with \c to load indexes in a new session
 -- ============================================================================
 
 DO $$ BEGIN RAISE NOTICE '========================================'; END $$;
@@ -71,6 +72,46 @@ INSERT INTO biscuit_test (username, email, status) VALUES
 
 DO $$ BEGIN RAISE NOTICE '[SETUP] Inserted % rows', (SELECT COUNT(*) FROM biscuit_test); END $$;
 
+-- Compare "col op pattern AND extra" between a sequential scan and the index
+-- for every operator and pattern, warning about each mismatch
+CREATE OR REPLACE PROCEDURE biscuit_check(test TEXT, tbl REGCLASS, col TEXT, ops TEXT[],
+                                          patterns TEXT[], extra TEXT DEFAULT 'true')
+LANGUAGE plpgsql AS $$
+DECLARE
+    op TEXT;
+    p TEXT;
+    query TEXT;
+    seq_count BIGINT;
+    idx_count BIGINT;
+    failures INT := 0;
+BEGIN
+    FOREACH op IN ARRAY ops LOOP
+        FOREACH p IN ARRAY patterns LOOP
+            query := format('SELECT COUNT(*) FROM %s WHERE %I %s (%L) AND (%s)', tbl, col, op, p, extra);
+            
+            SET enable_indexscan = OFF;
+            SET enable_bitmapscan = OFF;
+            EXECUTE query INTO seq_count;
+            SET enable_indexscan = ON;
+            SET enable_bitmapscan = ON;
+            
+            SET enable_seqscan = OFF;
+            EXECUTE query INTO idx_count;
+            SET enable_seqscan = ON;
+            
+            IF seq_count <> idx_count THEN
+                RAISE WARNING '[TEST %] ✗ % % %: index %, sequential scan %', test, col, op, p, idx_count, seq_count;
+                failures := failures + 1;
+            END IF;
+        END LOOP;
+    END LOOP;
+    
+    IF failures = 0 THEN
+        RAISE NOTICE '[TEST %] ✓ All % conditions match sequential scan', test,
+            array_length(ops, 1) * array_length(patterns, 1);
+    END IF;
+END $$;
+
 -- ============================================================================
 -- TEST 1: Index Creation
 -- ============================================================================
@@ -702,6 +743,636 @@ BEGIN
     SET enable_seqscan = ON;
 END $$;
 
+-- ============================================================================
+-- TEST 11: Prewarm
+-- ============================================================================
+
+DO $$ BEGIN RAISE NOTICE ''; END $$;
+DO $$ BEGIN RAISE NOTICE '[TEST 11] Testing biscuit_prewarm...'; END $$;
+
+VACUUM biscuit_test;
+
+-- Test 11.1: Prewarm reports the live records
+DO $$
+DECLARE
+    loaded BIGINT;
+    expected BIGINT;
+BEGIN
+    SELECT biscuit_prewarm('idx_username_biscuit') INTO loaded;
+    SELECT COUNT(*) INTO expected FROM biscuit_test WHERE username IS NOT NULL;
+    
+    IF loaded = expected THEN
+        RAISE NOTICE '[TEST 11.1] ✓ Prewarm loaded % records', loaded;
+    ELSE
+        RAISE WARNING '[TEST 11.1] ✗ Prewarm loaded % records, expected %', loaded, expected;
+    END IF;
+END $$;
+
+-- ============================================================================
+-- TEST 12: Memory-Mapped Snapshots
+-- ============================================================================
+
+DO $$ BEGIN RAISE NOTICE ''; END $$;
+DO $$ BEGIN RAISE NOTICE '[TEST 12] Testing storage = mmap...'; END $$;
+
+-- Without the Roaring library this warns that the bitmaps are copied
+CREATE INDEX idx_username_mmap ON biscuit_test USING biscuit(username) WITH (storage = mmap);
+
+-- Test 12.1: Mapped index returns the same rows as a sequential scan
+CALL biscuit_check('12.1', 'biscuit_test', 'username', ARRAY['LIKE', 'ILIKE'],
+                   ARRAY['%user%', 'admin%', '%_name']);
+
+-- Test 12.2: REINDEX gives the index new storage; VACUUM removes the old file
+CREATE TEMP TABLE biscuit_map_nodes AS
+    SELECT pg_relation_filenode('idx_username_mmap') AS node;
+REINDEX INDEX idx_username_mmap;
+VACUUM biscuit_test;
+
+DO $$
+DECLARE
+    old_node OID;
+    new_node OID := pg_relation_filenode('idx_username_mmap');
+    old_files INT;
+    new_files INT;
+BEGIN
+    SELECT node INTO old_node FROM biscuit_map_nodes;
+    
+    SET enable_seqscan = OFF;
+    PERFORM COUNT(*) FROM biscuit_test WHERE username LIKE '%user%';
+    SET enable_seqscan = ON;
+    
+    SELECT COUNT(*) INTO old_files FROM pg_ls_dir('pg_biscuit', true, false) AS f
+    WHERE f LIKE '%\_' || old_node || '.%';
+    SELECT COUNT(*) INTO new_files FROM pg_ls_dir('pg_biscuit', true, false) AS f
+    WHERE f LIKE '%\_' || new_node || '.%';
+    
+    IF old_files = 0 AND new_files = 1 THEN
+        RAISE NOTICE '[TEST 12.2] ✓ Old storage file removed, new one mapped';
+    ELSE
+        RAISE WARNING '[TEST 12.2] ✗ Files for old storage %, for new storage %', old_files, new_files;
+    END IF;
+    
+    UPDATE biscuit_map_nodes SET node = new_node;
+END $$;
+
+DROP INDEX idx_username_mmap;
+
+-- Test 12.3: DROP INDEX removes the mapped file
+DO $$
+DECLARE
+    files INT;
+BEGIN
+    SELECT COUNT(*) INTO files FROM pg_ls_dir('pg_biscuit', true, false) AS f
+    WHERE f LIKE '%\_' || (SELECT node FROM biscuit_map_nodes) || '.%';
+    
+    IF files = 0 THEN
+        RAISE NOTICE '[TEST 12.3] ✓ Dropped index left no mapped file';
+    ELSE
+        RAISE WARNING '[TEST 12.3] ✗ Dropped index left % mapped files', files;
+    END IF;
+END $$;
+
+DROP TABLE biscuit_map_nodes;
+
+-- ============================================================================
+-- TEST 13: Multi-Part Patterns
+-- ============================================================================
+
+DO $$ BEGIN RAISE NOTICE ''; END $$;
+DO $$ BEGIN RAISE NOTICE '[TEST 13] Testing multi-part patterns...'; END $$;
+
+CREATE TABLE biscuit_multipart (id SERIAL PRIMARY KEY, val TEXT);
+INSERT INTO biscuit_multipart (val) VALUES
+    ('ab'), ('xab'), ('abx'), ('axb'), ('abab'), ('aXbXc'), ('cba'), ('a_b'), ('abcabc'), (''),
+    ('aaab'), ('abababx');
+CREATE INDEX idx_multipart_biscuit ON biscuit_multipart USING biscuit(val);
+
+-- Test 13.1: Index results match a sequential scan for anchored and floating parts
+CALL biscuit_check('13.1', 'biscuit_multipart', 'val', ARRAY['LIKE'],
+                   ARRAY['a%b', '%a%b', 'a%b%', '%a%b%c%', 'a%b%c', '%b%a', 'ab%ab', '%a_b%', 'a%%b', '_%b']);
+
+-- Test 13.2: Parts that overlap or repeat, where only some of the positions
+-- a part starts at leave room for the next one
+CALL biscuit_check('13.2', 'biscuit_multipart', 'val', ARRAY['LIKE'],
+                   ARRAY['%a%ab', 'a%ab%ab%', '%ab%ab%ab%', '%aa%ab', 'a%b_c', '%_b%a', 'ab%b%x']);
+
+DROP TABLE biscuit_multipart;
+
+-- ============================================================================
+-- TEST 14: N-gram Layer
+-- ============================================================================
+
+DO $$ BEGIN RAISE NOTICE ''; END $$;
+DO $$ BEGIN RAISE NOTICE '[TEST 14] Testing ngram = 3...'; END $$;
+
+CREATE INDEX idx_email_ngram ON biscuit_test USING biscuit(email) WITH (ngram = 3);
+
+-- Test 14.1: Trigram windows give the same rows as a sequential scan
+CALL biscuit_check('14.1', 'biscuit_test', 'email', ARRAY['LIKE'],
+                   ARRAY['%example.com%', '%user_@%', 'user%', '%@%.%', '%ex%ple%']);
+
+DROP INDEX idx_email_ngram;
+
+-- Test 14.2: Bigram windows, with parts shorter than a window and
+-- '_' splitting a part into pieces
+CREATE INDEX idx_email_ngram ON biscuit_test USING biscuit(email) WITH (ngram = 2);
+CALL biscuit_check('14.2', 'biscuit_test', 'email', ARRAY['LIKE'],
+                   ARRAY['%example.com%', '%e%', '%m_x%', '%@e_a%', '%.c_m', 'a%e%m%']);
+
+DROP INDEX idx_email_ngram;
+
+-- ============================================================================
+-- TEST 15: TID Keys
+-- ============================================================================
+
+DO $$ BEGIN RAISE NOTICE ''; END $$;
+DO $$ BEGIN RAISE NOTICE '[TEST 15] Testing keys = tid...'; END $$;
+
+CREATE INDEX idx_username_tid ON biscuit_test USING biscuit(username) WITH (keys = tid);
+
+-- Test 15.1: TID-keyed index returns the same rows as a sequential scan,
+-- before and after updates add new row versions
+CALL biscuit_check('15.1', 'biscuit_test', 'username', ARRAY['LIKE'], ARRAY['%user%', '%_tid']);
+UPDATE biscuit_test SET username = username || '_tid' WHERE id % 5 = 0;
+CALL biscuit_check('15.1', 'biscuit_test', 'username', ARRAY['LIKE'], ARRAY['%user%', '%_tid']);
+
+-- Test 15.2: VACUUM removes dead TIDs, and rows inserted afterwards may
+-- reuse their line pointers
+DELETE FROM biscuit_test WHERE id % 11 = 0;
+VACUUM biscuit_test;
+INSERT INTO biscuit_test (username, email, status)
+SELECT 'reused_' || g, 'reused_' || g || '@example.com', 'active' FROM generate_series(1, 20) g;
+CALL biscuit_check('15.2', 'biscuit_test', 'username', ARRAY['LIKE'], ARRAY['%user%', '%_tid', 'reused\_%']);
+
+DROP INDEX idx_username_tid;
+
+-- ============================================================================
+-- TEST 16: Index-Only Scans
+-- ============================================================================
+
+DO $$ BEGIN RAISE NOTICE ''; END $$;
+DO $$ BEGIN RAISE NOTICE '[TEST 16] Testing index-only scans...'; END $$;
+
+VACUUM biscuit_test;
+
+-- Test 16.1: Values returned by the index match the heap
+DO $$
+DECLARE
+    plan TEXT;
+    index_only BOOLEAN := false;
+    seq_values TEXT[];
+    idx_values TEXT[];
+BEGIN
+    SET enable_indexscan = OFF;
+    SET enable_bitmapscan = OFF;
+    SELECT array_agg(username ORDER BY username) INTO seq_values
+    FROM biscuit_test WHERE username LIKE '%user%';
+    SET enable_indexscan = ON;
+    SET enable_bitmapscan = ON;
+    
+    SET enable_seqscan = OFF;
+    SET enable_bitmapscan = OFF;
+    FOR plan IN EXPLAIN SELECT username FROM biscuit_test WHERE username LIKE '%user%' LOOP
+        index_only := index_only OR plan LIKE '%Index Only Scan%';
+    END LOOP;
+    IF index_only THEN
+        RAISE NOTICE '[TEST 16.1] ✓ Planner chose an index-only scan';
+    ELSE
+        RAISE WARNING '[TEST 16.1] ✗ Plan has no Index Only Scan node';
+    END IF;
+    SELECT array_agg(username ORDER BY username) INTO idx_values
+    FROM biscuit_test WHERE username LIKE '%user%';
+    SET enable_seqscan = ON;
+    SET enable_bitmapscan = ON;
+    
+    IF seq_values IS NOT DISTINCT FROM idx_values THEN
+        RAISE NOTICE '[TEST 16.1] ✓ Index-only scan returned % matching values', coalesce(array_length(idx_values, 1), 0);
+    ELSE
+        RAISE WARNING '[TEST 16.1] ✗ Index-only scan values differ from sequential scan';
+    END IF;
+END $$;
+
+-- Test 16.2: Rows deleted but not yet vacuumed are not returned
+DO $$
+DECLARE
+    seq_values TEXT[];
+    idx_values TEXT[];
+BEGIN
+    DELETE FROM biscuit_test WHERE username LIKE 'user_%' AND id % 2 = 0;
+    
+    SET enable_indexscan = OFF;
+    SET enable_bitmapscan = OFF;
+    SELECT array_agg(username ORDER BY username) INTO seq_values
+    FROM biscuit_test WHERE username LIKE '%user%';
+    SET enable_indexscan = ON;
+    
+    SET enable_seqscan = OFF;
+    SELECT array_agg(username ORDER BY username) INTO idx_values
+    FROM biscuit_test WHERE username LIKE '%user%';
+    SET enable_seqscan = ON;
+    SET enable_bitmapscan = ON;
+    
+    IF seq_values IS NOT DISTINCT FROM idx_values THEN
+        RAISE NOTICE '[TEST 16.2] ✓ Index-only scan skipped dead rows (% values)', coalesce(array_length(idx_values, 1), 0);
+    ELSE
+        RAISE WARNING '[TEST 16.2] ✗ Index-only scan values differ from sequential scan after DELETE';
+    END IF;
+END $$;
+
+-- Test 16.3: Values too large for an index tuple come back whole
+CREATE TABLE biscuit_ios_large (id SERIAL PRIMARY KEY, val TEXT);
+ALTER TABLE biscuit_ios_large ALTER COLUMN val SET STORAGE EXTERNAL;
+INSERT INTO biscuit_ios_large (val) VALUES
+    ('short'), ('large_' || REPEAT('x', 20000)), ('large_' || REPEAT('y', 9000) || 'z');
+CREATE INDEX idx_ios_large_biscuit ON biscuit_ios_large USING biscuit(val);
+VACUUM biscuit_ios_large;
+
+DO $$
+DECLARE
+    idx_values TEXT[];
+BEGIN
+    SET enable_seqscan = OFF;
+    SET enable_bitmapscan = OFF;
+    SELECT array_agg(val ORDER BY val) INTO idx_values FROM biscuit_ios_large WHERE val LIKE 'large%';
+    SET enable_seqscan = ON;
+    SET enable_bitmapscan = ON;
+    
+    IF idx_values IS NOT DISTINCT FROM ARRAY['large_' || REPEAT('x', 20000), 'large_' || REPEAT('y', 9000) || 'z'] THEN
+        RAISE NOTICE '[TEST 16.3] ✓ Index-only scan returned values of % and % bytes',
+            length(idx_values[1]), length(idx_values[2]);
+    ELSE
+        RAISE WARNING '[TEST 16.3] ✗ Index-only scan values differ for large strings';
+    END IF;
+END $$;
+
+DROP TABLE biscuit_ios_large;
+
+-- ============================================================================
+-- TEST 17: biscuit_count
+-- ============================================================================
+
+DO $$ BEGIN RAISE NOTICE ''; END $$;
+DO $$ BEGIN RAISE NOTICE '[TEST 17] Testing biscuit_count...'; END $$;
+
+-- Test 17.1: Visible-only counts match count(*) for several patterns,
+-- including escaped ones the index has to recheck
+DO $$
+DECLARE
+    patterns TEXT[] := ARRAY['%user%', 'user_1%', '%@%', '%_tid', 'nomatch%', 'user\_1%', '%\_tid', 'a\%%'];
+    p TEXT;
+    seq_count BIGINT;
+    idx_count BIGINT;
+    failures INT := 0;
+BEGIN
+    DELETE FROM biscuit_test WHERE id % 7 = 0;
+    
+    FOREACH p IN ARRAY patterns LOOP
+        SET enable_indexscan = OFF;
+        SET enable_bitmapscan = OFF;
+        SELECT COUNT(*) INTO seq_count FROM biscuit_test WHERE username LIKE p;
+        SET enable_indexscan = ON;
+        SET enable_bitmapscan = ON;
+        
+        idx_count := biscuit_count('idx_username_biscuit', p, true);
+        
+        IF seq_count <> idx_count THEN
+            RAISE WARNING '[TEST 17.1] ✗ Pattern %: biscuit_count %, count(*) %', p, idx_count, seq_count;
+            failures := failures + 1;
+        END IF;
+    END LOOP;
+    
+    IF failures = 0 THEN
+        RAISE NOTICE '[TEST 17.1] ✓ All % patterns match count(*)', array_length(patterns, 1);
+    END IF;
+END $$;
+
+-- Test 17.2: The raw count includes dead row versions not yet vacuumed
+DO $$
+DECLARE
+    raw_count BIGINT;
+    visible_count BIGINT;
+BEGIN
+    raw_count := biscuit_count('idx_username_biscuit', '%user%');
+    visible_count := biscuit_count('idx_username_biscuit', '%user%', true);
+    
+    IF raw_count >= visible_count THEN
+        RAISE NOTICE '[TEST 17.2] ✓ Raw count % covers visible count %', raw_count, visible_count;
+    ELSE
+        RAISE WARNING '[TEST 17.2] ✗ Raw count % below visible count %', raw_count, visible_count;
+    END IF;
+END $$;
+
+-- ============================================================================
+-- TEST 18: ILIKE
+-- ============================================================================
+
+DO $$ BEGIN RAISE NOTICE ''; END $$;
+DO $$ BEGIN RAISE NOTICE '[TEST 18] Testing ILIKE...'; END $$;
+
+-- KELVIN SIGN and U+0130 lower to ASCII letters outside the C collation
+INSERT INTO biscuit_test (username, email, status) VALUES
+    ('MixedCase_User', 'Mixed@Example.COM', 'active'),
+    ('ADMIN_upper', 'ADMIN@EXAMPLE.COM', 'active'),
+    (U&'\212Aelvin', U&'\212Aelvin@example.com', 'active'),
+    (U&'\0130stanbul', U&'\0130stanbul@example.com', 'active'),
+    ('émile', 'Émile@example.com', 'active');
+
+CREATE INDEX idx_email_casefold ON biscuit_test USING biscuit(email) WITH (casefold = on);
+
+-- Test 18.1: ILIKE matches a sequential scan, rechecked on username and
+-- case-folded on email
+CALL biscuit_check('18.1', 'biscuit_test', 'username', ARRAY['ILIKE'],
+                   ARRAY['%ADMIN%', 'mixed%', '%@example.com', '%E_A%P%', 'M%', '%nomatch%',
+                         'kelvin%', '%K%', 'istanbul%', '_stanbul%', '_mile%', 'ÉMILE%', 'a\_%']);
+CALL biscuit_check('18.1', 'biscuit_test', 'email', ARRAY['ILIKE'],
+                   ARRAY['%ADMIN%', 'mixed%', '%@example.com', '%E_A%P%', 'M%', '%nomatch%',
+                         'kelvin%', '%K%', 'istanbul%', '_stanbul%', '_mile%', 'ÉMILE%', 'a\_%']);
+
+DROP INDEX idx_email_casefold;
+
+-- Test 18.2: Characters past the 256 indexed bytes, with and without the
+-- case-folded layer
+CREATE TABLE biscuit_ilike_long (id SERIAL PRIMARY KEY, val TEXT);
+INSERT INTO biscuit_ilike_long (val) VALUES
+    ('xyz'), ('Admin'), (REPEAT('a', 300) || 'XYZ'), (REPEAT('b', 254) || 'QUux'), (REPEAT('c', 280));
+CREATE INDEX idx_ilike_long_biscuit ON biscuit_ilike_long USING biscuit(val);
+CALL biscuit_check('18.2', 'biscuit_ilike_long', 'val', ARRAY['ILIKE'],
+                   ARRAY['%xyz', '%Q%', '%quux', 'b%x', '%c', 'admin']);
+DROP INDEX idx_ilike_long_biscuit;
+CREATE INDEX idx_ilike_long_casefold ON biscuit_ilike_long USING biscuit(val) WITH (casefold = on);
+CALL biscuit_check('18.2', 'biscuit_ilike_long', 'val', ARRAY['ILIKE'],
+                   ARRAY['%xyz', '%Q%', '%quux', 'b%x', '%c', 'admin']);
+DROP TABLE biscuit_ilike_long;
+
+-- ============================================================================
+-- TEST 19: Multiple Scan Keys
+-- ============================================================================
+
+DO $$ BEGIN RAISE NOTICE ''; END $$;
+DO $$ BEGIN RAISE NOTICE '[TEST 19] Testing several conditions on one index...'; END $$;
+
+-- Test 19.1: AND of LIKE and ILIKE conditions matches a sequential scan
+CALL biscuit_check('19.1', 'biscuit_test', 'username', ARRAY['LIKE', 'ILIKE'], ARRAY['%user%', 'admin%'],
+                   $q$username LIKE '%1%' AND username ILIKE '%0%'$q$);
+
+-- Test 19.2: A condition no row satisfies empties the result
+DO $$
+DECLARE
+    idx_count INT;
+BEGIN
+    SET enable_seqscan = OFF;
+    SELECT COUNT(*) INTO idx_count FROM biscuit_test
+    WHERE username LIKE '%user%' AND username LIKE '%nomatch_anywhere%';
+    SET enable_seqscan = ON;
+    
+    IF idx_count = 0 THEN
+        RAISE NOTICE '[TEST 19.2] ✓ Contradictory conditions return no rows';
+    ELSE
+        RAISE WARNING '[TEST 19.2] ✗ Contradictory conditions returned % rows', idx_count;
+    END IF;
+END $$;
+
+-- Test 19.3: Keys of every operator on one index, ordered rarest first
+CALL biscuit_check('19.3', 'biscuit_test', 'username', ARRAY['LIKE', 'NOT LIKE'], ARRAY['%user%', '%9%'],
+                   $q$username ILIKE '%USER%' AND username NOT ILIKE '%_TID' AND username ~ '[0-9]$'$q$);
+
+-- ============================================================================
+-- TEST 20: LIKE ANY
+-- ============================================================================
+
+DO $$ BEGIN RAISE NOTICE ''; END $$;
+DO $$ BEGIN RAISE NOTICE '[TEST 20] Testing LIKE ANY (array)...'; END $$;
+
+-- Test 20.1: Array keys match a sequential scan, with duplicates, NULLs and misses
+CALL biscuit_check('20.1', 'biscuit_test', 'username', ARRAY['LIKE ANY', 'ILIKE ANY'],
+                   ARRAY['{admin%,%_tid,admin%,NULL,%zzz_never%,user_1%}', '{%ADMIN%,MIXED%}']);
+
+-- Test 20.2: ILIKE ANY combined with a plain condition
+CALL biscuit_check('20.2', 'biscuit_test', 'username', ARRAY['ILIKE ANY'], ARRAY['{%ADMIN%,MIXED%}'],
+                   $q$username LIKE '%_%'$q$);
+
+-- Test 20.3: Arrays of negated patterns and regular expressions
+CALL biscuit_check('20.3', 'biscuit_test', 'username', ARRAY['NOT LIKE ANY', '~ ANY', '~* ANY'],
+                   ARRAY['{%user%,admin%}', '{^admin,_tid$,^admin}', '{^MIXED,[0-9]{3}}']);
+
+-- ============================================================================
+-- TEST 21: NOT LIKE
+-- ============================================================================
+
+DO $$ BEGIN RAISE NOTICE ''; END $$;
+DO $$ BEGIN RAISE NOTICE '[TEST 21] Testing NOT LIKE and NOT ILIKE...'; END $$;
+
+-- Test 21.1: Negated patterns match a sequential scan
+CALL biscuit_check('21.1', 'biscuit_test', 'username', ARRAY['NOT LIKE', 'NOT ILIKE'],
+                   ARRAY['%user%', 'admin%', '%', '%zzz_never%', '%ADMIN%']);
+
+-- Test 21.2: NOT LIKE combined with LIKE, and with another NOT LIKE
+CALL biscuit_check('21.2', 'biscuit_test', 'username', ARRAY['LIKE'], ARRAY['%user%'],
+                   $q$username NOT LIKE '%1%'$q$);
+CALL biscuit_check('21.2', 'biscuit_test', 'username', ARRAY['NOT LIKE', 'NOT ILIKE'], ARRAY['%user%', '%_tid'],
+                   $q$username NOT LIKE '%1%'$q$);
+
+-- ============================================================================
+-- TEST 22: Regular Expressions
+-- ============================================================================
+
+DO $$ BEGIN RAISE NOTICE ''; END $$;
+DO $$ BEGIN RAISE NOTICE '[TEST 22] Testing regular expressions...'; END $$;
+
+-- Test 22.1: ~ and ~* match a sequential scan
+CALL biscuit_check('22.1', 'biscuit_test', 'username', ARRAY['~', '~*'],
+                   ARRAY['^admin', 'user.*1', '^user_[0-9]+$', 'ADMIN', '(foo|admin)', 'e$', '^$',
+                         '[[:digit:]]{2}', '_tid$']);
+
+-- Test 22.2: Matches past the 256 indexed bytes, and across them
+CREATE TABLE biscuit_regex_long (id SERIAL PRIMARY KEY, msg TEXT);
+INSERT INTO biscuit_regex_long (msg) VALUES
+    ('timeout'), ('request timeout'), ('ok'),
+    (REPEAT('x', 300) || ' timeout'), (REPEAT('y', 252) || 'timeout'), (REPEAT('z', 400));
+CREATE INDEX idx_regex_long_biscuit ON biscuit_regex_long USING biscuit(msg);
+CALL biscuit_check('22.2', 'biscuit_regex_long', 'msg', ARRAY['~', '~*'],
+                   ARRAY['timeout', 'TIMEOUT$', '^x+ timeout$', 'y{252}time', 'z$', 'out$']);
+DROP TABLE biscuit_regex_long;
+
+-- ============================================================================
+-- TEST 23: Patterns the Index Cannot Match Exactly
+-- ============================================================================
+
+DO $$ BEGIN RAISE NOTICE ''; END $$;
+DO $$ BEGIN RAISE NOTICE '[TEST 23] Testing escapes, multibyte characters, case folding and long strings...'; END $$;
+
+-- Escapes, '_' over multibyte characters, letters whose case variants are
+-- not ASCII, and strings longer than the 256 indexed bytes.  NULLs are not
+-- indexed and satisfy none of the operators, negated or not.
+CREATE TABLE biscuit_edge (id SERIAL PRIMARY KEY, val TEXT);
+INSERT INTO biscuit_edge (val) VALUES
+    ('a%b'), ('axb'), ('a\b'), ('a_b'), ('é'), ('e'), ('ée'), ('xyz'), ('abxyz'),
+    ('École'), ('école'), ('ECOLE'), (U&'\212Aey'), ('key'), ('KEY'), (U&'\0130z'), ('iz'),
+    (NULL), ('');
+CREATE INDEX idx_edge_biscuit ON biscuit_edge USING biscuit(val);
+
+-- Test 23.1: All four LIKE operators match a sequential scan, before and
+-- after strings longer than the indexed prefix arrive
+DO $$ BEGIN RAISE NOTICE '[TEST 23.1] Short strings only'; END $$;
+CALL biscuit_check('23.1', 'biscuit_edge', 'val', ARRAY['LIKE', 'NOT LIKE', 'ILIKE', 'NOT ILIKE'],
+                   ARRAY['a\%b', 'a\_b', 'a\\b', '_', '__', '%_e', '%xyz', 'a%', '%b%',
+                         'école', '_cole', 'ÉCOLE%', 'key', '_ey', '%Y', 'iz', '_z']);
+INSERT INTO biscuit_edge (val) VALUES
+    (REPEAT('a', 297) || 'xyz'), (REPEAT('b', 300)), (REPEAT('é', 200) || 'KEY');
+DO $$ BEGIN RAISE NOTICE '[TEST 23.1] With strings over 256 bytes'; END $$;
+CALL biscuit_check('23.1', 'biscuit_edge', 'val', ARRAY['LIKE', 'NOT LIKE', 'ILIKE', 'NOT ILIKE'],
+                   ARRAY['a\%b', 'a\_b', 'a\\b', '_', '__', '%_e', '%xyz', 'a%', '%b%',
+                         'école', '_cole', 'ÉCOLE%', 'key', '_ey', '%Y', '%key', 'b%b', REPEAT('_', 300)]);
+
+-- Test 23.2: The same through the case-folded layer
+DROP INDEX idx_edge_biscuit;
+CREATE INDEX idx_edge_casefold ON biscuit_edge USING biscuit(val) WITH (casefold = on);
+CALL biscuit_check('23.2', 'biscuit_edge', 'val', ARRAY['ILIKE', 'NOT ILIKE'],
+                   ARRAY['a\_b', '_', '%xyz', 'école', '_cole', 'ÉCOLE%', 'key', '_ey', '%Y', '%key', 'iz', '_z']);
+
+DROP TABLE biscuit_edge;
+
+-- ============================================================================
+-- TEST 24: Parallel Builds
+-- ============================================================================
+
+DO $$ BEGIN RAISE NOTICE ''; END $$;
+DO $$ BEGIN RAISE NOTICE '[TEST 24] Testing parallel builds...'; END $$;
+
+CREATE TABLE biscuit_build (id SERIAL PRIMARY KEY, val TEXT);
+INSERT INTO biscuit_build (val)
+SELECT CASE WHEN g % 3 = 0 THEN 'user_' ELSE 'item-' END || md5(g::text) || REPEAT('x', g % 40)
+FROM generate_series(1, 100000) g;
+ALTER TABLE biscuit_build SET (parallel_workers = 2);
+ANALYZE biscuit_build;
+
+-- Test 24.1: Parallel build; each worker needs 32MB of maintenance_work_mem
+SET max_parallel_maintenance_workers = 2;
+SET maintenance_work_mem = '256MB';
+CREATE INDEX idx_build_biscuit ON biscuit_build USING biscuit(val);
+RESET maintenance_work_mem;
+RESET max_parallel_maintenance_workers;
+
+CALL biscuit_check('24.1', 'biscuit_build', 'val', ARRAY['LIKE', 'NOT LIKE', 'ILIKE'],
+                   ARRAY['user\_%', '%ab%', '%0_x%', '%xx', 'item-f%', '%ITEM%']);
+
+-- Test 24.2: An index scan returns rows in heap TID order
+DO $$
+DECLARE
+    seq_tids TID[];
+    idx_tids TID[];
+BEGIN
+    SET enable_indexscan = OFF;
+    SET enable_bitmapscan = OFF;
+    SELECT array_agg(ctid ORDER BY ctid) INTO seq_tids FROM biscuit_build WHERE val LIKE '%ab%';
+    SET enable_indexscan = ON;
+    
+    SET enable_seqscan = OFF;
+    SET max_parallel_workers_per_gather = 0;
+    SELECT array_agg(s.ctid) INTO idx_tids
+    FROM (SELECT ctid FROM biscuit_build WHERE val LIKE '%ab%') s;
+    RESET max_parallel_workers_per_gather;
+    SET enable_seqscan = ON;
+    SET enable_bitmapscan = ON;
+    
+    IF seq_tids IS NOT DISTINCT FROM idx_tids THEN
+        RAISE NOTICE '[TEST 24.2] ✓ Parallel build returned % rows in heap order', coalesce(array_length(idx_tids, 1), 0);
+    ELSE
+        RAISE WARNING '[TEST 24.2] ✗ Parallel build returned rows out of heap order';
+    END IF;
+END $$;
+
+DROP INDEX idx_build_biscuit;
+
+-- ============================================================================
+-- TEST 25: External Builds
+-- ============================================================================
+
+DO $$ BEGIN RAISE NOTICE ''; END $$;
+DO $$ BEGIN RAISE NOTICE '[TEST 25] Testing external builds...'; END $$;
+
+-- Test 25.1: External build, forced by a heap larger than maintenance_work_mem
+SET maintenance_work_mem = '1MB';
+CREATE INDEX idx_build_biscuit ON biscuit_build USING biscuit(val);
+RESET maintenance_work_mem;
+
+CALL biscuit_check('25.1', 'biscuit_build', 'val', ARRAY['LIKE', 'NOT LIKE', 'ILIKE'],
+                   ARRAY['user\_%', '%ab%', '%0_x%', '%xx', 'item-f%', '%ITEM%']);
+
+-- Test 25.2: An index scan returns rows in heap TID order
+DO $$
+DECLARE
+    seq_tids TID[];
+    idx_tids TID[];
+BEGIN
+    SET enable_indexscan = OFF;
+    SET enable_bitmapscan = OFF;
+    SELECT array_agg(ctid ORDER BY ctid) INTO seq_tids FROM biscuit_build WHERE val LIKE '%ab%';
+    SET enable_indexscan = ON;
+    
+    SET enable_seqscan = OFF;
+    SET max_parallel_workers_per_gather = 0;
+    SELECT array_agg(s.ctid) INTO idx_tids
+    FROM (SELECT ctid FROM biscuit_build WHERE val LIKE '%ab%') s;
+    RESET max_parallel_workers_per_gather;
+    SET enable_seqscan = ON;
+    SET enable_bitmapscan = ON;
+    
+    IF seq_tids IS NOT DISTINCT FROM idx_tids THEN
+        RAISE NOTICE '[TEST 25.2] ✓ External build returned % rows in heap order', coalesce(array_length(idx_tids, 1), 0);
+    ELSE
+        RAISE WARNING '[TEST 25.2] ✗ External build returned rows out of heap order';
+    END IF;
+END $$;
+
+-- ============================================================================
+-- TEST 26: Reloads and Compaction
+-- ============================================================================
+
+DO $$ BEGIN RAISE NOTICE ''; END $$;
+DO $$ BEGIN RAISE NOTICE '[TEST 26] Testing reloads and compaction...'; END $$;
+
+-- Test 26.1: A new session loads the index from its pages
+\c
+CALL biscuit_check('26.1', 'biscuit_build', 'val', ARRAY['LIKE', 'NOT LIKE'],
+                   ARRAY['user\_%', '%ab%', '%0_x%', '%xx']);
+
+-- Test 26.2: VACUUM folds a large change log into a new snapshot; rewriting
+-- most rows logs more than a quarter of the snapshot
+CREATE TEMP TABLE biscuit_build_gen AS
+    SELECT substring(biscuit_index_stats('idx_build_biscuit'::regclass::oid)
+                     FROM 'Generation: (\d+)')::INT AS generation;
+UPDATE biscuit_build SET val = 'moved_' || val WHERE id % 10 <> 1;
+DELETE FROM biscuit_build WHERE id % 10 = 1;
+INSERT INTO biscuit_build (val) SELECT 'late_' || md5(g::text) FROM generate_series(1, 5000) g;
+VACUUM biscuit_build;
+
+DO $$
+DECLARE
+    stats TEXT := biscuit_index_stats('idx_build_biscuit'::regclass::oid);
+    old_generation INT;
+    generation INT := substring(stats FROM 'Generation: (\d+)')::INT;
+    log_pages INT := substring(stats FROM 'Change log: (\d+) pages')::INT;
+BEGIN
+    SELECT g.generation INTO old_generation FROM biscuit_build_gen g;
+    
+    IF generation > old_generation AND log_pages = 0 THEN
+        RAISE NOTICE '[TEST 26.2] ✓ VACUUM wrote generation % with an empty change log', generation;
+    ELSE
+        RAISE WARNING '[TEST 26.2] ✗ Generation % -> %, % change-log pages left', old_generation, generation, log_pages;
+    END IF;
+END $$;
+
+CALL biscuit_check('26.2', 'biscuit_build', 'val', ARRAY['LIKE', 'NOT LIKE', 'ILIKE'],
+                   ARRAY['user\_%', 'moved\_user\_%', 'late\_%', '%ab%', '%xx', '%MOVED%']);
+
+-- Test 26.3: The compacted snapshot reloads in a new session
+\c
+CALL biscuit_check('26.3', 'biscuit_build', 'val', ARRAY['LIKE', 'NOT LIKE'],
+                   ARRAY['user\_%', 'moved\_user\_%', 'late\_%', '%ab%', '%xx']);
+
+DROP TABLE biscuit_build;
+
 -- ============================================================================
 -- FINAL SUMMARY
 -- ============================================================================